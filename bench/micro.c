@@ -0,0 +1,491 @@
+// Micro-benchmarks of the runtime primitives, linked against the
+// interpreter sources:
+//
+//     micro [--perf] [--samples N] [--filter NAME]
+//
+// Every benchmark is warmed up, then timed over several samples of enough
+// operations to fill SAMPLE_NS each. One CSV line per benchmark reports
+// the median time per operation, cycles per operation from rdtsc where
+// available, throughput for the benchmarks that consume or produce text,
+// and with --perf cache misses and branch mispredicts per operation from
+// perf_event_open.
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "lval.h"
+#include "parser.h"
+#include "dyn_string.h"
+#include "utils.h"
+#include "interp.h"
+
+#define WARMUP_NS 50e6
+#define SAMPLE_NS 20e6
+#define DEFAULT_SAMPLES 10
+
+typedef struct {
+    const char *name;
+    long size;
+    void *(*setup)(long size);
+    // Runs one operation, returning the bytes it read or wrote, if any
+    size_t (*run)(void *state);
+    void (*teardown)(void *state);
+} micro;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Keeps results alive so the compiler cannot drop the work
+static volatile uintptr_t sink;
+
+// Hardware counters, -1 when unavailable
+static int perf_cache_fd = -1;
+static int perf_branch_fd = -1;
+
+#ifdef __linux__
+static int perf_open(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_init(void) {
+    perf_cache_fd = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    perf_branch_fd = perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+    if (perf_cache_fd < 0 || perf_branch_fd < 0) {
+        fprintf(stderr, "micro: hardware counters unavailable, see perf_event_paranoid\n");
+    }
+}
+
+static void perf_start(int fd) {
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static long long perf_stop(int fd) {
+    long long count = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = -1;
+        }
+    }
+    return count;
+}
+#else
+static void perf_init(void) {
+    fprintf(stderr, "micro: hardware counters need Linux\n");
+}
+
+static void perf_start(UNUSED int fd) {}
+
+static long long perf_stop(UNUSED int fd) {
+    return -1;
+}
+#endif
+
+// Builds a Q-expression tree of the given depth, four children per node
+// and integer, string and double leaves
+static lval *make_tree(int depth, long *n) {
+    if (depth == 0) {
+        (*n)++;
+        switch (*n % 3) {
+            case 0: return lval_int(*n);
+            case 1: return lval_string("leaf");
+            default: return lval_double(*n * 0.5);
+        }
+    }
+
+    lval *v = lval_qexpr();
+    for (int i = 0; i < 4; i++) {
+        lval_expr_push_back(&v->qexpr, make_tree(depth - 1, n));
+    }
+    return v;
+}
+
+// lenv_lookup of the last binding in a scope of `size` bindings
+
+typedef struct {
+    lenv *env;
+    char key[32];
+} lookup_state;
+
+static void *lookup_setup(long size) {
+    lookup_state *s = malloc(sizeof(lookup_state));
+    s->env = lenv_new();
+    for (long i = 0; i < size; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "binding-%ld", i);
+        lval *v = lval_int(i);
+        lenv_put(s->env, name, v, false);
+        lval_del(v);
+    }
+    snprintf(s->key, sizeof(s->key), "binding-%ld", size - 1);
+    return s;
+}
+
+static size_t lookup_run(void *state) {
+    lookup_state *s = state;
+    sink = (uintptr_t)lenv_lookup(s->env, s->key);
+    return 0;
+}
+
+static void lookup_teardown(void *state) {
+    lookup_state *s = state;
+    lenv_del(s->env);
+    free(s);
+}
+
+// lval_copy and lval_del of a tree of the given depth
+
+static void *tree_setup(long size) {
+    long n = 0;
+    return make_tree((int)size, &n);
+}
+
+static size_t copy_run(void *state) {
+    lval *x = lval_copy(state);
+    sink = (uintptr_t)x;
+    lval_del(x);
+    return 0;
+}
+
+static void tree_teardown(void *state) {
+    lval_del(state);
+}
+
+// lval_eq of two equal trees, which has to visit every node
+
+typedef struct {
+    lval *a;
+    lval *b;
+} eq_state;
+
+static void *eq_setup(long size) {
+    eq_state *s = malloc(sizeof(eq_state));
+    long n = 0;
+    s->a = make_tree((int)size, &n);
+    s->b = lval_copy(s->a);
+    return s;
+}
+
+static size_t eq_run(void *state) {
+    eq_state *s = state;
+    sink = lval_eq(s->a, s->b);
+    return 0;
+}
+
+static void eq_teardown(void *state) {
+    eq_state *s = state;
+    lval_del(s->a);
+    lval_del(s->b);
+    free(s);
+}
+
+// `size` lval_expr_push_back calls, then popping every cell off the front
+// (the way builtins consume their arguments) or off the back
+
+static void *push_setup(long size) {
+    long *n = malloc(sizeof(long));
+    *n = size;
+    return n;
+}
+
+static lval *push_fill(long n) {
+    lval *v = lval_sexpr();
+    for (long i = 0; i < n; i++) {
+        lval_expr_push_back(&v->sexpr, lval_int(i));
+    }
+    return v;
+}
+
+static size_t push_pop_front_run(void *state) {
+    lval *v = push_fill(*(long *)state);
+    while (v->sexpr.count > 0) {
+        lval_del(lval_expr_pop(&v->sexpr, 0));
+    }
+    lval_del(v);
+    return 0;
+}
+
+static size_t push_pop_back_run(void *state) {
+    lval *v = push_fill(*(long *)state);
+    while (v->sexpr.count > 0) {
+        lval_del(lval_expr_pop(&v->sexpr, v->sexpr.count - 1));
+    }
+    lval_del(v);
+    return 0;
+}
+
+static void push_teardown(void *state) {
+    free(state);
+}
+
+// parse_expr of `size` KB of generated source
+
+typedef struct {
+    char *src;
+    size_t len;
+} parse_state;
+
+static void *parse_setup(long size) {
+    parse_state *s = malloc(sizeof(parse_state));
+    dyn_string *out = dyn_string_new();
+    unsigned seed = 1;
+    for (long i = 0; out->len < (size_t)size * 1024; i++) {
+        seed = seed * 1103515245 + 12345;
+        dyn_string_appendf(out, "(fun {f%ld x y} {if (> x %u) {+ x (* y 2.5)} {str-concat \"s%ld\\n\" (g x)}})\n",
+                           i, seed % 1000, i);
+        if (i % 4 == 0) {
+            dyn_string_appendf(out, "; comment %ld\n{1 2 3 {4 5 {6}} sym-%ld -17 \"text\"}\n", i, i);
+        }
+    }
+    s->len = out->len;
+    s->src = malloc(out->len + 1);
+    memcpy(s->src, out->buf, out->len + 1);
+    dyn_string_del(out);
+    return s;
+}
+
+// The same for source laid out like the standard library, whose indents,
+// comments, doc strings and long names take up most of the bytes
+static void *parse_spaced_setup(long size) {
+    parse_state *s = malloc(sizeof(parse_state));
+    dyn_string *out = dyn_string_new();
+    for (long i = 0; out->len < (size_t)size * 1024; i++) {
+        dyn_string_appendf(out, ";;; Folds the list with the function number %ld, starting\n"
+                           ";;; from the accumulator, and returns what is left of it\n"
+                           "(fun {fold-left-with-accumulator-%ld function accumulator list}\n"
+                           "    \"Applies function to the accumulator and each element in turn\"\n"
+                           "    {if (== list nil)\n"
+                           "        {accumulator}\n"
+                           "        {fold-left-with-accumulator-%ld function\n"
+                           "            (function accumulator (first list))\n"
+                           "            (tail list)}})\n\n", i, i, i);
+    }
+    s->len = out->len;
+    s->src = malloc(out->len + 1);
+    memcpy(s->src, out->buf, out->len + 1);
+    dyn_string_del(out);
+    return s;
+}
+
+static size_t parse_run(void *state) {
+    parse_state *s = state;
+    lval *v = lval_sexpr();
+    parse_expr(v, s->src, 0, '\0');
+    sink = (uintptr_t)v->sexpr.count;
+    lval_del(v);
+    return s->len;
+}
+
+static void parse_teardown(void *state) {
+    parse_state *s = state;
+    free(s->src);
+    free(s);
+}
+
+// lval_print of a tree into the interpreter's output, which is discarded
+
+typedef struct {
+    lval *v;
+    size_t len;
+} print_state;
+
+static void *print_setup(long size) {
+    print_state *s = malloc(sizeof(print_state));
+    long n = 0;
+    s->v = make_tree((int)size, &n);
+    dyn_string *out = dyn_string_new();
+    lval_write(out, s->v);
+    s->len = out->len;
+    dyn_string_del(out);
+    return s;
+}
+
+static size_t print_run(void *state) {
+    print_state *s = state;
+    lval_print(s->v);
+    return s->len;
+}
+
+static void print_teardown(void *state) {
+    print_state *s = state;
+    lval_del(s->v);
+    free(s);
+}
+
+static const micro micros[] = {
+    { "lenv_lookup", 8, lookup_setup, lookup_run, lookup_teardown },
+    { "lenv_lookup", 64, lookup_setup, lookup_run, lookup_teardown },
+    { "lenv_lookup", 512, lookup_setup, lookup_run, lookup_teardown },
+    { "lval_copy", 2, tree_setup, copy_run, tree_teardown },
+    { "lval_copy", 4, tree_setup, copy_run, tree_teardown },
+    { "lval_copy", 6, tree_setup, copy_run, tree_teardown },
+    { "push_pop_front", 16, push_setup, push_pop_front_run, push_teardown },
+    { "push_pop_front", 1024, push_setup, push_pop_front_run, push_teardown },
+    { "push_pop_back", 16, push_setup, push_pop_back_run, push_teardown },
+    { "push_pop_back", 1024, push_setup, push_pop_back_run, push_teardown },
+    { "parse_expr", 64, parse_setup, parse_run, parse_teardown },
+    { "parse_expr", 1024, parse_setup, parse_run, parse_teardown },
+    { "parse_expr_spaced", 64, parse_spaced_setup, parse_run, parse_teardown },
+    { "parse_expr_spaced", 1024, parse_spaced_setup, parse_run, parse_teardown },
+    { "lval_eq", 4, eq_setup, eq_run, eq_teardown },
+    { "lval_eq", 7, eq_setup, eq_run, eq_teardown },
+    { "lval_print", 4, print_setup, print_run, print_teardown },
+    { "lval_print", 7, print_setup, print_run, print_teardown },
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double run_ops(const micro *m, void *state, long ops, size_t *bytes) {
+    double start = now_ns();
+    for (long i = 0; i < ops; i++) {
+        *bytes += m->run(state);
+    }
+    return now_ns() - start;
+}
+
+static void measure(const micro *m, int samples) {
+    void *state = m->setup(m->size);
+    size_t bytes = 0;
+
+    // Warm up, doubling the batch until one batch fills a sample
+    long ops = 1;
+    double start = now_ns();
+    while (true) {
+        double t = run_ops(m, state, ops, &bytes);
+        if (t >= SAMPLE_NS && now_ns() - start >= WARMUP_NS) {
+            break;
+        }
+        if (t < SAMPLE_NS) {
+            ops *= 2;
+        }
+    }
+
+    double *ns = malloc(sizeof(double) * samples);
+    double *cycles = malloc(sizeof(double) * samples);
+    perf_start(perf_cache_fd);
+    perf_start(perf_branch_fd);
+    for (int i = 0; i < samples; i++) {
+        bytes = 0;
+        uint64_t c0 = now_cycles();
+        double t = run_ops(m, state, ops, &bytes);
+        uint64_t c1 = now_cycles();
+        ns[i] = t / ops;
+        cycles[i] = (double)(c1 - c0) / ops;
+    }
+    long long cache_misses = perf_stop(perf_cache_fd);
+    long long branch_misses = perf_stop(perf_branch_fd);
+
+    qsort(ns, samples, sizeof(double), cmp_double);
+    qsort(cycles, samples, sizeof(double), cmp_double);
+    double total_ops = (double)ops * samples;
+
+    printf("%s,%ld,%ld,%.1f,", m->name, m->size, ops, ns[samples / 2]);
+#ifdef HAVE_RDTSC
+    printf("%.0f,", cycles[samples / 2]);
+#else
+    printf(",");
+#endif
+    if (bytes > 0) {
+        printf("%.1f,", (double)bytes / ops / ns[samples / 2] * 1e9 / (1024 * 1024));
+    } else {
+        printf(",");
+    }
+    if (cache_misses >= 0) {
+        printf("%.2f,", cache_misses / total_ops);
+    } else {
+        printf(",");
+    }
+    if (branch_misses >= 0) {
+        printf("%.2f\n", branch_misses / total_ops);
+    } else {
+        printf("\n");
+    }
+    fflush(stdout);
+
+    free(ns);
+    free(cycles);
+    m->teardown(state);
+}
+
+static void discard(UNUSED void *ud, UNUSED const char *buf, UNUSED size_t len) {}
+
+int main(int argc, char **argv) {
+    bool perf = false;
+    int samples = DEFAULT_SAMPLES;
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf = true;
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--perf] [--samples N] [--filter NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (samples < 1) {
+        samples = 1;
+    }
+    if (perf) {
+        perf_init();
+    }
+
+    clisp_config config = { .write = discard };
+    clisp *c = clisp_new(&config);
+    clisp *prev = clisp_enter(c);
+
+    printf("benchmark,size,ops_per_sample,ns_per_op,cycles_per_op,mb_per_s,"
+           "cache_misses_per_op,branch_misses_per_op\n");
+    for (size_t i = 0; i < sizeof(micros) / sizeof(micros[0]); i++) {
+        if (filter == NULL || strstr(micros[i].name, filter) != NULL) {
+            measure(&micros[i], samples);
+        }
+    }
+
+    clisp_leave(prev);
+    clisp_free(c);
+    return 0;
+}
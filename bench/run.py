@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""Runs the benchmark workloads in bench/ and prints a JSON report.
+
+    bench/run.py [--runs N] [--baseline FILE] [--threshold PCT] CLISP
+
+Every workload is run N times with CLISP from the root of the repository.
+The report holds the median wall time, the peak RSS and the allocation
+counts printed by `--stats` for each workload. The peak RSS is the VmHWM
+that `--stats` reads from /proc just before the interpreter exits: the
+ru_maxrss of wait4 also counts this script's own memory, which the child
+holds until it calls exec. With a baseline (an earlier
+report), workloads whose median time, peak RSS or allocations grew by more
+than the threshold are listed under "regressions" and the exit status is 1.
+"""
+
+import argparse
+import json
+import os
+import random
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(BENCH_DIR)
+
+WORKLOADS = ["startup", "fib", "lists", "lists_stdlib", "recursion", "curry", "parse"]
+
+PARSE_INPUT = os.path.join(BENCH_DIR, "gen", "parse_input.clsp")
+PARSE_FORMS = 40000
+
+METRICS = ["time", "rss_kb", "allocs"]
+
+
+def gen_atom(rng):
+    r = rng.random()
+    if r < 0.3:
+        return str(rng.randint(-10**6, 10**6))
+    if r < 0.45:
+        return "%.3f" % rng.uniform(-1000, 1000)
+    if r < 0.65:
+        chars = "abcdefghij \\"
+        body = "".join(rng.choice(chars) for _ in range(rng.randint(0, 16)))
+        return '"' + body.replace("\\", "\\n") + '"'
+    return rng.choice(["foo", "bar-baz", "x", "map", "+", "nil", "str->num", "&"])
+
+
+def gen_expr(rng, depth):
+    parts = []
+    for _ in range(rng.randint(1, 6)):
+        if depth < 4 and rng.random() < 0.3:
+            parts.append(gen_expr(rng, depth + 1))
+        else:
+            parts.append(gen_atom(rng))
+    if rng.random() < 0.5:
+        return "(" + " ".join(parts) + ")"
+    return "{" + " ".join(parts) + "}"
+
+
+def write_parse_input():
+    """Writes the input of the parse workload, the same on every run."""
+    if os.path.exists(PARSE_INPUT):
+        return
+    os.makedirs(os.path.dirname(PARSE_INPUT), exist_ok=True)
+    rng = random.Random(42)
+    with open(PARSE_INPUT, "w") as f:
+        for i in range(PARSE_FORMS):
+            if i % 10 == 0:
+                f.write("; form %d\n" % i)
+            f.write("{" + gen_expr(rng, 0) + "}\n")
+
+
+def run_once(clisp, workload):
+    """Returns the wall time, peak RSS in KB and --stats counters of one run."""
+    path = os.path.join("bench", workload + ".clsp")
+    with tempfile.TemporaryFile(mode="w+") as err:
+        start = time.perf_counter()
+        proc = subprocess.Popen([clisp, "--stats", path], cwd=ROOT,
+                                stdin=subprocess.DEVNULL,
+                                stdout=subprocess.DEVNULL, stderr=err)
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+
+        err.seek(0)
+        stats = {}
+        for line in err:
+            fields = line.split()
+            if len(fields) == 2 and fields[1].lstrip("-").isdigit():
+                stats[fields[0]] = int(fields[1])
+
+    if proc.returncode != 0:
+        sys.exit("%s failed with status %d" % (workload, proc.returncode))
+    # Without /proc, fall back to wait4's figure, which is too high
+    rss = stats.pop("peak-rss-kb", usage.ru_maxrss)
+    return elapsed, rss, stats
+
+
+def run_workload(clisp, workload, runs):
+    times = []
+    rss = 0
+    stats = {}
+    for _ in range(runs):
+        elapsed, maxrss, stats = run_once(clisp, workload)
+        times.append(elapsed)
+        rss = max(rss, maxrss)
+
+    return {
+        "time": round(statistics.median(times), 4),
+        "times": [round(t, 4) for t in times],
+        "rss_kb": rss,
+        "allocs": stats.get("allocs"),
+        "bytes": stats.get("bytes"),
+        "lvals": stats.get("lvals"),
+    }
+
+
+def find_regressions(report, baseline, threshold):
+    regressions = []
+    for name, res in report["workloads"].items():
+        base = baseline.get("workloads", {}).get(name)
+        if base is None:
+            continue
+        for metric in METRICS:
+            old, new = base.get(metric), res.get(metric)
+            if not old or new is None:
+                continue
+            change = (new - old) / old * 100
+            if change > threshold:
+                regressions.append({
+                    "workload": name,
+                    "metric": metric,
+                    "baseline": old,
+                    "current": new,
+                    "change_pct": round(change, 1),
+                })
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("clisp", help="interpreter to benchmark")
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--baseline", help="earlier report to compare against")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="percent increase reported as a regression")
+    parser.add_argument("--only", action="append", choices=WORKLOADS,
+                        help="run only this workload, may be repeated")
+    args = parser.parse_args()
+
+    clisp = os.path.abspath(args.clisp)
+    write_parse_input()
+
+    report = {"clisp": clisp, "runs": args.runs, "workloads": {}}
+    for workload in args.only or WORKLOADS:
+        report["workloads"][workload] = run_workload(clisp, workload, args.runs)
+
+    failed = False
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        report["threshold_pct"] = args.threshold
+        report["regressions"] = find_regressions(report, baseline, args.threshold)
+        failed = len(report["regressions"]) > 0
+
+    json.dump(report, sys.stdout, indent=2)
+    sys.stdout.write("\n")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Checks that `--serve-timeout` cuts off every kind of runaway request.
+
+    bench/serve_check.py CLISP
+
+Starts CLISP as a server with a short timeout and sends it requests that
+never finish on their own: a Lisp loop, and loops driven from builtins
+(forcing an infinite lazy sequence, transduce over one, a sort comparator
+that never returns). Each must be answered with the timeout status well
+before the deadline below, after which the worker must still answer a
+plain request. The exit status is 1 on the first failure.
+"""
+
+import argparse
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+TIMEOUT_MS = 300
+# A request cut off later than this counts as not cut off at all
+DEADLINE_S = 5
+
+STATUS_OK, STATUS_ERROR, STATUS_TIMEOUT = 0, 1, 2
+
+RUNAWAY = [
+    "(fun {loop n} {loop (+ n 1)}) (loop 0)",
+    "(force (iterate + 1))",
+    "(transduce (xmap +) + 0 (iterate + 1))",
+    "(sort (\\ {a b} {do (force (iterate + 1)) true}) {2 1})",
+]
+
+
+def recv_exactly(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise ConnectionError("server closed the connection")
+        data += chunk
+    return data
+
+
+def request(sock, src):
+    """Sends one request and returns its status and text."""
+    body = src.encode()
+    sock.sendall(struct.pack(">I", len(body)) + body)
+    header = recv_exactly(sock, 5)
+    n = struct.unpack(">I", header[1:])[0]
+    return header[0], recv_exactly(sock, n).decode()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("clisp", help="interpreter to check")
+    args = parser.parse_args()
+
+    path = os.path.join(tempfile.mkdtemp(), "serve.sock")
+    server = subprocess.Popen([os.path.abspath(args.clisp), "--serve", path,
+                               "--serve-workers", "1",
+                               "--serve-timeout", str(TIMEOUT_MS)],
+                              cwd=ROOT, stdin=subprocess.DEVNULL,
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    failed = False
+    try:
+        for _ in range(100):
+            if os.path.exists(path):
+                break
+            time.sleep(0.05)
+
+        sock = socket.socket(socket.AF_UNIX)
+        sock.settimeout(DEADLINE_S)
+        sock.connect(path)
+
+        for src in RUNAWAY:
+            start = time.perf_counter()
+            try:
+                status, text = request(sock, src)
+            except socket.timeout:
+                print("%s: no answer after %ds" % (src, DEADLINE_S))
+                return 1
+            elapsed = time.perf_counter() - start
+            ok = status == STATUS_TIMEOUT
+            failed |= not ok
+            print("%s %s: status %d after %.2fs %s" %
+                  ("ok  " if ok else "FAIL", src, status, elapsed, text.strip()))
+
+        status, text = request(sock, "(+ 1 2)")
+        ok = status == STATUS_OK and text.strip() == "3"
+        failed |= not ok
+        print("%s (+ 1 2): status %d %s" % ("ok  " if ok else "FAIL", status, text.strip()))
+        sock.close()
+    finally:
+        server.send_signal(signal.SIGINT)
+        try:
+            server.wait(DEADLINE_S)
+        except subprocess.TimeoutExpired:
+            server.kill()
+            failed = True
+            print("FAIL server did not shut down")
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,514 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "bignum.h"
+#include "dyn_string.h"
+#include "utils.h"
+#include "interp.h"
+
+// Operands at least this many limbs long are multiplied with Karatsuba
+#define KARATSUBA_MIN 32
+
+// Largest result `^` will build, in limbs
+#define BIG_MAX_LIMBS (1 << 24)
+
+#define DEC_BASE 1000000000u
+#define DEC_DIGITS 9
+
+// Magnitudes are limb arrays with an explicit length. Functions below
+// accept leading zero limbs unless they say otherwise.
+
+static int mag_norm(const uint32_t *a, int n) {
+    while (n > 0 && a[n - 1] == 0) {
+        n--;
+    }
+    return n;
+}
+
+static int mag_cmp(const uint32_t *a, int an, const uint32_t *b, int bn) {
+    an = mag_norm(a, an);
+    bn = mag_norm(b, bn);
+    if (an != bn) {
+        return an < bn ? -1 : 1;
+    }
+    for (int i = an - 1; i >= 0; i--) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// r[0, rn) += a[0, an), where the sum fits in rn limbs
+static void mag_add_into(uint32_t *r, int rn, const uint32_t *a, int an) {
+    uint64_t carry = 0;
+    int i = 0;
+    for (; i < an; i++) {
+        uint64_t s = (uint64_t)r[i] + a[i] + carry;
+        r[i] = (uint32_t)s;
+        carry = s >> 32;
+    }
+    for (; carry != 0 && i < rn; i++) {
+        uint64_t s = (uint64_t)r[i] + carry;
+        r[i] = (uint32_t)s;
+        carry = s >> 32;
+    }
+}
+
+// r[0, rn) -= a[0, an), where r is at least a
+static void mag_sub_into(uint32_t *r, int rn, const uint32_t *a, int an) {
+    int64_t borrow = 0;
+    int i = 0;
+    for (; i < an; i++) {
+        int64_t d = (int64_t)r[i] - a[i] - borrow;
+        r[i] = (uint32_t)d;
+        borrow = d < 0;
+    }
+    for (; borrow != 0 && i < rn; i++) {
+        int64_t d = (int64_t)r[i] - borrow;
+        r[i] = (uint32_t)d;
+        borrow = d < 0;
+    }
+}
+
+static void mag_mul_school(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn) {
+    memset(r, 0, sizeof(uint32_t) * (an + bn));
+    for (int i = 0; i < an; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < bn; j++) {
+            uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+            r[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        r[i + bn] = (uint32_t)carry;
+    }
+}
+
+// r[0, an + bn) = a * b
+static void mag_mul(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn) {
+    if (an < bn) {
+        const uint32_t *t = a; a = b; b = t;
+        int tn = an; an = bn; bn = tn;
+    }
+    if (bn < KARATSUBA_MIN) {
+        mag_mul_school(r, a, an, b, bn);
+        return;
+    }
+
+    int h = an / 2;
+    if (bn <= h) {
+        // b is short: split only a, r = a0 * b + a1 * b * B^h
+        uint32_t *t = lmalloc(sizeof(uint32_t) * (an - h + bn));
+        mag_mul(r, a, h, b, bn);
+        memset(r + h + bn, 0, sizeof(uint32_t) * (an - h));
+        mag_mul(t, a + h, an - h, b, bn);
+        mag_add_into(r + h, an + bn - h, t, an - h + bn);
+        lfree(t);
+        return;
+    }
+
+    // a = a1 * B^h + a0, b = b1 * B^h + b0 and
+    // a * b = z2 * B^2h + ((a0 + a1)(b0 + b1) - z0 - z2) * B^h + z0
+    int an1 = an - h, bn1 = bn - h;
+    mag_mul(r, a, h, b, h);
+    mag_mul(r + 2 * h, a + h, an1, b + h, bn1);
+
+    int sn = an1 + 1;
+    uint32_t *sa = lcalloc(sn, sizeof(uint32_t));
+    uint32_t *sb = lcalloc(sn, sizeof(uint32_t));
+    memcpy(sa, a + h, sizeof(uint32_t) * an1);
+    mag_add_into(sa, sn, a, h);
+    memcpy(sb, b, sizeof(uint32_t) * h);
+    mag_add_into(sb, sn, b + h, bn1);
+
+    uint32_t *z1 = lmalloc(sizeof(uint32_t) * 2 * sn);
+    mag_mul(z1, sa, sn, sb, sn);
+    mag_sub_into(z1, 2 * sn, r, 2 * h);
+    mag_sub_into(z1, 2 * sn, r + 2 * h, an1 + bn1);
+    mag_add_into(r + h, an + bn - h, z1, mag_norm(z1, 2 * sn));
+
+    lfree(sa);
+    lfree(sb);
+    lfree(z1);
+}
+
+// q[0, an) = a / d, returning a % d
+static uint32_t mag_divmod_small(uint32_t *q, const uint32_t *a, int an, uint32_t d) {
+    uint64_t rem = 0;
+    for (int i = an - 1; i >= 0; i--) {
+        uint64_t cur = (rem << 32) | a[i];
+        q[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    return (uint32_t)rem;
+}
+
+// q[0, an - bn + 1) = a / b and r[0, bn) = a % b by Knuth's algorithm D.
+// b must be normalised and an >= bn.
+static void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, int an,
+                       const uint32_t *b, int bn) {
+    if (bn == 1) {
+        r[0] = mag_divmod_small(q, a, an, b[0]);
+        return;
+    }
+
+    // Shift so the divisor's top limb has its high bit set
+    int s = __builtin_clz(b[bn - 1]);
+    uint32_t *vn = lmalloc(sizeof(uint32_t) * bn);
+    uint32_t *un = lmalloc(sizeof(uint32_t) * (an + 1));
+    for (int i = bn - 1; i > 0; i--) {
+        vn[i] = (b[i] << s) | (s ? (uint32_t)((uint64_t)b[i - 1] >> (32 - s)) : 0);
+    }
+    vn[0] = b[0] << s;
+    un[an] = s ? (uint32_t)((uint64_t)a[an - 1] >> (32 - s)) : 0;
+    for (int i = an - 1; i > 0; i--) {
+        un[i] = (a[i] << s) | (s ? (uint32_t)((uint64_t)a[i - 1] >> (32 - s)) : 0);
+    }
+    un[0] = a[0] << s;
+
+    for (int j = an - bn; j >= 0; j--) {
+        uint64_t num = ((uint64_t)un[j + bn] << 32) | un[j + bn - 1];
+        uint64_t qhat = num / vn[bn - 1];
+        uint64_t rhat = num % vn[bn - 1];
+        while (qhat >> 32 || qhat * vn[bn - 2] > ((rhat << 32) | un[j + bn - 2])) {
+            qhat--;
+            rhat += vn[bn - 1];
+            if (rhat >> 32) {
+                break;
+            }
+        }
+
+        int64_t borrow = 0;
+        int64_t t;
+        for (int i = 0; i < bn; i++) {
+            uint64_t p = qhat * vn[i];
+            t = (int64_t)un[i + j] - borrow - (int64_t)(p & 0xffffffffu);
+            un[i + j] = (uint32_t)t;
+            borrow = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)un[j + bn] - borrow;
+        un[j + bn] = (uint32_t)t;
+
+        q[j] = (uint32_t)qhat;
+        if (t < 0) {
+            // qhat was one too large, add the divisor back
+            q[j]--;
+            uint64_t carry = 0;
+            for (int i = 0; i < bn; i++) {
+                uint64_t sum = (uint64_t)un[i + j] + vn[i] + carry;
+                un[i + j] = (uint32_t)sum;
+                carry = sum >> 32;
+            }
+            un[j + bn] += (uint32_t)carry;
+        }
+    }
+
+    for (int i = 0; i < bn - 1; i++) {
+        r[i] = (un[i] >> s) | (s ? (uint32_t)((uint64_t)un[i + 1] << (32 - s)) : 0);
+    }
+    r[bn - 1] = un[bn - 1] >> s;
+
+    lfree(vn);
+    lfree(un);
+}
+
+lbig *lbig_retain(lbig *b) {
+    REF_RETAIN(b);
+    return b;
+}
+
+void lbig_release(lbig *b) {
+    if (REF_RELEASE(b) > 0) {
+        return;
+    }
+    lfree(b);
+}
+
+bool lbig_eq(lbig *a, lbig *b) {
+    return a->neg == b->neg && a->len == b->len &&
+           memcmp(a->limbs, b->limbs, sizeof(uint32_t) * a->len) == 0;
+}
+
+double lbig_to_double(lbig *b) {
+    double x = 0;
+    for (int i = b->len - 1; i >= 0; i--) {
+        x = x * 4294967296.0 + b->limbs[i];
+    }
+    return b->neg ? -x : x;
+}
+
+// An integer argument seen as a sign and magnitude. Fixnums are spread
+// into `buf`, so a view must not be copied.
+typedef struct {
+    bool neg;
+    int len;
+    const uint32_t *d;
+    uint32_t buf[2];
+} bigview;
+
+static void big_view(lval *v, bigview *w) {
+    if (v->type == LVAL_BIGINT) {
+        w->neg = v->big->neg;
+        w->len = v->big->len;
+        w->d = v->big->limbs;
+        return;
+    }
+
+    unsigned long u = v->_int < 0 ? -(unsigned long)v->_int : (unsigned long)v->_int;
+    w->neg = v->_int < 0;
+    w->buf[0] = (uint32_t)u;
+    w->buf[1] = (uint32_t)(u >> 32);
+    w->d = w->buf;
+    w->len = mag_norm(w->buf, 2);
+}
+
+// The integer with the given sign and magnitude: a fixnum if it fits in a
+// long, otherwise a bignum copying d
+static lval *big_make(bool neg, const uint32_t *d, int n) {
+    n = mag_norm(d, n);
+    if (n <= 2) {
+        unsigned long u = n == 0 ? 0 : d[0] | (n == 2 ? (unsigned long)d[1] << 32 : 0);
+        if (u <= LONG_MAX) {
+            return lval_int(neg ? -(long)u : (long)u);
+        }
+        if (neg && u == (unsigned long)LONG_MAX + 1) {
+            return lval_int(LONG_MIN);
+        }
+    }
+
+    lbig *b = lmalloc(sizeof(lbig) + sizeof(uint32_t) * n);
+    b->refs = 1;
+    b->neg = neg;
+    b->len = n;
+    memcpy(b->limbs, d, sizeof(uint32_t) * n);
+
+    lval *v = lval_alloc();
+    v->type = LVAL_BIGINT;
+    v->big = b;
+    return v;
+}
+
+bool lval_is_integer(lval *v) {
+    return v->type == LVAL_INT || v->type == LVAL_BIGINT;
+}
+
+int lval_int_cmp(lval *a, lval *b) {
+    if (a->type == LVAL_INT && b->type == LVAL_INT) {
+        return (a->_int > b->_int) - (a->_int < b->_int);
+    }
+
+    bigview x, y;
+    big_view(a, &x);
+    big_view(b, &y);
+    if (x.neg != y.neg) {
+        return x.neg ? -1 : 1;
+    }
+    int c = mag_cmp(x.d, x.len, y.d, y.len);
+    return x.neg ? -c : c;
+}
+
+// Parses an optionally signed string of decimal digits. Returns NULL if s
+// is not one.
+lval *lval_bigint_parse(const char *s) {
+    bool neg = *s == '-';
+    if (neg) {
+        s++;
+    }
+
+    size_t digits = strlen(s);
+    if (digits == 0 || strspn(s, "0123456789") != digits) {
+        return NULL;
+    }
+
+    int cap = (int)(digits / DEC_DIGITS) + 2;
+    uint32_t *d = lcalloc(cap, sizeof(uint32_t));
+    int n = 0;
+
+    // Consume the digits in chunks of DEC_DIGITS, the first one shorter
+    size_t first = digits % DEC_DIGITS == 0 ? DEC_DIGITS : digits % DEC_DIGITS;
+    for (size_t i = 0; i < digits; i += (i == 0 ? first : DEC_DIGITS)) {
+        size_t len = i == 0 ? first : DEC_DIGITS;
+        uint32_t chunk = 0;
+        uint32_t scale = 1;
+        for (size_t k = 0; k < len; k++) {
+            chunk = chunk * 10 + (s[i + k] - '0');
+            scale *= 10;
+        }
+
+        uint64_t carry = chunk;
+        for (int k = 0; k < n; k++) {
+            uint64_t t = (uint64_t)d[k] * scale + carry;
+            d[k] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        if (carry != 0) {
+            d[n++] = (uint32_t)carry;
+        }
+    }
+
+    lval *res = big_make(neg, d, n);
+    lfree(d);
+    return res;
+}
+
+void lbig_write(struct dyn_string *out, lbig *b) {
+    uint32_t *q = lmalloc(sizeof(uint32_t) * b->len);
+    memcpy(q, b->limbs, sizeof(uint32_t) * b->len);
+
+    // Base 10^9 digits, least significant first
+    uint32_t *chunks = lmalloc(sizeof(uint32_t) * (b->len * 10 / 9 + 2));
+    int count = 0;
+    int n = b->len;
+    while (n > 0) {
+        chunks[count++] = mag_divmod_small(q, q, n, DEC_BASE);
+        n = mag_norm(q, n);
+    }
+
+    if (b->neg) {
+        dyn_string_push(out, '-');
+    }
+    dyn_string_appendf(out, "%u", chunks[count - 1]);
+    for (int i = count - 2; i >= 0; i--) {
+        dyn_string_appendf(out, "%09u", chunks[i]);
+    }
+
+    lfree(chunks);
+    lfree(q);
+}
+
+static lval *big_add(bigview *x, bigview *y, bool negate_y) {
+    bool yneg = y->neg != negate_y;
+    int n = (x->len > y->len ? x->len : y->len) + 1;
+    uint32_t *r = lcalloc(n, sizeof(uint32_t));
+    bool neg;
+
+    if (x->neg == yneg) {
+        memcpy(r, x->d, sizeof(uint32_t) * x->len);
+        mag_add_into(r, n, y->d, y->len);
+        neg = x->neg;
+    } else if (mag_cmp(x->d, x->len, y->d, y->len) >= 0) {
+        memcpy(r, x->d, sizeof(uint32_t) * x->len);
+        mag_sub_into(r, n, y->d, y->len);
+        neg = x->neg;
+    } else {
+        memcpy(r, y->d, sizeof(uint32_t) * y->len);
+        mag_sub_into(r, n, x->d, x->len);
+        neg = yneg;
+    }
+
+    lval *res = big_make(neg, r, n);
+    lfree(r);
+    return res;
+}
+
+static lval *big_mul(bigview *x, bigview *y) {
+    if (x->len == 0 || y->len == 0) {
+        return lval_int(0);
+    }
+
+    uint32_t *r = lmalloc(sizeof(uint32_t) * (x->len + y->len));
+    mag_mul(r, x->d, x->len, y->d, y->len);
+    lval *res = big_make(x->neg != y->neg, r, x->len + y->len);
+    lfree(r);
+    return res;
+}
+
+// Truncating division, like C's / and %
+static lval *big_div(bigview *x, bigview *y, bool want_rem) {
+    if (y->len == 0) {
+        return lval_error("division by zero");
+    }
+    if (mag_cmp(x->d, x->len, y->d, y->len) < 0) {
+        return want_rem ? big_make(x->neg, x->d, x->len) : lval_int(0);
+    }
+
+    uint32_t *q = lmalloc(sizeof(uint32_t) * (x->len - y->len + 1));
+    uint32_t *r = lmalloc(sizeof(uint32_t) * y->len);
+    mag_divmod(q, r, x->d, x->len, y->d, y->len);
+
+    lval *res = want_rem
+        ? big_make(x->neg, r, y->len)
+        : big_make(x->neg != y->neg, q, x->len - y->len + 1);
+    lfree(q);
+    lfree(r);
+    return res;
+}
+
+// Exponentiation by squaring
+static lval *big_pow(bigview *x, lval *exp) {
+    bool exp_neg = exp->type == LVAL_BIGINT ? exp->big->neg : exp->_int < 0;
+    if (exp_neg) {
+        return lval_error("Function '^' expects a non-negative integer exponent");
+    }
+
+    // 0, 1 and -1 are the only bases whose powers never grow
+    bool odd = exp->type == LVAL_BIGINT ? exp->big->limbs[0] & 1 : exp->_int & 1;
+    if (x->len == 0) {
+        return lval_int(exp->type == LVAL_INT && exp->_int == 0 ? 1 : 0);
+    }
+    if (x->len == 1 && x->d[0] == 1) {
+        return lval_int(x->neg && odd ? -1 : 1);
+    }
+    if (exp->type == LVAL_BIGINT) {
+        return lval_error("Function '^' result too large");
+    }
+
+    unsigned long e = exp->_int;
+    int bits = (x->len - 1) * 32 + (32 - __builtin_clz(x->d[x->len - 1]));
+    if ((double)bits * e > (double)BIG_MAX_LIMBS * 32) {
+        return lval_error("Function '^' result too large");
+    }
+
+    int cap = (int)(((double)bits * e) / 32) + 2;
+    uint32_t *res = lcalloc(cap, sizeof(uint32_t));
+    uint32_t *base = lcalloc(cap, sizeof(uint32_t));
+    uint32_t *tmp = lmalloc(sizeof(uint32_t) * 2 * cap);
+    int rn = 1, bn = x->len;
+    res[0] = 1;
+    memcpy(base, x->d, sizeof(uint32_t) * x->len);
+
+    for (unsigned long k = e; k > 0; k >>= 1) {
+        if (k & 1) {
+            mag_mul(tmp, res, rn, base, bn);
+            rn = mag_norm(tmp, rn + bn);
+            memcpy(res, tmp, sizeof(uint32_t) * rn);
+        }
+        if (k > 1) {
+            mag_mul(tmp, base, bn, base, bn);
+            bn = mag_norm(tmp, 2 * bn);
+            memcpy(base, tmp, sizeof(uint32_t) * bn);
+        }
+    }
+
+    lval *v = big_make(x->neg && (e & 1), res, rn);
+    lfree(res);
+    lfree(base);
+    lfree(tmp);
+    return v;
+}
+
+// Applies an arithmetic operator to two integers, either of which may be a
+// bignum, consuming both. This is the slow path behind builtin_op for
+// operands or results that do not fit in a long.
+lval *lval_int_arith(char *op, lval *x, lval *y) {
+    bigview a, b;
+    big_view(x, &a);
+    big_view(y, &b);
+
+    lval *res;
+    if (strcmp(op, "+") == 0) { res = big_add(&a, &b, false); }
+    else if (strcmp(op, "-") == 0) { res = big_add(&a, &b, true); }
+    else if (strcmp(op, "*") == 0) { res = big_mul(&a, &b); }
+    else if (strcmp(op, "/") == 0) { res = big_div(&a, &b, false); }
+    else if (strcmp(op, "%") == 0) { res = big_div(&a, &b, true); }
+    else if (strcmp(op, "^") == 0) { res = big_pow(&a, y); }
+    else if (strcmp(op, "min") == 0) { res = lval_copy(lval_int_cmp(x, y) <= 0 ? x : y); }
+    else if (strcmp(op, "max") == 0) { res = lval_copy(lval_int_cmp(x, y) >= 0 ? x : y); }
+    else { res = lval_error("invalid operator"); }
+
+    lval_del(x);
+    lval_del(y);
+    return res;
+}
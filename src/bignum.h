@@ -0,0 +1,28 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct lval lval;
+struct dyn_string;
+
+// An arbitrary-precision integer: a sign and a magnitude in base 2^32,
+// least significant limb first. Integer results are only ever bignums when
+// they do not fit in a long, so the same number is never represented both
+// ways and fixnum arithmetic stays on its fast path.
+typedef struct lbig lbig;
+struct lbig {
+    int refs;
+    bool neg;
+    int len;
+    uint32_t limbs[];
+};
+
+lbig *lbig_retain(lbig *b);
+void lbig_release(lbig *b);
+bool lbig_eq(lbig *a, lbig *b);
+double lbig_to_double(lbig *b);
+void lbig_write(struct dyn_string *out, lbig *b);
+
+bool lval_is_integer(lval *v);
+lval *lval_bigint_parse(const char *s);
+lval *lval_int_arith(char *op, lval *x, lval *y);
+int lval_int_cmp(lval *a, lval *b);
@@ -0,0 +1,163 @@
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <time.h>
+
+#include "lval.h"
+#include "builtins.h"
+#include "utils.h"
+#include "interp.h"
+
+__thread long lbudget_steps = 0;
+
+static long budget_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void lbudget_init(clisp *c, long fuel, long deadline_ms, long heap) {
+    c->budget.fuel = fuel > 0 ? fuel : -1;
+    c->budget.deadline = deadline_ms > 0 ? budget_now() + deadline_ms * 1000000L : 0;
+    c->budget.heap = heap > 0 ? heap : 0;
+}
+
+// Takes the next allowance from the interpreter's fuel. The application
+// that ran out of steps is the first one paid for by it.
+static bool budget_refuel(lbudget *b) {
+    long fuel = __atomic_load_n(&b->fuel, __ATOMIC_RELAXED);
+    if (fuel < 0) {
+        lbudget_steps = LBUDGET_TICK - 1;
+        return true;
+    }
+
+    long grant;
+    do {
+        if (fuel == 0) {
+            lbudget_steps = 0;
+            return false;
+        }
+        grant = fuel < LBUDGET_TICK ? fuel : LBUDGET_TICK;
+    } while (!__atomic_compare_exchange_n(&b->fuel, &fuel, fuel - grant, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    lbudget_steps = grant - 1;
+    return true;
+}
+
+lval *lbudget_check(void) {
+    clisp *c = clisp_current();
+    if (c == NULL) {
+        lbudget_steps = LBUDGET_TICK - 1;
+        return NULL;
+    }
+
+    if (__atomic_load_n(&c->interrupted, __ATOMIC_RELAXED)) {
+        lbudget_steps = 0;
+        return lval_error("Evaluation interrupted");
+    }
+
+    lbudget *b = &c->budget;
+    if (!budget_refuel(b)) {
+        return lval_error("Budget exhausted: out of fuel");
+    }
+
+    long deadline = __atomic_load_n(&b->deadline, __ATOMIC_RELAXED);
+    if (deadline != 0 && budget_now() >= deadline) {
+        lbudget_steps = 0;
+        return lval_error("Budget exhausted: deadline passed");
+    }
+
+    long heap = __atomic_load_n(&b->heap, __ATOMIC_RELAXED);
+    if (heap != 0 && clisp_heap_live(c) > heap) {
+        lbudget_steps = 0;
+        return lval_error("Budget exhausted: heap limit reached");
+    }
+    return NULL;
+}
+
+void lbudget_return(clisp *c) {
+    if (c != NULL && lbudget_steps > 0 &&
+        __atomic_load_n(&c->budget.fuel, __ATOMIC_RELAXED) >= 0) {
+        __atomic_add_fetch(&c->budget.fuel, lbudget_steps, __ATOMIC_RELAXED);
+    }
+    lbudget_steps = 0;
+}
+
+static long budget_min(long a, long b) {
+    return a < b ? a : b;
+}
+
+// (with-budget {fuel n ms n heap n} {expr}) evaluates expr with at most
+// `fuel` function applications, `ms` milliseconds and `heap` more bytes
+// live than when it started, within whatever budget is already running.
+lval *builtin_with_budget(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("with-budget", v, 2);
+    LASSERT_ARG_TYPE("with-budget", v, 0, LVAL_QEXPR);
+    LASSERT_ARG_TYPE("with-budget", v, 1, LVAL_QEXPR);
+    clisp *c = clisp_current();
+    LASSERT(v, c != NULL, "Function 'with-budget' needs a running interpreter");
+
+    lval_expr *limits = &v->sexpr.cell[0]->qexpr;
+    LASSERT(v, limits->count % 2 == 0,
+            "Function 'with-budget' expects limits as pairs of a name and a number");
+    long fuel = -1, ms = -1, heap = -1;
+    for (int i = 0; i < limits->count; i += 2) {
+        lval *name = limits->cell[i];
+        lval *n = limits->cell[i + 1];
+        LASSERT(v, name->type == LVAL_SYMBOL && n->type == LVAL_INT && n->_int >= 0,
+                "Function 'with-budget' expects limits as pairs of a name and a number");
+
+        char *key = LSTR(name->symbol);
+        if (strcmp(key, "fuel") == 0) {
+            fuel = n->_int;
+        } else if (strcmp(key, "ms") == 0) {
+            ms = n->_int;
+        } else if (strcmp(key, "heap") == 0) {
+            heap = n->_int;
+        } else {
+            lval *err = lval_error("Function 'with-budget' has no limit '%s'", key);
+            lval_del(v);
+            return err;
+        }
+    }
+
+    LASSERT(v, heap < 0 || clisp_count_heap(c),
+            "Function 'with-budget' cannot limit the heap of a custom allocator");
+
+    // Steps this thread was allowed but has not taken go back to the
+    // running budget first, so that the nested one starts from an exact
+    // count
+    lbudget_return(c);
+    lbudget outer = c->budget;
+
+    lbudget inner = outer;
+    if (fuel >= 0) {
+        inner.fuel = outer.fuel >= 0 ? budget_min(fuel, outer.fuel) : fuel;
+    }
+    if (ms >= 0) {
+        long deadline = budget_now() + ms * 1000000L;
+        inner.deadline = outer.deadline != 0 ? budget_min(deadline, outer.deadline) : deadline;
+    }
+    if (heap >= 0) {
+        long limit = clisp_heap_live(c) + heap;
+        inner.heap = outer.heap != 0 ? budget_min(limit, outer.heap) : limit;
+    }
+
+    __atomic_store_n(&c->budget.fuel, inner.fuel, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->budget.deadline, inner.deadline, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->budget.heap, inner.heap, __ATOMIC_RELAXED);
+
+    lval *expr = lval_take(v, 1);
+    expr->type = LVAL_SEXPR;
+    expr->sexpr = expr->qexpr;
+    lval *res = lval_eval(e, expr);
+
+    // The outer budget pays for what the nested one used
+    lbudget_return(c);
+    if (outer.fuel >= 0) {
+        outer.fuel -= inner.fuel - __atomic_load_n(&c->budget.fuel, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&c->budget.fuel, outer.fuel, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->budget.deadline, outer.deadline, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->budget.heap, outer.heap, __ATOMIC_RELAXED);
+    return res;
+}
@@ -0,0 +1,33 @@
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct clisp clisp;
+
+// Limits on an evaluation. The evaluator counts steps down in a per-thread
+// allowance, so its only cost is a decrement and a branch per application;
+// once the allowance runs out lbudget_check takes the next one from the
+// interpreter's fuel and looks at the clock and the heap. An exhausted
+// budget fails every application after it, so the evaluation unwinds.
+typedef struct {
+    // Applications left, -1 for no limit
+    long fuel;
+    // CLOCK_MONOTONIC time in nanoseconds, 0 for none
+    long deadline;
+    // Live bytes allowed, 0 for no limit
+    long heap;
+} lbudget;
+
+// Steps taken between checks when fuel does not run out sooner
+#define LBUDGET_TICK 1024
+
+// Steps this thread may take before calling lbudget_check
+extern __thread long lbudget_steps;
+
+// Returns the error ending the current evaluation, or NULL to go on
+lval *lbudget_check(void);
+// Gives the steps this thread has left back to c's fuel, for when the thread
+// switches interpreters and must not take them along
+void lbudget_return(clisp *c);
+// Sets c's budget from command line style limits, where 0 is no limit
+void lbudget_init(clisp *c, long fuel, long deadline_ms, long heap);
+
+lval *builtin_with_budget(lenv *e, lval *v);
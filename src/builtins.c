@@ -1,51 +1,45 @@
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "lval.h"
+#include "builtins.h"
+#include "lazy.h"
+#include "transduce.h"
+#include "parallel.h"
+#include "lstring.h"
+#include "map.h"
+#include "vec.h"
+#include "pool.h"
+#include "bignum.h"
+#include "profile.h"
+#include "compile.h"
+#include "dump.h"
 #include "utils.h"
 #include "parser.h"
+#include "interp.h"
+#include "dyn_string.h"
 
 #define MIN(x,y) (x) < (y) ? (x) : (y)
 #define MAX(x,y) (x) > (y) ? (x) : (y)
 
-#define LASSERT(arg, cond, ...) \
-    if (!(cond)) { \
-        lval *_e = lval_error(__VA_ARGS__); \
-        lval_del(arg); \
-        return _e; \
-    }
-
-#define LASSERT_ARG_COUNT(func_name, arg, expected_count) \
-    LASSERT(arg, arg->sexpr.count == expected_count, \
-            "Incorrect argument count for function '%s'. Expected %d, got %d", \
-             func_name, expected_count, arg->sexpr.count);
-
-#define LASSERT_ARG_TYPE(func_name, arg, arg_num, arg_type) \
-    LASSERT(arg, arg->sexpr.cell[arg_num]->type = arg_type, \
-            "Incorrect argument type for function '%s'. Expected type '%s' for argument '%d', got %s", \
-             func_name, lval_type_name(arg_type), arg_num + 1, arg->sexpr.cell[arg_num]->type);
-
-#define LASSERT_QEXPR_NOT_EMPTY(func_name, arg) \
-    LASSERT(arg, arg->qexpr.count > 0, \
-            "Function '%s' received empty Q-expression", func_name);
-
-#define LASSERT_ARG_TYPES(lval, arg_type) \
-    for (int i = 0; i < lval->sexpr.count; i++) { \
-        LASSERT(lval, lval->sexpr.cell[i]->type == (arg_type), \
-                "Expected type '%s', got type '%s'", \
-                lval_type_name(arg_type), lval_type_name(lval->sexpr.cell[i]->type)); \
-    }
-
-static long powli(long x, long y) {
-    long res = 1;
-    while (y) {
-        res *= x;
-        y--;
+// Computes x^y by squaring, returning false if the result overflows a long
+static bool powli(long x, long y, long *res) {
+    long r = 1;
+    while (y > 0) {
+        if ((y & 1) && __builtin_mul_overflow(r, x, &r)) {
+            return false;
+        }
+        y >>= 1;
+        if (y > 0 && __builtin_mul_overflow(x, x, &x)) {
+            return false;
+        }
     }
-    return res;
+    *res = r;
+    return true;
 }
 
 static lval *builtin_op(lval *v, char *op) {
@@ -53,17 +47,22 @@ static lval *builtin_op(lval *v, char *op) {
     
     lval_expr *sexpr = &v->sexpr;
     enum LVAL_TYPE elem_type = sexpr->cell[0]->type;
+    bool integer = lval_is_integer(sexpr->cell[0]);
 
-    LASSERT(v, elem_type == LVAL_INT || elem_type == LVAL_DOUBLE,
+    LASSERT(v, integer || elem_type == LVAL_DOUBLE,
             "Operator arguments must be numeric");
-    LASSERT_ARG_TYPES(v, elem_type);
+    for (int i = 0; i < sexpr->count; i++) {
+        LASSERT(v, integer ? lval_is_integer(sexpr->cell[i]) : sexpr->cell[i]->type == LVAL_DOUBLE,
+                "Expected type '%s', got type '%s'",
+                lval_type_name(elem_type), lval_type_name(sexpr->cell[i]->type));
+    }
 
     lval *x = lval_expr_pop(sexpr, 0);
     
     // Unary '-'
     if ((strcmp(op, "-") == 0) && sexpr->count == 0) {
-        if (elem_type == LVAL_INT) {
-            x->_int = -x->_int;
+        if (integer) {
+            x = lval_int_arith("-", lval_int(0), x);
         } else {
             x->_double = -x->_double;
         }
@@ -72,25 +71,46 @@ static lval *builtin_op(lval *v, char *op) {
     while (sexpr->count > 0) {
         lval *y = lval_expr_pop(sexpr, 0);
 
-        if (elem_type == LVAL_INT) {
-            if (strcmp(op, "+") == 0) { x->_int += y->_int; }
-            else if (strcmp(op, "-") == 0) { x->_int -= y->_int; }
-            else if (strcmp(op, "*") == 0) { x->_int *= y->_int; }
-            else if (strcmp(op, "/") == 0) { 
-                LASSERT(y, y->_int != 0, "division by zero");
-                x->_int /= y->_int;
+        if (integer) {
+            // Fixnums stay on this path until a result overflows
+            if (x->type == LVAL_INT && y->type == LVAL_INT) {
+                long a = x->_int, b = y->_int, r = 0;
+                bool fits = true;
+                if (strcmp(op, "+") == 0) { fits = !__builtin_add_overflow(a, b, &r); }
+                else if (strcmp(op, "-") == 0) { fits = !__builtin_sub_overflow(a, b, &r); }
+                else if (strcmp(op, "*") == 0) { fits = !__builtin_mul_overflow(a, b, &r); }
+                else if (strcmp(op, "/") == 0 || strcmp(op, "%") == 0) {
+                    if (b == 0) {
+                        lval_del(x);
+                        lval_del(y);
+                        lval_del(v);
+                        return lval_error("division by zero");
+                    }
+                    fits = b != -1 || a != LONG_MIN;
+                    if (fits) { r = op[0] == '/' ? a / b : a % b; }
+                }
+                else if (strcmp(op, "^") == 0) { fits = b >= 0 && powli(a, b, &r); }
+                else if (strcmp(op, "min") == 0) { r = MIN(a, b); }
+                else if (strcmp(op, "max") == 0) { r = MAX(a, b); }
+                else { 
+                    lval_del(x);
+                    lval_del(y);
+                    lval_del(v);
+                    return lval_error("invalid operator");
+                }
+
+                if (fits) {
+                    x->_int = r;
+                    lval_del(y);
+                    continue;
+                }
             }
-            else if (strcmp(op, "%") == 0) { x->_int %= y->_int; }
-            else if (strcmp(op, "^") == 0) { x->_int = powli(x->_int, y->_int); }
-            else if (strcmp(op, "min") == 0) { x->_int = MIN(x->_int, y->_int); }
-            else if (strcmp(op, "max") == 0) { x->_int = MAX(x->_int, y->_int); }
-            else { 
-                lval_del(y);
+
+            x = lval_int_arith(op, x, y);
+            if (x->type == LVAL_ERROR) {
                 lval_del(v);
-                return lval_error("invalid operator");
+                return x;
             }
-
-            lval_del(y);
         } else {
             if (strcmp(op, "+") == 0) { x->_double += y->_double; }
             else if (strcmp(op, "-") == 0) { x->_double -= y->_double; }
@@ -152,30 +172,36 @@ lval *builtin_ord(lval *v, char *op) {
     assert(v->type == LVAL_SEXPR);
     LASSERT_ARG_COUNT(op, v, 2);
 
-    lval *a = lval_expr_pop(&v->sexpr, 0);
-    lval *b = lval_expr_pop(&v->sexpr, 0);
+    lval *a = v->sexpr.cell[0];
+    lval *b = v->sexpr.cell[1];
 
-    LASSERT(v, a->type == LVAL_INT || a->type == LVAL_DOUBLE, 
+    LASSERT(v, lval_is_integer(a) || a->type == LVAL_DOUBLE, 
             "Expected numeric type for comparison, got '%s'", lval_type_name(a->type));
-    LASSERT(v, b->type == a->type, 
+    LASSERT(v, lval_is_integer(a) ? lval_is_integer(b) : b->type == a->type, 
             "Expected type '%s' for second argument of comparison, got '%s'", 
             lval_type_name(a->type), lval_type_name(b->type));
 
-    lval_del(v);
-
+    bool res = false;
     if (a->type == LVAL_INT && b->type == LVAL_INT) {
-        if (strcmp(op, "<") == 0) { return lval_bool(a->_int < b->_int); }
-        else if (strcmp(op, ">") == 0) { return lval_bool(a->_int > b->_int); }
-        else if (strcmp(op, "<=") == 0) { return lval_bool(a->_int <= b->_int); }
-        else if (strcmp(op, ">=") == 0) { return lval_bool(a->_int >= b->_int); }
+        if (strcmp(op, "<") == 0) { res = a->_int < b->_int; }
+        else if (strcmp(op, ">") == 0) { res = a->_int > b->_int; }
+        else if (strcmp(op, "<=") == 0) { res = a->_int <= b->_int; }
+        else if (strcmp(op, ">=") == 0) { res = a->_int >= b->_int; }
+    } else if (lval_is_integer(a)) {
+        int c = lval_int_cmp(a, b);
+        if (strcmp(op, "<") == 0) { res = c < 0; }
+        else if (strcmp(op, ">") == 0) { res = c > 0; }
+        else if (strcmp(op, "<=") == 0) { res = c <= 0; }
+        else if (strcmp(op, ">=") == 0) { res = c >= 0; }
     } else {
-        if (strcmp(op, "<") == 0) { return lval_bool(a->_double < b->_double); }
-        else if (strcmp(op, ">") == 0) { return lval_bool(a->_double > b->_double); }
-        else if (strcmp(op, "<=") == 0) { return lval_bool(a->_double <= b->_double); }
-        else if (strcmp(op, ">=") == 0) { return lval_bool(a->_double >= b->_double); }
+        if (strcmp(op, "<") == 0) { res = a->_double < b->_double; }
+        else if (strcmp(op, ">") == 0) { res = a->_double > b->_double; }
+        else if (strcmp(op, "<=") == 0) { res = a->_double <= b->_double; }
+        else if (strcmp(op, ">=") == 0) { res = a->_double >= b->_double; }
     }
 
-    return lval_error("invalid comparison operator!");
+    lval_del(v);
+    return lval_bool(res);
 }
 
 lval *builtin_lt(UNUSED lenv *e, lval *v) {
@@ -202,13 +228,17 @@ lval *builtin_compare(lval *v, char* op) {
     lval *a = v->sexpr.cell[0];
     lval *b = v->sexpr.cell[1];
 
+    lval *res;
     if (strcmp(op, "==") == 0) {
-        return lval_bool(lval_eq(a, b));
+        res = lval_bool(lval_eq(a, b));
     } else if (strcmp(op, "!=") == 0) {
-        return lval_bool(!lval_eq(a, b));
+        res = lval_bool(!lval_eq(a, b));
+    } else {
+        res = lval_error("Invalid comparison operator!");
     }
 
-    return lval_error("Invalid comparison operator!");
+    lval_del(v);
+    return res;
 }
 
 lval *builtin_eq(UNUSED lenv *e, lval *v) {
@@ -233,9 +263,9 @@ lval *builtin_if(UNUSED lenv *e, lval *v) {
 
     lval *res;
     if (b) {
-        res = lval_eval(e, lval_expr_pop(args, 1));
+        res = lval_thunk_new(e, lval_expr_pop(args, 1));
     } else {
-        res = lval_eval(e, lval_expr_pop(args, 2));
+        res = lval_thunk_new(e, lval_expr_pop(args, 2));
     }
 
     lval_del(v);
@@ -332,7 +362,7 @@ lval *builtin_eval(UNUSED lenv *e, lval *v) {
     lval *x = lval_take(v, 0);
     x->type = LVAL_SEXPR;
     x->sexpr = x->qexpr;
-    return lval_eval(e, x);
+    return lval_thunk_new(e, x);
 }
 
 lval *builtin_join(UNUSED lenv *e, lval *v) {
@@ -399,6 +429,313 @@ lval *builtin_init(UNUSED lenv *e, lval *v) {
     return arg;
 }
 
+// Lists at least this long are sorted on the worker pool when their keys
+// compare natively. They are split into SORT_CHUNKS runs which are sorted
+// independently and then merged pairwise, each merge itself split into
+// segments along its merge path so every level keeps all workers busy.
+#define SORT_PARALLEL_MIN 65536
+#define SORT_CHUNKS 64
+
+enum SORT_KIND {
+    SORT_INT,
+    SORT_BIGINT,
+    SORT_DOUBLE,
+    SORT_STRING,
+    SORT_LAMBDA,
+};
+
+typedef struct {
+    lval *v;
+    union {
+        long i;
+        lval *k;
+        double d;
+        struct {
+            const char *s;
+            size_t len;
+        };
+    };
+} sort_item;
+
+typedef struct {
+    enum SORT_KIND kind;
+    lenv *env;
+    lval *less;
+    lval *err;
+} sort_ctx;
+
+static bool sort_less(sort_ctx *c, const sort_item *a, const sort_item *b) {
+    switch (c->kind) {
+        case SORT_INT:
+            return a->i < b->i;
+        case SORT_BIGINT:
+            return lval_int_cmp(a->k, b->k) < 0;
+        case SORT_DOUBLE:
+            return a->d < b->d;
+        case SORT_STRING: {
+            int r = memcmp(a->s, b->s, a->len < b->len ? a->len : b->len);
+            return r < 0 || (r == 0 && a->len < b->len);
+        }
+        case SORT_LAMBDA:
+            break;
+    }
+
+    if (c->err != NULL) {
+        return false;
+    }
+
+    lval *args = lval_sexpr();
+    lval_expr_push_back(&args->sexpr, lval_copy(a->v));
+    lval_expr_push_back(&args->sexpr, lval_copy(b->v));
+    lval *res = lval_apply(c->env, c->less, args);
+
+    bool less = false;
+    if (res->type == LVAL_BOOL) {
+        less = res->_bool;
+    } else if (res->type == LVAL_ERROR) {
+        c->err = res;
+        return false;
+    } else {
+        c->err = lval_error("Function 'sort' expects the comparator to return a bool, got %s",
+                            lval_type_name(res->type));
+    }
+    lval_del(res);
+    return less;
+}
+
+// Stable merge of a[0, na) and b[0, nb) into out
+static void sort_merge(sort_ctx *c, const sort_item *a, long na,
+                       const sort_item *b, long nb, sort_item *out) {
+    long i = 0, j = 0;
+    while (i < na && j < nb) {
+        *out++ = sort_less(c, &b[j], &a[i]) ? b[j++] : a[i++];
+    }
+    memcpy(out, a + i, sizeof(sort_item) * (na - i));
+    memcpy(out + (na - i), b + j, sizeof(sort_item) * (nb - j));
+}
+
+// Sorts a[lo, hi) using tmp[lo, hi) as scratch space
+static void sort_range(sort_ctx *c, sort_item *a, sort_item *tmp, long lo, long hi) {
+    if (hi - lo <= 16) {
+        for (long i = lo + 1; i < hi; i++) {
+            sort_item x = a[i];
+            long j = i;
+            for (; j > lo && sort_less(c, &x, &a[j - 1]); j--) {
+                a[j] = a[j - 1];
+            }
+            a[j] = x;
+        }
+        return;
+    }
+
+    long mid = lo + (hi - lo) / 2;
+    sort_range(c, a, tmp, lo, mid);
+    sort_range(c, a, tmp, mid, hi);
+    if (!sort_less(c, &a[mid], &a[mid - 1])) {
+        return;
+    }
+
+    memcpy(tmp + lo, a + lo, sizeof(sort_item) * (hi - lo));
+    sort_merge(c, tmp + lo, mid - lo, tmp + mid, hi - mid, a + lo);
+}
+
+// Number of elements of a that come before output position d when a and
+// b are merged
+static long sort_corank(sort_ctx *c, const sort_item *a, long na,
+                        const sort_item *b, long nb, long d) {
+    long lo = d > nb ? d - nb : 0;
+    long hi = d < na ? d : na;
+    while (lo < hi) {
+        long i = lo + (hi - lo) / 2;
+        long j = d - i;
+        if (j > 0 && i < na && !sort_less(c, &b[j - 1], &a[i])) {
+            lo = i + 1;
+        } else {
+            hi = i;
+        }
+    }
+    return lo;
+}
+
+typedef struct {
+    sort_ctx *c;
+    sort_item *src;
+    sort_item *dst;
+    long bounds[SORT_CHUNKS + 1];
+    long width;
+} sort_job;
+
+static void sort_chunk_task(void *ctx, long i) {
+    sort_job *job = ctx;
+    sort_range(job->c, job->src, job->dst, job->bounds[i], job->bounds[i + 1]);
+}
+
+// Merges one segment of a pair of adjacent runs of `width` chunks
+static void sort_merge_task(void *ctx, long t) {
+    sort_job *job = ctx;
+    long segs = job->width * 2;
+    long first = t / segs * segs;
+    long seg = t % segs;
+
+    long lo = job->bounds[first];
+    long mid = job->bounds[first + job->width];
+    long hi = job->bounds[first + segs];
+    sort_item *a = job->src + lo;
+    sort_item *b = job->src + mid;
+    long na = mid - lo, nb = hi - mid;
+
+    long d0 = (hi - lo) * seg / segs;
+    long d1 = (hi - lo) * (seg + 1) / segs;
+    long i0 = sort_corank(job->c, a, na, b, nb, d0);
+    long i1 = sort_corank(job->c, a, na, b, nb, d1);
+    sort_merge(job->c, a + i0, i1 - i0, b + (d0 - i0), (d1 - i1) - (d0 - i0),
+               job->dst + lo + d0);
+}
+
+static void sort_items(sort_ctx *c, sort_item *items, long n) {
+    sort_item *tmp = lmalloc(sizeof(sort_item) * (n > 0 ? n : 1));
+
+    if (c->kind == SORT_LAMBDA || n < SORT_PARALLEL_MIN) {
+        sort_range(c, items, tmp, 0, n);
+        lfree(tmp);
+        return;
+    }
+
+    sort_job job = { .c = c, .src = items, .dst = tmp };
+    for (long i = 0; i <= SORT_CHUNKS; i++) {
+        job.bounds[i] = n * i / SORT_CHUNKS;
+    }
+    lpool_run(sort_chunk_task, &job, SORT_CHUNKS);
+
+    for (job.width = 1; job.width < SORT_CHUNKS; job.width *= 2) {
+        lpool_run(sort_merge_task, &job, SORT_CHUNKS);
+        sort_item *t = job.src;
+        job.src = job.dst;
+        job.dst = t;
+    }
+
+    if (job.src != items) {
+        memcpy(items, job.src, sizeof(sort_item) * n);
+    }
+    lfree(tmp);
+}
+
+// Sorts the cells of list in place, ordered by keys[i] or by the cells
+// themselves when keys is NULL. Consumes list.
+static lval *sort_cells(lenv *e, char *func, lval *list, lval **keys, lval *less) {
+    lval_expr *cells = &list->qexpr;
+    long n = cells->count;
+    sort_ctx c = { SORT_LAMBDA, e, less, NULL };
+
+    if (less == NULL) {
+        bool strings = n > 0 && (keys != NULL ? keys[0] : cells->cell[0])->type == LVAL_STRING;
+        c.kind = strings ? SORT_STRING : SORT_INT;
+        for (long i = 0; i < n; i++) {
+            lval *k = keys != NULL ? keys[i] : cells->cell[i];
+            if (k->type == LVAL_DOUBLE && !strings) {
+                c.kind = SORT_DOUBLE;
+            } else if (k->type == LVAL_BIGINT && c.kind == SORT_INT) {
+                c.kind = SORT_BIGINT;
+            }
+            bool numeric = lval_is_integer(k) || k->type == LVAL_DOUBLE;
+            if (strings ? k->type != LVAL_STRING : !numeric) {
+                lval *err = lval_error("Function '%s' can only compare all numbers or all strings "
+                                       "without a comparator, got %s", func, lval_type_name(k->type));
+                lval_del(list);
+                return err;
+            }
+        }
+    }
+
+    sort_item *items = lmalloc(sizeof(sort_item) * (n > 0 ? n : 1));
+    for (long i = 0; i < n; i++) {
+        lval *k = keys != NULL ? keys[i] : cells->cell[i];
+        items[i].v = cells->cell[i];
+        if (c.kind == SORT_INT) {
+            items[i].i = k->_int;
+        } else if (c.kind == SORT_BIGINT) {
+            items[i].k = k;
+        } else if (c.kind == SORT_DOUBLE) {
+            items[i].d = k->type == LVAL_INT ? (double)k->_int :
+                         k->type == LVAL_BIGINT ? lbig_to_double(k->big) : k->_double;
+        } else if (c.kind == SORT_STRING) {
+            items[i].s = LSTR(k->string);
+            items[i].len = k->string.len;
+        }
+    }
+
+    sort_items(&c, items, n);
+
+    for (long i = 0; i < n; i++) {
+        cells->cell[i] = items[i].v;
+    }
+    lfree(items);
+
+    if (c.err != NULL) {
+        lval_del(list);
+        return c.err;
+    }
+    return list;
+}
+
+lval *builtin_sort(lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count == 1 || v->sexpr.count == 2,
+            "Function 'sort' expects a list and an optional comparator, got %d arguments",
+            v->sexpr.count);
+    LASSERT_ARG_TYPE("sort", v, v->sexpr.count - 1, LVAL_QEXPR);
+    LASSERT(v, v->sexpr.count == 1 || lval_is_func(v->sexpr.cell[0]),
+            "Function 'sort' expects a comparator function, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    lval *list = lval_expr_pop(&v->sexpr, v->sexpr.count - 1);
+    if (v->sexpr.count == 0) {
+        lval_del(v);
+        return sort_cells(e, "sort", list, NULL, NULL);
+    }
+
+    lval *less = lval_take(v, 0);
+    lval *res = sort_cells(e, "sort", list, NULL, less);
+    lval_del(less);
+    return res;
+}
+
+lval *builtin_sort_by(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("sort-by", v, 2);
+    LASSERT(v, lval_is_func(v->sexpr.cell[0]),
+            "Function 'sort-by' expects a key function, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+    LASSERT_ARG_TYPE("sort-by", v, 1, LVAL_QEXPR);
+
+    lval *list = lval_expr_pop(&v->sexpr, 1);
+    lval *key = lval_take(v, 0);
+    long n = list->qexpr.count;
+
+    // Each key is computed once, not once per comparison
+    lval **keys = lmalloc(sizeof(lval*) * (n > 0 ? n : 1));
+    long done = 0;
+    lval *err = NULL;
+    for (; done < n; done++) {
+        lval *args = lval_sexpr();
+        lval_expr_push_back(&args->sexpr, lval_copy(list->qexpr.cell[done]));
+        keys[done] = lval_apply(e, key, args);
+        if (keys[done]->type == LVAL_ERROR) {
+            err = keys[done];
+            break;
+        }
+    }
+
+    lval *res = err != NULL ? err : sort_cells(e, "sort-by", list, keys, NULL);
+    if (err != NULL) {
+        lval_del(list);
+    }
+    for (long i = 0; i < done; i++) {
+        lval_del(keys[i]);
+    }
+    lfree(keys);
+    lval_del(key);
+    return res;
+}
+
 lval *builtin_lambda(UNUSED lenv *e, lval *v) {
     LASSERT_ARG_COUNT("\\", v, 2);
     LASSERT_ARG_TYPE("\\", v, 0, LVAL_QEXPR);
@@ -433,7 +770,7 @@ lval *builtin_var(UNUSED lenv *e, lval *v, char *func) {
             "Function '%s' requires the same number of values as is given in the symbol list", func);
 
     for (int i = 0; i < symbols->count; i++) {
-        lenv_entry *entry = lenv_lookup(e, symbols->cell[i]->symbol);
+        lenv_entry *entry = lenv_lookup(e, LSTR(symbols->cell[i]->symbol));
         if (entry != NULL && entry->builtin) {
             return lval_error("Cannot redefine builtin function '%s'", entry->symbol);
         }
@@ -442,10 +779,10 @@ lval *builtin_var(UNUSED lenv *e, lval *v, char *func) {
 
     for (int i = 0; i < symbols->count; i++) {
         if (strcmp(func, "def") == 0) {
-            lenv_def(e, symbols->cell[i]->symbol, v->sexpr.cell[i+1]);
+            lenv_def(e, LSTR(symbols->cell[i]->symbol), v->sexpr.cell[i+1]);
         }
         if (strcmp(func, "=") == 0) {
-            lenv_put(e, symbols->cell[i]->symbol, v->sexpr.cell[i+1], false);
+            lenv_put(e, LSTR(symbols->cell[i]->symbol), v->sexpr.cell[i+1], false);
         }
     }
 
@@ -463,63 +800,171 @@ lval *builtin_put(lenv *e, lval *v) {
 
 lval *builtin_print(UNUSED lenv *e, lval *v) {
     assert(v->type == LVAL_SEXPR);
+    dyn_string *out = lout_begin();
     for (int i = 0; i < v->sexpr.count; i++) {
-        lval_print(v->sexpr.cell[i]);
-        putchar(' ');
+        lval_write(out, v->sexpr.cell[i]);
+        dyn_string_push(out, ' ');
     }
 
-    putchar('\n');
+    dyn_string_push(out, '\n');
+    lout_end(out);
     lval_del(v);
 
     return lval_sexpr();
 }
 
+static lval *builtin_str(lval *v, char *func, bool raw) {
+    LASSERT_ARG_COUNT(func, v, 1);
+
+    lval *x = v->sexpr.cell[0];
+    if (raw && x->type == LVAL_STRING) {
+        return lval_take(v, 0);
+    }
+
+    dyn_string *out = dyn_string_new();
+    lval_write(out, x);
+    lval *res = lval_string_n(out->buf, out->len);
+    dyn_string_del(out);
+    lval_del(v);
+    return res;
+}
+
+// Returns the printed form of any value as a string
+lval *builtin_show(UNUSED lenv *e, lval *v) {
+    return builtin_str(v, "show", false);
+}
+
+// Like show, but leaves strings as they are instead of quoting them
+lval *builtin_to_string(UNUSED lenv *e, lval *v) {
+    return builtin_str(v, "to-string", true);
+}
+
 lval *builtin_error(UNUSED lenv *e, lval *v) {
     assert(v->type == LVAL_SEXPR);
     LASSERT_ARG_COUNT("error", v, 1);
     LASSERT_ARG_TYPE("error", v, 0, LVAL_STRING);
 
-    lval *err = lval_error(v->sexpr.cell[0]->string);
+    lval *err = lval_error("%s", lstr_cstr(&v->sexpr.cell[0]->string));
 
     lval_del(v);
     return err;
 }
 
+static void call_stats_collect(lval *res, lval *x) {
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) {
+        return;
+    }
+
+    lval_expr *expr = &x->sexpr;
+    if (expr->cache != NULL && expr->count > 0 && expr->cell[0]->type == LVAL_SYMBOL) {
+        lval *site = lval_qexpr();
+        lval_expr_push_back(&site->qexpr, lval_symbol(LSTR(expr->cell[0]->symbol)));
+        lval_expr_push_back(&site->qexpr, lval_int(expr->cache->hits));
+        lval_expr_push_back(&site->qexpr, lval_int(expr->cache->misses));
+        lval_expr_push_back(&res->qexpr, site);
+    }
+
+    for (int i = 0; i < expr->count; i++) {
+        call_stats_collect(res, expr->cell[i]);
+    }
+}
+
+// Returns {{callee hits misses} ...} for every call site in a lambda's body
+lval *builtin_call_stats(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("call-stats", v, 1);
+    LASSERT_ARG_TYPE("call-stats", v, 0, LVAL_LAMBDA);
+
+    lval *res = lval_qexpr();
+    call_stats_collect(res, v->sexpr.cell[0]->lambda.body);
+    lval_del(v);
+    return res;
+}
+
 lval *builtin_load(lenv *e, lval *v) {
     assert(v->type == LVAL_SEXPR);
 
     LASSERT_ARG_COUNT("load", v, 1);
     LASSERT_ARG_TYPE("load", v, 0, LVAL_STRING);
+
+    char *path = lstr_cstr(&v->sexpr.cell[0]->string);
+    long traced = ltrace_active ? ltrace_now() : 0;
+    if (compile_is_shared(path)) {
+        lval *res = compile_load_shared(e, path);
+        if (traced != 0) {
+            ltrace_span("load", path, traced);
+        }
+        lval_del(v);
+        return res;
+    }
     
-    lval *expr = parse_file(v->sexpr.cell[0]->string);
+    lval *expr = parse_file(path);
     if (expr->type == LVAL_ERROR) {
         lval_del(v);
         return expr;
     }
     
     assert(expr->type == LVAL_SEXPR);
+    clisp *c = clisp_current();
     while (expr->sexpr.count > 0) {
-        lval *x = lval_eval(e, lval_expr_pop(&expr->sexpr, 0));
+        lval *form = lval_expr_pop(&expr->sexpr, 0);
+        // Each form is a span named after its source
+        char label[64];
+        long form_traced = 0;
+        if (traced != 0) {
+            ltrace_label(form, label, sizeof(label));
+            form_traced = ltrace_now();
+        }
+        lval *x = lval_eval(e, form);
+        if (form_traced != 0) {
+            ltrace_span("form", label, form_traced);
+            ltrace_counters();
+        }
+
+        if (c != NULL && c->exited) {
+            if (traced != 0) {
+                ltrace_span("load", path, traced);
+            }
+            lval_del(expr);
+            lval_del(v);
+            return x;
+        }
+
         if (x->type == LVAL_ERROR) {
             lval_println(x);
         }
         lval_del(x);
     }
 
+    if (traced != 0) {
+        ltrace_span("load", path, traced);
+    }
     lval_del(expr);
     lval_del(v);
 
     return lval_sexpr();
 }
 
-lval *builtin_exit(lenv *e, lval *v) {
-    printf("Exiting REPL\n");
+// Stops the interpreter. The error returned unwinds the evaluation, and the
+// embedder sees CLISP_EXIT instead of it.
+lval *builtin_exit(UNUSED lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count <= 1,
+            "Function 'exit' expects at most 1 argument, got %d", v->sexpr.count);
+    if (v->sexpr.count == 1) {
+        LASSERT_ARG_TYPE("exit", v, 0, LVAL_INT);
+    }
+
+    clisp *c = clisp_current();
+    if (c != NULL) {
+        c->exited = true;
+        c->exit_code = v->sexpr.count == 1 ? (int)v->sexpr.cell[0]->_int : 0;
+    }
+
+    lprintf("Exiting REPL\n");
     lval_del(v);
-    lenv_del(e);
-    exit(0);
+    return lval_error("exit");
 }
 
-static void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
     lval *v = lval_builtin_func(func);
     lenv_put(e, name, v, true);
     lval_del(v);
@@ -538,6 +983,60 @@ static void lenv_add_builtins(lenv *e) {
     lenv_add_builtin(e, "len", builtin_len);
     lenv_add_builtin(e, "init", builtin_init);
     lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "sort", builtin_sort);
+    lenv_add_builtin(e, "sort-by", builtin_sort_by);
+
+    lenv_add_builtin(e, "range", builtin_range);
+    lenv_add_builtin(e, "iterate", builtin_iterate);
+    lenv_add_builtin(e, "lazy", builtin_lazy);
+    lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+    lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+    lenv_add_builtin(e, "take-while", builtin_take_while);
+    lenv_add_builtin(e, "lazy-take", builtin_lazy_take);
+    lenv_add_builtin(e, "file-lines", builtin_file_lines);
+    lenv_add_builtin(e, "force", builtin_force);
+
+    lenv_add_builtin(e, "xmap", builtin_xmap);
+    lenv_add_builtin(e, "xfilter", builtin_xfilter);
+    lenv_add_builtin(e, "xtake", builtin_xtake);
+    lenv_add_builtin(e, "xcomp", builtin_xcomp);
+    lenv_add_builtin(e, "transduce", builtin_transduce);
+
+    lenv_add_builtin(e, "str-concat", builtin_str_concat);
+    lenv_add_builtin(e, "substr", builtin_substr);
+    lenv_add_builtin(e, "str-len", builtin_str_len);
+    lenv_add_builtin(e, "str-split", builtin_str_split);
+    lenv_add_builtin(e, "str-join", builtin_str_join);
+    lenv_add_builtin(e, "str-find", builtin_str_find);
+    lenv_add_builtin(e, "str->num", builtin_str_to_num);
+    lenv_add_builtin(e, "num->str", builtin_num_to_str);
+
+    lenv_add_builtin(e, "map-new", builtin_map_new);
+    lenv_add_builtin(e, "hamt-new", builtin_hamt_new);
+    lenv_add_builtin(e, "map-get", builtin_map_get);
+    lenv_add_builtin(e, "map-put", builtin_map_put);
+    lenv_add_builtin(e, "map-del", builtin_map_del);
+    lenv_add_builtin(e, "map-keys", builtin_map_keys);
+    lenv_add_builtin(e, "map-len", builtin_map_len);
+
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vec-get", builtin_vec_get);
+    lenv_add_builtin(e, "vec-set!", builtin_vec_set);
+    lenv_add_builtin(e, "vec-push!", builtin_vec_push);
+    lenv_add_builtin(e, "vec-pop!", builtin_vec_pop);
+    lenv_add_builtin(e, "vec-len", builtin_vec_len);
+    lenv_add_builtin(e, "vec->list", builtin_vec_to_list);
+
+    lenv_add_builtin(e, "dump", builtin_dump);
+    lenv_add_builtin(e, "restore", builtin_restore);
+
+    lenv_add_builtin(e, "pmap", builtin_pmap);
+    lenv_add_builtin(e, "pfilter", builtin_pfilter);
+    lenv_add_builtin(e, "preduce", builtin_preduce);
+
+    lval *xcat = lval_xcat();
+    lenv_put(e, "xcat", xcat, true);
+    lval_del(xcat);
 
     lenv_add_builtin(e, "+", builtin_add);
     lenv_add_builtin(e, "-", builtin_sub);
@@ -560,15 +1059,21 @@ static void lenv_add_builtins(lenv *e) {
     lenv_add_builtin(e, "if", builtin_if);
 
     lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "show", builtin_show);
+    lenv_add_builtin(e, "to-string", builtin_to_string);
     lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "call-stats", builtin_call_stats);
+    lenv_add_builtin(e, "profile", builtin_profile);
+    lenv_add_builtin(e, "stats", builtin_stats);
+    lenv_add_builtin(e, "stats-reset", builtin_stats_reset);
+    lenv_add_builtin(e, "with-budget", builtin_with_budget);
     lenv_add_builtin(e, "load", builtin_load);
     lenv_add_builtin(e, "exit", builtin_exit);
-
-    load_file(e, "lib/stdlib.clsp");
 }
 
 lenv *lenv_base(void) {
     lenv *e = lenv_new();
+    e->root = true;
     lenv_add_builtins(e);
     return e;
 }
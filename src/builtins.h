@@ -1,5 +1,36 @@
 typedef struct lenv lenv;
 typedef struct lval lval;
 
+typedef lval*(*lbuiltin)(lenv*, lval*);
+
 lenv *lenv_base(void);
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func);
 lval *builtin_load(lenv *e, lval *v);
+
+#define LASSERT(arg, cond, ...) \
+    if (!(cond)) { \
+        lval *_e = lval_error(__VA_ARGS__); \
+        lval_del(arg); \
+        return _e; \
+    }
+
+#define LASSERT_ARG_COUNT(func_name, arg, expected_count) \
+    LASSERT(arg, arg->sexpr.count == expected_count, \
+            "Incorrect argument count for function '%s'. Expected %d, got %d", \
+             func_name, expected_count, arg->sexpr.count);
+
+#define LASSERT_ARG_TYPE(func_name, arg, arg_num, arg_type) \
+    LASSERT(arg, arg->sexpr.cell[arg_num]->type == arg_type, \
+            "Incorrect argument type for function '%s'. Expected type '%s' for argument '%d', got %s", \
+             func_name, lval_type_name(arg_type), arg_num + 1, lval_type_name(arg->sexpr.cell[arg_num]->type));
+
+#define LASSERT_QEXPR_NOT_EMPTY(func_name, arg) \
+    LASSERT(arg, arg->qexpr.count > 0, \
+            "Function '%s' received empty Q-expression", func_name);
+
+#define LASSERT_ARG_TYPES(lval, arg_type) \
+    for (int i = 0; i < lval->sexpr.count; i++) { \
+        LASSERT(lval, lval->sexpr.cell[i]->type == (arg_type), \
+                "Expected type '%s', got type '%s'", \
+                lval_type_name(arg_type), lval_type_name(lval->sexpr.cell[i]->type)); \
+    }
@@ -0,0 +1,340 @@
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "builtins.h"
+#include "parser.h"
+#include "interp.h"
+#include "utils.h"
+#include "dyn_string.h"
+#include "pool.h"
+
+#define CLISP_DEFAULT_MAX_DEPTH 1000000
+#define CLISP_DEFAULT_OUTPUT_BUFFER 65536
+// Change in a thread's heap passed on to the interpreter at once
+#define CLISP_HEAP_SLACK 65536
+
+static __thread clisp *clisp_cur = NULL;
+// Change in clisp_cur's heap_live not yet added to it
+static __thread long clisp_heap_local = 0;
+
+static void clisp_heap_flush(clisp *c) {
+    if (c != NULL && clisp_heap_local != 0) {
+        long live = __atomic_add_fetch(&c->heap_live, clisp_heap_local, __ATOMIC_RELAXED);
+        // Blocks allocated before counting started are subtracted when they
+        // are freed all the same, so the count is kept from going below
+        // where it started
+        while (live < 0 && !__atomic_compare_exchange_n(&c->heap_live, &live, 0, false,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+    clisp_heap_local = 0;
+}
+
+static void clisp_heap_charge(clisp *c, long n) {
+    clisp_heap_local += n;
+    // A heap budget is then checked before the next application
+    if (clisp_heap_local > CLISP_HEAP_SLACK) {
+        clisp_heap_flush(c);
+        if (__atomic_load_n(&c->budget.heap, __ATOMIC_RELAXED) != 0) {
+            lbudget_steps = 0;
+        }
+    }
+}
+
+clisp *clisp_current(void) {
+    return clisp_cur;
+}
+
+clisp *clisp_enter(clisp *c) {
+    clisp *prev = clisp_cur;
+    clisp_heap_flush(prev);
+    lbudget_return(prev);
+    clisp_cur = c;
+    return prev;
+}
+
+void clisp_leave(clisp *prev) {
+    if (clisp_cur != NULL) {
+        lstats_flush(clisp_cur);
+    }
+    clisp_heap_flush(clisp_cur);
+    lbudget_return(clisp_cur);
+    clisp_cur = prev;
+}
+
+static void *clisp_default_alloc(UNUSED void *ud, void *ptr, size_t size) {
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
+static void clisp_default_write(UNUSED void *ud, const char *buf, size_t len) {
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+}
+
+void *lmalloc(size_t size) {
+    LSTAT(allocs, 1);
+    LSTAT(bytes, size);
+    clisp *c = clisp_cur;
+    if (c == NULL) {
+        return malloc(size);
+    }
+    void *ptr = c->alloc(c->alloc_ud, NULL, size == 0 ? 1 : size);
+    if (__atomic_load_n(&c->heap_counted, __ATOMIC_RELAXED)) {
+        clisp_heap_charge(c, malloc_usable_size(ptr));
+    }
+    return ptr;
+}
+
+void *lcalloc(size_t count, size_t size) {
+    void *ptr = lmalloc(count * size);
+    memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void *lrealloc(void *ptr, size_t size) {
+    clisp *c = clisp_cur;
+    // Only the growth counts as new bytes, or a buffer grown step by step
+    // would be counted over and over. Blocks from a custom allocator can't
+    // be measured, so they count in full.
+    long old = 0;
+    if (ptr != NULL && (c == NULL || c->alloc == clisp_default_alloc)) {
+        old = malloc_usable_size(ptr);
+    }
+    LSTAT(allocs, ptr == NULL);
+    LSTAT(bytes, (long)size > old ? (long)size - old : 0);
+    if (c == NULL) {
+        return realloc(ptr, size);
+    }
+    if (!__atomic_load_n(&c->heap_counted, __ATOMIC_RELAXED)) {
+        return c->alloc(c->alloc_ud, ptr, size == 0 ? 1 : size);
+    }
+    ptr = c->alloc(c->alloc_ud, ptr, size == 0 ? 1 : size);
+    clisp_heap_charge(c, (long)malloc_usable_size(ptr) - old);
+    return ptr;
+}
+
+void lfree(void *ptr) {
+    clisp *c = clisp_cur;
+    if (c == NULL) {
+        free(ptr);
+    } else if (ptr != NULL) {
+        if (__atomic_load_n(&c->heap_counted, __ATOMIC_RELAXED)) {
+            clisp_heap_local -= malloc_usable_size(ptr);
+            if (clisp_heap_local < -CLISP_HEAP_SLACK) {
+                clisp_heap_flush(c);
+            }
+        }
+        c->alloc(c->alloc_ud, ptr, 0);
+    }
+}
+
+dyn_string *lout_begin(void) {
+    clisp *c = clisp_cur;
+    if (c == NULL) {
+        return dyn_string_new();
+    }
+
+    if (lpool_in_worker()) {
+        pthread_mutex_lock(&c->out_lock);
+    }
+    return c->out;
+}
+
+static void clisp_flush_out(clisp *c) {
+    if (c->out->len > 0) {
+        c->write(c->write_ud, c->out->buf, c->out->len);
+        dyn_string_clear(c->out);
+    }
+}
+
+// Leaves an API call, releasing per-thread scratch space if it was the
+// outermost one
+static void clisp_return(clisp *c, clisp *prev) {
+    if (prev != c) {
+        clisp_flush_out(c);
+        clisp_clear_interrupt(c);
+    }
+    clisp_leave(prev);
+    if (prev == NULL) {
+        lval_eval_trim();
+    }
+}
+
+void lout_end(dyn_string *out) {
+    clisp *c = clisp_cur;
+    if (c == NULL) {
+        fwrite(out->buf, 1, out->len, stdout);
+        dyn_string_del(out);
+        return;
+    }
+
+    if (out->len >= c->out_limit) {
+        clisp_flush_out(c);
+    }
+    if (lpool_in_worker()) {
+        pthread_mutex_unlock(&c->out_lock);
+    }
+}
+
+void lprintf(const char *fmt, ...) {
+    dyn_string *out = lout_begin();
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
+
+    char *buf = lmalloc(n + 1);
+    va_start(va, fmt);
+    vsnprintf(buf, n + 1, fmt, va);
+    va_end(va);
+    dyn_string_append_n(out, buf, n);
+    lfree(buf);
+    lout_end(out);
+}
+
+clisp *clisp_new(const clisp_config *config) {
+    clisp_config defaults = {0};
+    if (config == NULL) {
+        config = &defaults;
+    }
+
+    clisp_alloc_fn alloc = config->alloc != NULL ? config->alloc : clisp_default_alloc;
+    clisp *c = alloc(config->alloc_ud, NULL, sizeof(clisp));
+    if (c == NULL) {
+        return NULL;
+    }
+    memset(c, 0, sizeof(clisp));
+
+    c->alloc = alloc;
+    c->alloc_ud = config->alloc_ud;
+    c->write = config->write != NULL ? config->write : clisp_default_write;
+    c->write_ud = config->write_ud;
+    c->max_depth = config->max_depth > 0 ? config->max_depth : CLISP_DEFAULT_MAX_DEPTH;
+    c->out_limit = config->output_buffer > 0 ? config->output_buffer : CLISP_DEFAULT_OUTPUT_BUFFER;
+    lbudget_init(c, config->fuel, config->deadline_ms, config->max_heap);
+    if (config->max_heap > 0) {
+        clisp_count_heap(c);
+    }
+    pthread_mutex_init(&c->out_lock, NULL);
+    if (config->trace != NULL) {
+        ltrace_open(c, config->trace, config->trace_threshold_us);
+    }
+
+    clisp *prev = clisp_enter(c);
+    c->out = dyn_string_new();
+    c->env = lenv_base();
+    clisp_leave(prev);
+
+    if (config->stdlib != NULL) {
+        clisp_load_file(c, config->stdlib);
+    }
+    return c;
+}
+
+void clisp_free(clisp *c) {
+    clisp *prev = clisp_enter(c);
+    lenv_del(c->env);
+    clisp_flush_out(c);
+    dyn_string_del(c->out);
+    clisp_leave(prev);
+    ltrace_close(c);
+    clisp_clear_interrupt(c);
+    pthread_mutex_destroy(&c->out_lock);
+
+    c->alloc(c->alloc_ud, c, 0);
+}
+
+enum CLISP_STATUS clisp_eval_string(clisp *c, const char *src, int flags) {
+    if (c->exited) {
+        return CLISP_EXIT;
+    }
+
+    clisp *prev = clisp_enter(c);
+    enum CLISP_STATUS status = CLISP_OK;
+
+    lval *expr = lval_sexpr();
+    parse_expr(expr, src, 0, '\0');
+    if (flags & CLISP_REPL) {
+        lval *line = lval_sexpr();
+        lval_expr_push_back(&line->sexpr, expr);
+        expr = line;
+    }
+
+    while (expr->sexpr.count > 0 && !c->exited) {
+        lval *x = lval_eval(c->env, lval_expr_pop(&expr->sexpr, 0));
+        if (c->exited) {
+            lval_del(x);
+            break;
+        }
+
+        if (x->type == LVAL_ERROR) {
+            status = CLISP_ERROR;
+        }
+        if (x->type == LVAL_ERROR || (flags & CLISP_REPL)) {
+            lval_println(x);
+        }
+        lval_del(x);
+    }
+    lval_del(expr);
+
+    clisp_return(c, prev);
+    return c->exited ? CLISP_EXIT : status;
+}
+
+enum CLISP_STATUS clisp_load_file(clisp *c, const char *path) {
+    if (c->exited) {
+        return CLISP_EXIT;
+    }
+
+    clisp *prev = clisp_enter(c);
+    lval *args = lval_sexpr();
+    lval_expr_push_back(&args->sexpr, lval_string((char*)path));
+
+    lval *x = builtin_load(c->env, args);
+    enum CLISP_STATUS status = x->type == LVAL_ERROR ? CLISP_ERROR : CLISP_OK;
+    if (x->type == LVAL_ERROR && !c->exited) {
+        lval_println(x);
+    }
+    lval_del(x);
+
+    clisp_return(c, prev);
+    return c->exited ? CLISP_EXIT : status;
+}
+
+int clisp_exit_code(clisp *c) {
+    return c->exit_code;
+}
+
+void clisp_flush(clisp *c) {
+    clisp_flush_out(c);
+}
+
+void clisp_interrupt(clisp *c) {
+    __atomic_store_n(&c->interrupted, 1, __ATOMIC_RELAXED);
+}
+
+void clisp_clear_interrupt(clisp *c) {
+    __atomic_store_n(&c->interrupted, 0, __ATOMIC_RELAXED);
+}
+
+bool clisp_count_heap(clisp *c) {
+    if (c->alloc == clisp_default_alloc) {
+        __atomic_store_n(&c->heap_counted, true, __ATOMIC_RELAXED);
+    }
+    return c->heap_counted;
+}
+
+long clisp_heap_live(clisp *c) {
+    if (c == clisp_cur) {
+        clisp_heap_flush(c);
+    }
+    return __atomic_load_n(&c->heap_live, __ATOMIC_RELAXED);
+}
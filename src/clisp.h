@@ -0,0 +1,64 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+// Embedding API. Every interpreter owns its environment, output sink and
+// allocator, so independent interpreters can run on different threads at
+// the same time.
+typedef struct clisp clisp;
+
+// Allocates (ptr == NULL), resizes, or frees (size == 0) a block of memory.
+// Parallel builtins call it from pool threads, so it must be thread-safe.
+typedef void *(*clisp_alloc_fn)(void *ud, void *ptr, size_t size);
+typedef void (*clisp_write_fn)(void *ud, const char *buf, size_t len);
+
+typedef struct {
+    // NULL selects malloc/realloc/free
+    clisp_alloc_fn alloc;
+    void *alloc_ud;
+    // NULL selects stdout
+    clisp_write_fn write;
+    void *write_ud;
+    // Bytes of output buffered before `write` is called, 0 selects the
+    // default. Output is always flushed when an API call returns.
+    size_t output_buffer;
+    // Path of the standard library to load, or NULL to start without it
+    const char *stdlib;
+    // Maximum evaluation depth, 0 selects the default
+    int max_depth;
+    // Path to write a Chrome trace of the interpreter to, or NULL. Calls
+    // shorter than trace_threshold_us microseconds are left out.
+    const char *trace;
+    long trace_threshold_us;
+    // Budget of the whole interpreter, 0 for no limit: the number of
+    // function applications, milliseconds from now, and live bytes (only
+    // counted with the default allocator). Once one runs out, evaluation
+    // fails with an error.
+    long fuel;
+    long deadline_ms;
+    long max_heap;
+} clisp_config;
+
+enum CLISP_STATUS {
+    CLISP_OK,
+    CLISP_ERROR,
+    CLISP_EXIT,
+};
+
+// Flags for clisp_eval_string
+#define CLISP_REPL 1
+
+clisp *clisp_new(const clisp_config *config);
+void clisp_free(clisp *c);
+
+// Evaluates every expression in src, writing errors to the output sink.
+// With CLISP_REPL, src is instead evaluated as a single S-expression the way
+// the REPL reads a line, and its value is written too. Returns CLISP_EXIT
+// once the program has called `exit`.
+enum CLISP_STATUS clisp_eval_string(clisp *c, const char *src, int flags);
+enum CLISP_STATUS clisp_load_file(clisp *c, const char *path);
+int clisp_exit_code(clisp *c);
+// Makes the evaluation running in c fail with an error within a few
+// function applications. May be called from any thread. The interrupt is
+// cleared when the outermost API call running in c returns.
+void clisp_interrupt(clisp *c);
+void clisp_flush(clisp *c);
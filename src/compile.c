@@ -0,0 +1,687 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lval.h"
+#include "builtins.h"
+#include "compile.h"
+#include "dyn_string.h"
+#include "parser.h"
+#include "interp.h"
+
+// Runtime support for generated code. These are resolved against the clisp
+// executable when a compiled object is loaded, so it must be linked with
+// -rdynamic.
+
+lval *clisp_rt_list(int quoted, int n, ...) {
+    lval *v = quoted ? lval_qexpr() : lval_sexpr();
+
+    va_list va;
+    va_start(va, n);
+    for (int i = 0; i < n; i++) {
+        lval_expr_push_back(&v->sexpr, va_arg(va, lval*));
+    }
+    va_end(va);
+
+    return v;
+}
+
+int clisp_rt_count(lval *a) {
+    return a->sexpr.count;
+}
+
+lval *clisp_rt_arg(lval *a, int i) {
+    return a->sexpr.cell[i];
+}
+
+// Compiled functions still get an environment holding their parameters so
+// that interpreted code they call sees the same dynamic scope.
+lenv *clisp_rt_frame(lenv *e, lval *a, int n, char **names) {
+    lenv *fe = lenv_new();
+    fe->parent = e;
+    for (int i = 0; i < n; i++) {
+        lenv_put(fe, names[i], a->sexpr.cell[i], false);
+    }
+    return fe;
+}
+
+void clisp_rt_frame_del(lenv *fe, lval *a) {
+    lenv_del(fe);
+    lval_del(a);
+}
+
+lval *clisp_rt_call(lenv *e, lbuiltin f, lval *a) {
+    for (int i = 0; i < a->sexpr.count; i++) {
+        if (a->sexpr.cell[i]->type == LVAL_ERROR) {
+            return lval_take(a, i);
+        }
+    }
+
+    return lval_force(f(e, a));
+}
+
+lval *clisp_rt_apply(lenv *e, lval *v) {
+    lval_expr *sexpr = &v->sexpr;
+
+    for (int i = 0; i < sexpr->count; i++) {
+        if (sexpr->cell[i]->type == LVAL_ERROR) {
+            return lval_take(v, i);
+        }
+    }
+
+    if (sexpr->count == 0) { return v; }
+    if (sexpr->count == 1) { return lval_take(v, 0); }
+
+    lval *f = lval_expr_pop(sexpr, 0);
+    if (!lval_is_func(f)) {
+        lval_del(f);
+        lval_del(v);
+        return lval_error("S-expression does not start with a function!");
+    }
+
+    lval *res = lval_call(e, f, v);
+    lval_del(f);
+    return res;
+}
+
+int clisp_rt_test(lval *c, lval **out) {
+    if (c->type == LVAL_ERROR) {
+        *out = c;
+        return -1;
+    }
+    if (c->type != LVAL_BOOL) {
+        *out = lval_error("Incorrect argument type for function 'if'. Expected type 'bool' for argument '1', got %s",
+                          lval_type_name(c->type));
+        lval_del(c);
+        return -1;
+    }
+
+    int b = c->_bool;
+    lval_del(c);
+    return b;
+}
+
+// Interprets a compiled function for calls the compiled code does not cover,
+// such as partial application.
+lval *clisp_rt_fallback(lenv *e, lval *formals, lval *body, lval *a) {
+    lval *f = lval_func(formals, body);
+    lval *res = lval_call(e, f, a);
+    lval_del(f);
+    return res;
+}
+
+void clisp_rt_toplevel(lval *x) {
+    if (x->type == LVAL_ERROR) {
+        lval_println(x);
+    }
+    lval_del(x);
+}
+
+static const char *compile_prelude =
+    "#include <stddef.h>\n"
+    "\n"
+    "typedef struct lval lval;\n"
+    "typedef struct lenv lenv;\n"
+    "typedef lval *(*lbuiltin)(lenv *, lval *);\n"
+    "\n"
+    "lval *lval_int(long x);\n"
+    "lval *lval_double(double x);\n"
+    "lval *lval_bigint_parse(const char *s);\n"
+    "lval *lval_bool(_Bool x);\n"
+    "lval *lval_string(char *s);\n"
+    "lval *lval_symbol(char *s);\n"
+    "lval *lval_error(char *fmt, ...);\n"
+    "lval *lval_sexpr(void);\n"
+    "lval *lval_copy(lval *v);\n"
+    "lval *lenv_get(lenv *e, char *k);\n"
+    "void lenv_add_builtin(lenv *e, char *name, lbuiltin func);\n"
+    "lval *clisp_rt_list(int quoted, int n, ...);\n"
+    "int clisp_rt_count(lval *a);\n"
+    "lval *clisp_rt_arg(lval *a, int i);\n"
+    "lenv *clisp_rt_frame(lenv *e, lval *a, int n, char **names);\n"
+    "void clisp_rt_frame_del(lenv *fe, lval *a);\n"
+    "lval *clisp_rt_call(lenv *e, lbuiltin f, lval *a);\n"
+    "lval *clisp_rt_apply(lenv *e, lval *v);\n"
+    "int clisp_rt_test(lval *c, lval **out);\n"
+    "lval *clisp_rt_fallback(lenv *e, lval *formals, lval *body, lval *a);\n"
+    "void clisp_rt_toplevel(lval *x);\n";
+
+typedef struct {
+    lenv *env;
+    dyn_string *decls;
+    dyn_string *out;
+    int tmp;
+    int fn_count;
+    char **fn_names;
+    int proto_count;
+    char **protos;
+} ccomp;
+
+typedef struct {
+    lval *params;
+    bool locals;
+    int indent;
+} cscope;
+
+static void emit(ccomp *c, cscope *sc, const char *fmt, ...) {
+    for (int i = 0; i < sc->indent && fmt[0] != '\0'; i++) {
+        dyn_string_append(c->out, "    ");
+    }
+
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
+
+    char *buf = lmalloc(n + 1);
+    va_start(va, fmt);
+    vsnprintf(buf, n + 1, fmt, va);
+    va_end(va);
+
+    dyn_string_append(c->out, buf);
+    dyn_string_push(c->out, '\n');
+    lfree(buf);
+}
+
+static void emit_c_string(dyn_string *out, const char *s) {
+    dyn_string_push(out, '"');
+    for (; *s != '\0'; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            dyn_string_push(out, '\\');
+            dyn_string_push(out, ch);
+        } else if (ch < 32 || ch >= 127) {
+            dyn_string_appendf(out, "\\%03o", ch);
+        } else {
+            dyn_string_push(out, ch);
+        }
+    }
+    dyn_string_push(out, '"');
+}
+
+// Appends a C expression that rebuilds v exactly, without evaluating it.
+static void emit_literal(dyn_string *out, lval *v) {
+    switch (v->type) {
+        case LVAL_INT:
+            if (v->_int == LONG_MIN) {
+                dyn_string_appendf(out, "lval_int(-%ldL - 1)", LONG_MAX);
+            } else {
+                dyn_string_appendf(out, "lval_int(%ldL)", v->_int);
+            }
+            break;
+        case LVAL_BIGINT: {
+            dyn_string *digits = dyn_string_new();
+            lval_write(digits, v);
+            dyn_string_appendf(out, "lval_bigint_parse(\"%s\")", digits->buf);
+            dyn_string_del(digits);
+            break;
+        }
+        case LVAL_DOUBLE:
+            dyn_string_appendf(out, "lval_double(%a)", v->_double);
+            break;
+        case LVAL_BOOL:
+            dyn_string_appendf(out, "lval_bool(%d)", v->_bool);
+            break;
+        case LVAL_STRING:
+            dyn_string_append(out, "lval_string(");
+            emit_c_string(out, lstr_cstr(&v->string));
+            dyn_string_push(out, ')');
+            break;
+        case LVAL_SYMBOL:
+            dyn_string_append(out, "lval_symbol(");
+            emit_c_string(out, LSTR(v->symbol));
+            dyn_string_push(out, ')');
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            dyn_string_appendf(out, "clisp_rt_list(%d, %d",
+                               v->type == LVAL_QEXPR, v->sexpr.count);
+            for (int i = 0; i < v->sexpr.count; i++) {
+                dyn_string_append(out, ", ");
+                emit_literal(out, v->sexpr.cell[i]);
+            }
+            dyn_string_push(out, ')');
+            break;
+        default:
+            dyn_string_append(out, "lval_error(\"%s\", ");
+            emit_c_string(out, v->type == LVAL_ERROR ? LSTR(v->error) : "value cannot be compiled");
+            dyn_string_push(out, ')');
+            break;
+    }
+}
+
+static int param_index(cscope *sc, char *name) {
+    if (sc->params == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < sc->params->qexpr.count; i++) {
+        if (strcmp(LSTR(sc->params->qexpr.cell[i]->symbol), name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int fn_index(ccomp *c, char *name) {
+    for (int i = 0; i < c->fn_count; i++) {
+        if (strcmp(c->fn_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Finds the C symbol of a builtin bound to name in the root environment and
+// declares it in the generated file. Returns NULL if it cannot be called
+// directly.
+static const char *builtin_symbol(ccomp *c, char *name) {
+    lenv_entry *entry = lenv_lookup(c->env, name);
+    if (entry == NULL || !entry->builtin || entry->val->type != LVAL_BUILTIN_FUNC) {
+        return NULL;
+    }
+
+    Dl_info info;
+    void *addr = (void *)entry->val->builtin_func;
+    if (dladdr(addr, &info) == 0 || info.dli_sname == NULL || info.dli_saddr != addr) {
+        return NULL;
+    }
+
+    for (int i = 0; i < c->proto_count; i++) {
+        if (strcmp(c->protos[i], info.dli_sname) == 0) {
+            return info.dli_sname;
+        }
+    }
+
+    c->proto_count++;
+    c->protos = lrealloc(c->protos, sizeof(char*) * c->proto_count);
+    c->protos[c->proto_count - 1] = (char *)info.dli_sname;
+    dyn_string_appendf(c->decls, "lval *%s(lenv *, lval *);\n", info.dli_sname);
+    return info.dli_sname;
+}
+
+static int gen_sexpr(ccomp *c, cscope *sc, lval_expr *x);
+
+static int gen_expr(ccomp *c, cscope *sc, lval *v) {
+    if (v->type == LVAL_SEXPR) {
+        return gen_sexpr(c, sc, &v->sexpr);
+    }
+
+    int t = c->tmp++;
+    if (v->type == LVAL_SYMBOL) {
+        int p = param_index(sc, LSTR(v->symbol));
+        if (p >= 0 && sc->locals) {
+            emit(c, sc, "lval *t%d = lval_copy(p%d);", t, p);
+        } else {
+            dyn_string *lit = dyn_string_new();
+            emit_c_string(lit, LSTR(v->symbol));
+            emit(c, sc, "lval *t%d = lenv_get(fe, %s);", t, lit->buf);
+            dyn_string_del(lit);
+        }
+        return t;
+    }
+
+    dyn_string *lit = dyn_string_new();
+    emit_literal(lit, v);
+    emit(c, sc, "lval *t%d = %s;", t, lit->buf);
+    dyn_string_del(lit);
+    return t;
+}
+
+// Emits `clisp_rt_list(0, n, t..)` over temporaries for cells[from..].
+static int gen_list(ccomp *c, cscope *sc, lval_expr *x, int from) {
+    int *temps = lmalloc(sizeof(int) * (x->count + 1));
+    for (int i = from; i < x->count; i++) {
+        temps[i] = gen_expr(c, sc, x->cell[i]);
+    }
+
+    dyn_string *args = dyn_string_new();
+    for (int i = from; i < x->count; i++) {
+        dyn_string_appendf(args, ", t%d", temps[i]);
+    }
+
+    int t = c->tmp++;
+    emit(c, sc, "lval *t%d = clisp_rt_list(0, %d%s);", t, x->count - from, args->buf);
+    dyn_string_del(args);
+    lfree(temps);
+    return t;
+}
+
+static int gen_if(ccomp *c, cscope *sc, lval_expr *x) {
+    int cond = gen_expr(c, sc, x->cell[1]);
+    int t = c->tmp++;
+
+    emit(c, sc, "lval *t%d = NULL;", t);
+    emit(c, sc, "switch (clisp_rt_test(t%d, &t%d)) {", cond, t);
+    for (int branch = 1; branch >= 0; branch--) {
+        emit(c, sc, "case %d: {", branch);
+        sc->indent++;
+        int res = gen_sexpr(c, sc, &x->cell[branch ? 2 : 3]->qexpr);
+        emit(c, sc, "t%d = t%d;", t, res);
+        emit(c, sc, "break;");
+        sc->indent--;
+        emit(c, sc, "}");
+    }
+    emit(c, sc, "}");
+    return t;
+}
+
+static int gen_sexpr(ccomp *c, cscope *sc, lval_expr *x) {
+    if (x->count == 0) {
+        int t = c->tmp++;
+        emit(c, sc, "lval *t%d = lval_sexpr();", t);
+        return t;
+    }
+    if (x->count == 1) {
+        return gen_expr(c, sc, x->cell[0]);
+    }
+
+    lval *head = x->cell[0];
+    if (head->type == LVAL_SYMBOL && param_index(sc, LSTR(head->symbol)) < 0) {
+        if (strcmp(LSTR(head->symbol), "if") == 0 && x->count == 4 &&
+            x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR &&
+            builtin_symbol(c, "if") != NULL) {
+            return gen_if(c, sc, x);
+        }
+
+        char callee[64];
+        int fn = fn_index(c, LSTR(head->symbol));
+        const char *builtin = fn < 0 ? builtin_symbol(c, LSTR(head->symbol)) : NULL;
+        if (fn >= 0 || builtin != NULL) {
+            if (fn >= 0) {
+                snprintf(callee, sizeof(callee), "clisp_fn_%d", fn);
+            } else {
+                snprintf(callee, sizeof(callee), "%s", builtin);
+            }
+
+            int args = gen_list(c, sc, x, 1);
+            int t = c->tmp++;
+            emit(c, sc, "lval *t%d = clisp_rt_call(fe, %s, t%d);", t, callee, args);
+            return t;
+        }
+    }
+
+    int list = gen_list(c, sc, x, 0);
+    int t = c->tmp++;
+    emit(c, sc, "lval *t%d = clisp_rt_apply(fe, t%d);", t, list);
+    return t;
+}
+
+static bool lval_mentions(lval *v, char *symbol) {
+    if (v->type == LVAL_SYMBOL) {
+        return strcmp(LSTR(v->symbol), symbol) == 0;
+    }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i = 0; i < v->sexpr.count; i++) {
+            if (lval_mentions(v->sexpr.cell[i], symbol)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Recognises `(fun {name args..} {body})` and `(def {name} (\\ {args..} {body}))`
+// with a fixed number of parameters. The parameters are the symbols of
+// `formals` from index `first` on.
+static bool compile_fun_form(lval *form, char **name, lval **formals, int *first, lval **body) {
+    if (form->type != LVAL_SEXPR || form->sexpr.count != 3) {
+        return false;
+    }
+
+    lval **cell = form->sexpr.cell;
+    if (cell[0]->type != LVAL_SYMBOL || cell[1]->type != LVAL_QEXPR ||
+        cell[1]->qexpr.count < 1 || cell[1]->qexpr.cell[0]->type != LVAL_SYMBOL) {
+        return false;
+    }
+
+    *name = LSTR(cell[1]->qexpr.cell[0]->symbol);
+    if (strcmp(LSTR(cell[0]->symbol), "fun") == 0 && cell[2]->type == LVAL_QEXPR) {
+        *formals = cell[1];
+        *first = 1;
+        *body = cell[2];
+    } else if (strcmp(LSTR(cell[0]->symbol), "def") == 0 && cell[1]->qexpr.count == 1 &&
+               cell[2]->type == LVAL_SEXPR && cell[2]->sexpr.count == 3 &&
+               cell[2]->sexpr.cell[0]->type == LVAL_SYMBOL &&
+               strcmp(LSTR(cell[2]->sexpr.cell[0]->symbol), "\\") == 0 &&
+               cell[2]->sexpr.cell[1]->type == LVAL_QEXPR &&
+               cell[2]->sexpr.cell[2]->type == LVAL_QEXPR) {
+        *formals = cell[2]->sexpr.cell[1];
+        *first = 0;
+        *body = cell[2]->sexpr.cell[2];
+    } else {
+        return false;
+    }
+
+    // Lambdas without parameters can never be called
+    if ((*formals)->qexpr.count <= *first) {
+        return false;
+    }
+    for (int i = *first; i < (*formals)->qexpr.count; i++) {
+        lval *p = (*formals)->qexpr.cell[i];
+        if (p->type != LVAL_SYMBOL || strcmp(LSTR(p->symbol), "&") == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void gen_function(ccomp *c, int id, lval *formals, int first, lval *body) {
+    lval *params = lval_qexpr();
+    for (int i = first; i < formals->qexpr.count; i++) {
+        lval_expr_push_back(&params->qexpr, lval_copy(formals->qexpr.cell[i]));
+    }
+
+    cscope sc = { params, !lval_mentions(body, "="), 1 };
+    int n = params->qexpr.count;
+
+    dyn_string_appendf(c->out, "static lval *clisp_fn_%d(lenv *e, lval *a) {\n", id);
+
+    dyn_string *lit = dyn_string_new();
+    emit_literal(lit, params);
+    emit(c, &sc, "if (clisp_rt_count(a) != %d) {", n);
+    emit(c, &sc, "    lval *formals = %s;", lit->buf);
+    dyn_string_del(lit);
+    lit = dyn_string_new();
+    emit_literal(lit, body);
+    emit(c, &sc, "    return clisp_rt_fallback(e, formals, %s, a);", lit->buf);
+    dyn_string_del(lit);
+    emit(c, &sc, "}");
+    emit(c, &sc, "");
+
+    dyn_string *names = dyn_string_new();
+    for (int i = 0; i < n; i++) {
+        if (i > 0) { dyn_string_append(names, ", "); }
+        emit_c_string(names, LSTR(params->qexpr.cell[i]->symbol));
+    }
+    emit(c, &sc, "static char *names[] = { %s };", names->buf);
+    dyn_string_del(names);
+    emit(c, &sc, "lenv *fe = clisp_rt_frame(e, a, %d, names);", n);
+    for (int i = 0; i < n; i++) {
+        emit(c, &sc, "lval *p%d = clisp_rt_arg(a, %d);", i, i);
+        emit(c, &sc, "(void)p%d;", i);
+    }
+    emit(c, &sc, "");
+
+    int res = gen_sexpr(c, &sc, &body->qexpr);
+    emit(c, &sc, "");
+    emit(c, &sc, "clisp_rt_frame_del(fe, a);");
+    emit(c, &sc, "return t%d;", res);
+    dyn_string_append(c->out, "}\n\n");
+
+    lval_del(params);
+}
+
+// Names the output next to filename. A leading "./" keeps a name starting
+// with '-' from being read as an option by cc.
+static char *compile_output_name(const char *filename, const char *ext) {
+    size_t len = strlen(filename);
+    if (len > 5 && strcmp(filename + len - 5, ".clsp") == 0) {
+        len -= 5;
+    }
+
+    const char *prefix = filename[0] == '-' ? "./" : "";
+    char *out = lmalloc(strlen(prefix) + len + strlen(ext) + 1);
+    strcpy(out, prefix);
+    memcpy(out + strlen(prefix), filename, len);
+    strcpy(out + strlen(prefix) + len, ext);
+    return out;
+}
+
+// Builds c_name into the shared object so_name. cc is run directly rather
+// than through the shell, so file names need no quoting.
+static bool compile_run_cc(const char *so_name, const char *c_name) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        char *argv[] = {
+            "cc", "-shared", "-fPIC", "-O2", "-o", (char *)so_name, (char *)c_name, NULL
+        };
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Translates the top-level forms of a file into C and builds them into a
+// shared object next to the source, which `load` can then open.
+lval *compile_file(lenv *e, const char *filename) {
+    lval *forms = parse_file(filename);
+    if (forms->type == LVAL_ERROR) {
+        return forms;
+    }
+
+    ccomp c = { e, dyn_string_new(), dyn_string_new(), 0, 0, NULL, 0, NULL };
+
+    // Name every compiled function up front so calls between them are direct
+    for (int i = 0; i < forms->sexpr.count; i++) {
+        char *name;
+        lval *formals, *body;
+        int first;
+        if (compile_fun_form(forms->sexpr.cell[i], &name, &formals, &first, &body) &&
+            fn_index(&c, name) < 0) {
+            c.fn_count++;
+            c.fn_names = lrealloc(c.fn_names, sizeof(char*) * c.fn_count);
+            c.fn_names[c.fn_count - 1] = name;
+        }
+    }
+
+    for (int i = 0; i < c.fn_count; i++) {
+        dyn_string_appendf(c.out, "static lval *clisp_fn_%d(lenv *e, lval *a);\n", i);
+    }
+    dyn_string_push(c.out, '\n');
+
+    dyn_string *init = dyn_string_new();
+    dyn_string_append(init, "void clisp_init(lenv *e) {\n    lenv *fe = e;\n    (void)fe;\n\n");
+
+    for (int i = 0; i < forms->sexpr.count; i++) {
+        lval *form = forms->sexpr.cell[i];
+        char *name;
+        lval *formals, *body;
+        int first;
+
+        if (compile_fun_form(form, &name, &formals, &first, &body)) {
+            int id = fn_index(&c, name);
+            gen_function(&c, id, formals, first, body);
+
+            dyn_string_append(init, "    lenv_add_builtin(e, ");
+            emit_c_string(init, name);
+            dyn_string_appendf(init, ", clisp_fn_%d);\n", id);
+            continue;
+        }
+
+        // Any other form is compiled inline and run when the object loads
+        dyn_string *fns = c.out;
+        c.out = init;
+        cscope sc = { NULL, false, 1 };
+        emit(&c, &sc, "{");
+        sc.indent++;
+        int res = gen_expr(&c, &sc, form);
+        emit(&c, &sc, "clisp_rt_toplevel(t%d);", res);
+        sc.indent--;
+        emit(&c, &sc, "}");
+        c.out = fns;
+    }
+    dyn_string_append(init, "}\n");
+
+    char *c_name = compile_output_name(filename, ".c");
+    char *so_name = compile_output_name(filename, ".so");
+
+    lval *res = lval_sexpr();
+    FILE *f = fopen(c_name, "w");
+    if (f == NULL) {
+        lval_del(res);
+        res = lval_error("Could not write %s", c_name);
+    } else {
+        // The file name must not end the comment early
+        fputs("/* Generated by clisp --compile from ", f);
+        for (const char *p = filename; *p != '\0'; p++) {
+            fputc(p[0] == '*' && p[1] == '/' ? '?' : *p, f);
+        }
+        fputs(" */\n\n", f);
+        fputs(compile_prelude, f);
+        fputs(c.decls->buf, f);
+        fputc('\n', f);
+        fputs(c.out->buf, f);
+        fputs(init->buf, f);
+        fclose(f);
+
+        if (!compile_run_cc(so_name, c_name)) {
+            lval_del(res);
+            res = lval_error("Compiling %s failed", c_name);
+        }
+    }
+
+    lfree(c_name);
+    lfree(so_name);
+    lfree(c.fn_names);
+    lfree(c.protos);
+    dyn_string_del(init);
+    dyn_string_del(c.decls);
+    dyn_string_del(c.out);
+    lval_del(forms);
+    return res;
+}
+
+bool compile_is_shared(const char *filename) {
+    size_t len = strlen(filename);
+    return len > 3 && strcmp(filename + len - 3, ".so") == 0;
+}
+
+lval *compile_load_shared(lenv *e, const char *filename) {
+    // dlopen only searches the library path for names without a slash
+    char *path = lmalloc(strlen(filename) + 3);
+    sprintf(path, "%s%s", strchr(filename, '/') ? "" : "./", filename);
+
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    lfree(path);
+    if (handle == NULL) {
+        return lval_error("Could not load %s: %s", filename, dlerror());
+    }
+
+    void (*init)(lenv *) = (void (*)(lenv *))dlsym(handle, "clisp_init");
+    if (init == NULL) {
+        dlclose(handle);
+        return lval_error("%s is not a compiled clisp file", filename);
+    }
+
+    // The handle stays open: the environment now refers to its functions
+    init(e);
+    return lval_sexpr();
+}
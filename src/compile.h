@@ -0,0 +1,8 @@
+#include <stdbool.h>
+
+typedef struct lenv lenv;
+typedef struct lval lval;
+
+bool compile_is_shared(const char *filename);
+lval *compile_load_shared(lenv *e, const char *filename);
+lval *compile_file(lenv *e, const char *filename);
@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lval.h"
+#include "builtins.h"
+#include "bignum.h"
+#include "dump.h"
+#include "dyn_string.h"
+#include "map.h"
+#include "vec.h"
+#include "utils.h"
+#include "interp.h"
+
+#define DUMP_MAGIC "CLSPDUMP"
+#define DUMP_VERSION 1
+// Numbers are written in the host's byte order, which this tells apart
+#define DUMP_ORDER 0x01020304u
+// Magic, version and order
+#define DUMP_HEADER 16
+// Offset of the root record and the number of names
+#define DUMP_TRAILER 16
+
+// Every record starts with one of these. Integers, lengths, counts and
+// distances back to children are LEB128 varints, integers zigzag encoded.
+enum DUMP_TAG {
+    DUMP_INT = 1,       // integer
+    DUMP_DOUBLE,        // 64-bit double
+    DUMP_BOOL,          // one byte
+    DUMP_BIGINT,        // length and decimal digits
+    DUMP_STRING,        // length and bytes
+    DUMP_ERROR,         // length and bytes
+    DUMP_NAME,          // index, length and bytes of a symbol name
+    DUMP_SYMBOL,        // distance to its name
+    DUMP_SEXPR,         // count and distances to the items
+    DUMP_QEXPR,
+    DUMP_MAP,           // kind and distance to a list of keys and values
+    DUMP_VEC,           // count and distances to the items
+};
+
+// Names written so far, in an open-addressing table
+typedef struct {
+    const char *name;
+    size_t len;
+    uint64_t hash;
+    uint64_t at;
+} dump_name;
+
+typedef struct {
+    FILE *out;
+    uint64_t pos;
+    dump_name *names;
+    long names_cap;
+    long names_count;
+    // Why the dump stopped, if it did
+    lval *err;
+} dump_writer;
+
+#define DUMP_FAILED UINT64_MAX
+
+static uint64_t dump_hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static void dump_bytes(dump_writer *w, const void *buf, size_t len) {
+    fwrite(buf, 1, len, w->out);
+    w->pos += len;
+}
+
+static void dump_u8(dump_writer *w, uint8_t x) {
+    dump_bytes(w, &x, 1);
+}
+
+static void dump_varint(dump_writer *w, uint64_t x) {
+    uint8_t buf[10];
+    int n = 0;
+    while (x >= 0x80) {
+        buf[n++] = (uint8_t)(x | 0x80);
+        x >>= 7;
+    }
+    buf[n++] = (uint8_t)x;
+    dump_bytes(w, buf, n);
+}
+
+static uint64_t dump_text(dump_writer *w, enum DUMP_TAG tag, const char *s, size_t len) {
+    uint64_t at = w->pos;
+    dump_u8(w, tag);
+    dump_varint(w, len);
+    dump_bytes(w, s, len);
+    return at;
+}
+
+static void dump_names_grow(dump_writer *w) {
+    long cap = w->names_cap == 0 ? 64 : w->names_cap * 2;
+    dump_name *names = lcalloc(cap, sizeof(dump_name));
+    for (long i = 0; i < w->names_cap; i++) {
+        dump_name *n = &w->names[i];
+        if (n->name != NULL) {
+            long j = n->hash & (cap - 1);
+            while (names[j].name != NULL) {
+                j = (j + 1) & (cap - 1);
+            }
+            names[j] = *n;
+        }
+    }
+    lfree(w->names);
+    w->names = names;
+    w->names_cap = cap;
+}
+
+// Returns the record of the name, writing it the first time it is seen
+static uint64_t dump_name_of(dump_writer *w, const char *s, size_t len) {
+    if (w->names_count * 2 >= w->names_cap) {
+        dump_names_grow(w);
+    }
+
+    uint64_t hash = dump_hash(s, len);
+    long j = hash & (w->names_cap - 1);
+    while (w->names[j].name != NULL) {
+        dump_name *n = &w->names[j];
+        if (n->hash == hash && n->len == len && memcmp(n->name, s, len) == 0) {
+            return n->at;
+        }
+        j = (j + 1) & (w->names_cap - 1);
+    }
+
+    uint64_t at = w->pos;
+    dump_u8(w, DUMP_NAME);
+    dump_varint(w, w->names_count);
+    dump_varint(w, len);
+    dump_bytes(w, s, len);
+    w->names[j] = (dump_name){ s, len, hash, at };
+    w->names_count++;
+    return at;
+}
+
+static uint64_t dump_value(dump_writer *w, lval *x);
+
+// Writes the items, then the record listing them
+static uint64_t dump_items(dump_writer *w, enum DUMP_TAG tag, lval **items, long count) {
+    uint64_t *children = lmalloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+    for (long i = 0; i < count; i++) {
+        children[i] = dump_value(w, items[i]);
+        if (children[i] == DUMP_FAILED) {
+            lfree(children);
+            return DUMP_FAILED;
+        }
+    }
+
+    uint64_t at = w->pos;
+    dump_u8(w, tag);
+    dump_varint(w, count);
+    for (long i = 0; i < count; i++) {
+        dump_varint(w, at - children[i]);
+    }
+    lfree(children);
+    return at;
+}
+
+typedef struct {
+    lval **items;
+    long count;
+} dump_pairs;
+
+static bool dump_pairs_visit(lmap_leaf *l, void *ctx) {
+    dump_pairs *p = ctx;
+    p->items[p->count++] = l->key;
+    p->items[p->count++] = l->val;
+    return true;
+}
+
+static uint64_t dump_map(dump_writer *w, lmap *m) {
+    dump_pairs pairs = { lmalloc(sizeof(lval*) * (m->count * 2 + 1)), 0 };
+    lmap_each(m, dump_pairs_visit, &pairs);
+
+    uint64_t list = dump_items(w, DUMP_QEXPR, pairs.items, pairs.count);
+    lfree(pairs.items);
+    if (list == DUMP_FAILED) {
+        return DUMP_FAILED;
+    }
+
+    uint64_t at = w->pos;
+    dump_u8(w, DUMP_MAP);
+    dump_u8(w, m->kind);
+    dump_varint(w, at - list);
+    return at;
+}
+
+static uint64_t dump_value(dump_writer *w, lval *x) {
+    uint64_t at = w->pos;
+    switch (x->type) {
+    case LVAL_INT:
+        dump_u8(w, DUMP_INT);
+        dump_varint(w, ((uint64_t)x->_int << 1) ^ (uint64_t)(x->_int >> 63));
+        return at;
+    case LVAL_DOUBLE:
+        dump_u8(w, DUMP_DOUBLE);
+        dump_bytes(w, &x->_double, 8);
+        return at;
+    case LVAL_BOOL:
+        dump_u8(w, DUMP_BOOL);
+        dump_u8(w, x->_bool);
+        return at;
+    case LVAL_BIGINT: {
+        dyn_string *digits = dyn_string_new();
+        lbig_write(digits, x->big);
+        at = dump_text(w, DUMP_BIGINT, digits->buf, digits->len);
+        dyn_string_del(digits);
+        return at;
+    }
+    case LVAL_STRING:
+        return dump_text(w, DUMP_STRING, LSTR(x->string), x->string.len);
+    case LVAL_ERROR:
+        return dump_text(w, DUMP_ERROR, LSTR(x->error), x->error.len);
+    case LVAL_SYMBOL: {
+        uint64_t name = dump_name_of(w, LSTR(x->symbol), x->symbol.len);
+        at = w->pos;
+        dump_u8(w, DUMP_SYMBOL);
+        dump_varint(w, at - name);
+        return at;
+    }
+    case LVAL_SEXPR:
+        return dump_items(w, DUMP_SEXPR, x->sexpr.cell, x->sexpr.count);
+    case LVAL_QEXPR:
+        return dump_items(w, DUMP_QEXPR, x->qexpr.cell, x->qexpr.count);
+    case LVAL_MAP:
+        return dump_map(w, x->map);
+    case LVAL_VEC: {
+        lvec_lock(x->vec);
+        at = dump_items(w, DUMP_VEC, x->vec->items, x->vec->count);
+        lvec_unlock(x->vec);
+        return at;
+    }
+    default:
+        if (w->err == NULL) {
+            w->err = lval_error("Function 'dump' cannot write a value of type %s",
+                                lval_type_name(x->type));
+        }
+        return DUMP_FAILED;
+    }
+}
+
+lval *builtin_dump(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("dump", v, 2);
+    LASSERT_ARG_TYPE("dump", v, 1, LVAL_STRING);
+
+    char *path = lstr_cstr(&v->sexpr.cell[1]->string);
+    dump_writer w = {0};
+    w.out = fopen(path, "wb");
+    if (w.out == NULL) {
+        lval *err = lval_error("Function 'dump' could not open %s", path);
+        lval_del(v);
+        return err;
+    }
+
+    uint32_t header[2] = { DUMP_VERSION, DUMP_ORDER };
+    dump_bytes(&w, DUMP_MAGIC, 8);
+    dump_bytes(&w, header, sizeof(header));
+    uint64_t root = dump_value(&w, v->sexpr.cell[0]);
+    // A dump cut short has no trailer, which restore rejects
+    if (root != DUMP_FAILED) {
+        dump_bytes(&w, &root, 8);
+        uint64_t names = w.names_count;
+        dump_bytes(&w, &names, 8);
+    }
+
+    bool failed = ferror(w.out) != 0;
+    failed |= fclose(w.out) != 0;
+    lfree(w.names);
+    if (w.err == NULL && failed) {
+        w.err = lval_error("Function 'dump' could not write %s", path);
+    }
+
+    lval_del(v);
+    return w.err != NULL ? w.err : lval_int((long)w.pos);
+}
+
+typedef struct {
+    lenv *env;
+    const unsigned char *buf;
+    // Records end where the trailer starts
+    uint64_t end;
+    lstr *names;
+    bool *named;
+    uint64_t names_count;
+    // A bit per byte of the records, set once a record has been used as a
+    // child. The writer only makes trees, so a second use means the dump
+    // was made to decode a record many times over.
+    unsigned char *used;
+} dump_reader;
+
+// Each of these reads at *at and moves it past what was read, returning
+// false if that would run past the records
+
+static bool restore_u8(dump_reader *r, uint64_t *at, uint8_t *x) {
+    if (*at >= r->end) {
+        return false;
+    }
+    *x = r->buf[(*at)++];
+    return true;
+}
+
+static bool restore_varint(dump_reader *r, uint64_t *at, uint64_t *x) {
+    *x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b;
+        if (!restore_u8(r, at, &b)) {
+            return false;
+        }
+        *x |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Points *s at the bytes in place
+static bool restore_bytes(dump_reader *r, uint64_t *at, uint64_t len, const char **s) {
+    if (len > r->end - *at) {
+        return false;
+    }
+    *s = (const char *)r->buf + *at;
+    *at += len;
+    return true;
+}
+
+static bool restore_text(dump_reader *r, uint64_t *at, const char **s, size_t *len) {
+    uint64_t n;
+    if (!restore_varint(r, at, &n) || !restore_bytes(r, at, n, s)) {
+        return false;
+    }
+    *len = n;
+    return true;
+}
+
+// Children always come before the record at `start` referring to them.
+// Only names may be referred to more than once.
+static bool restore_child(dump_reader *r, uint64_t start, uint64_t *at, uint64_t *child,
+                          bool shared) {
+    uint64_t back;
+    if (!restore_varint(r, at, &back) || back == 0 || back > start - DUMP_HEADER) {
+        return false;
+    }
+    *child = start - back;
+    if (!shared) {
+        unsigned char bit = 1 << (*child & 7);
+        if (r->used[*child >> 3] & bit) {
+            return false;
+        }
+        r->used[*child >> 3] |= bit;
+    }
+    return true;
+}
+
+// Returns NULL when the dump is damaged
+static lval *restore_value(dump_reader *r, uint64_t start);
+
+static lval *restore_items(dump_reader *r, uint64_t start, uint64_t at, lval *list) {
+    // Every item takes at least a byte to refer to
+    uint64_t count;
+    if (!restore_varint(r, &at, &count) || count > r->end - at) {
+        lval_del(list);
+        return NULL;
+    }
+
+    list->sexpr.cell = lmalloc(sizeof(lval*) * (count > 0 ? count : 1));
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t child;
+        lval *x = restore_child(r, start, &at, &child, false) ? restore_value(r, child) : NULL;
+        if (x == NULL) {
+            lval_del(list);
+            return NULL;
+        }
+        list->sexpr.cell[list->sexpr.count++] = x;
+    }
+    lval_expr_attach_cache(list);
+    return list;
+}
+
+static lval *restore_symbol(dump_reader *r, uint64_t start, uint64_t at) {
+    uint64_t name, index;
+    uint8_t tag;
+    if (!restore_child(r, start, &at, &name, true)) {
+        return NULL;
+    }
+    at = name;
+    if (!restore_u8(r, &at, &tag) || tag != DUMP_NAME ||
+        !restore_varint(r, &at, &index) || index >= r->names_count) {
+        return NULL;
+    }
+
+    // Every symbol with this name shares one copy of it
+    if (!r->named[index]) {
+        const char *s;
+        size_t len;
+        if (!restore_text(r, &at, &s, &len)) {
+            return NULL;
+        }
+        lstr_init(&r->names[index], s, len);
+        r->named[index] = true;
+    }
+
+    lval *x = lval_symbol_n("", 0);
+    lstr_free(&x->symbol);
+    lstr_copy(&x->symbol, &r->names[index]);
+    return x;
+}
+
+static lval *restore_map(dump_reader *r, uint64_t start, uint64_t at) {
+    uint8_t kind;
+    uint64_t list;
+    if (!restore_u8(r, &at, &kind) || !restore_child(r, start, &at, &list, false)) {
+        return NULL;
+    }
+    lval *pairs = restore_value(r, list);
+    if (pairs == NULL || pairs->type != LVAL_QEXPR) {
+        if (pairs != NULL) {
+            lval_del(pairs);
+        }
+        return NULL;
+    }
+
+    lval *args = lval_sexpr();
+    lval_expr_push_back(&args->sexpr, pairs);
+    return kind == LMAP_HAMT ? builtin_hamt_new(r->env, args) : builtin_map_new(r->env, args);
+}
+
+static lval *restore_value(dump_reader *r, uint64_t start) {
+    uint64_t at = start;
+    uint8_t tag;
+    if (!restore_u8(r, &at, &tag)) {
+        return NULL;
+    }
+
+    const char *s;
+    size_t len;
+    switch (tag) {
+    case DUMP_INT: {
+        uint64_t x;
+        if (!restore_varint(r, &at, &x)) {
+            return NULL;
+        }
+        return lval_int((long)(x >> 1) ^ -(long)(x & 1));
+    }
+    case DUMP_DOUBLE: {
+        double x;
+        if (!restore_bytes(r, &at, 8, &s)) {
+            return NULL;
+        }
+        memcpy(&x, s, 8);
+        return lval_double(x);
+    }
+    case DUMP_BOOL: {
+        uint8_t x;
+        return restore_u8(r, &at, &x) ? lval_bool(x != 0) : NULL;
+    }
+    case DUMP_BIGINT: {
+        if (!restore_text(r, &at, &s, &len)) {
+            return NULL;
+        }
+        dyn_string *digits = dyn_string_new();
+        dyn_string_append_n(digits, s, len);
+        lval *x = lval_bigint_parse(digits->buf);
+        dyn_string_del(digits);
+        return x;
+    }
+    case DUMP_STRING:
+        return restore_text(r, &at, &s, &len) ? lval_string_n(s, len) : NULL;
+    case DUMP_ERROR:
+        return restore_text(r, &at, &s, &len) ? lval_error("%.*s", (int)len, s) : NULL;
+    case DUMP_SYMBOL:
+        return restore_symbol(r, start, at);
+    case DUMP_SEXPR:
+        return restore_items(r, start, at, lval_sexpr());
+    case DUMP_QEXPR:
+        return restore_items(r, start, at, lval_qexpr());
+    case DUMP_MAP:
+        return restore_map(r, start, at);
+    case DUMP_VEC: {
+        lval *items = restore_items(r, start, at, lval_qexpr());
+        if (items == NULL) {
+            return NULL;
+        }
+        lval *args = lval_sexpr();
+        lval_expr_push_back(&args->sexpr, items);
+        return builtin_vec(r->env, args);
+    }
+    default:
+        return NULL;
+    }
+}
+
+static lval *restore_buffer(lenv *e, const unsigned char *buf, uint64_t size, char *path) {
+    uint32_t header[2];
+    if (size < DUMP_HEADER || memcmp(buf, DUMP_MAGIC, 8) != 0) {
+        return lval_error("Function 'restore' found no dump in %s", path);
+    }
+    memcpy(header, buf + 8, sizeof(header));
+    if (header[1] != DUMP_ORDER) {
+        return lval_error("Function 'restore' cannot read %s, which was written with another byte order", path);
+    }
+    if (header[0] != DUMP_VERSION) {
+        return lval_error("Function 'restore' cannot read version %u of the dump in %s",
+                          header[0], path);
+    }
+
+    dump_reader r = { e, buf, 0, NULL, NULL, 0, NULL };
+    uint64_t trailer[2];
+    lval *x = NULL;
+    if (size >= DUMP_HEADER + DUMP_TRAILER) {
+        r.end = size - DUMP_TRAILER;
+        memcpy(trailer, buf + r.end, sizeof(trailer));
+        r.names_count = trailer[1];
+        if (trailer[0] >= DUMP_HEADER && r.names_count <= r.end) {
+            r.names = lmalloc(sizeof(lstr) * (r.names_count > 0 ? r.names_count : 1));
+            r.named = lcalloc(r.names_count > 0 ? r.names_count : 1, sizeof(bool));
+            r.used = lcalloc(r.end / 8 + 1, 1);
+            x = restore_value(&r, trailer[0]);
+        }
+    }
+
+    for (uint64_t i = 0; i < r.names_count && r.named != NULL; i++) {
+        if (r.named[i]) {
+            lstr_free(&r.names[i]);
+        }
+    }
+    lfree(r.names);
+    lfree(r.named);
+    lfree(r.used);
+    return x != NULL ? x : lval_error("Function 'restore' found a damaged dump in %s", path);
+}
+
+lval *builtin_restore(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("restore", v, 1);
+    LASSERT_ARG_TYPE("restore", v, 0, LVAL_STRING);
+
+    char *path = lstr_cstr(&v->sexpr.cell[0]->string);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        lval *err = lval_error("Function 'restore' could not open %s", path);
+        lval_del(v);
+        return err;
+    }
+
+    lval *x;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            x = lval_error("Function 'restore' could not read %s", path);
+        } else {
+            x = restore_buffer(e, buf, st.st_size, path);
+            munmap(buf, st.st_size);
+        }
+    } else {
+        // Pipes are read to the end, which is where the writer closed them
+        size_t len = 0, cap = 1 << 16;
+        unsigned char *buf = lmalloc(cap);
+        ssize_t n;
+        while ((n = read(fd, buf + len, cap - len)) > 0) {
+            len += n;
+            if (len == cap) {
+                cap *= 2;
+                buf = lrealloc(buf, cap);
+            }
+        }
+        x = n < 0 ? lval_error("Function 'restore' could not read %s", path)
+                  : restore_buffer(e, buf, len, path);
+        lfree(buf);
+    }
+    close(fd);
+
+    lval_del(v);
+    return x;
+}
@@ -0,0 +1,18 @@
+typedef struct lenv lenv;
+typedef struct lval lval;
+
+// A binary encoding of values, for handing data between jobs without
+// printing and parsing it.
+//
+// A dump is a header, the records of the value and a trailer. Records are
+// written children first, so that a dump can go straight into a pipe, and
+// refer to their children by the distance back to them. Each symbol name
+// is written once and shared by every symbol with that name. Functions and
+// lazy values cannot be dumped.
+
+// (dump value "file") writes value to the file, which may be a pipe, and
+// returns the number of bytes written
+lval *builtin_dump(lenv *e, lval *v);
+// (restore "file") reads a value back. Regular files are mapped and
+// decoded in place, anything else is read to the end first.
+lval *builtin_restore(lenv *e, lval *v);
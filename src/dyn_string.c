@@ -1,26 +1,72 @@
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "dyn_string.h"
+#include "interp.h"
 
 dyn_string *dyn_string_new(void) {
-    dyn_string *s = malloc(sizeof(dyn_string));
+    dyn_string *s = lmalloc(sizeof(dyn_string));
     s->len = 0;
     s->capacity = 4;
-    s->buf = calloc(s->capacity + 1, sizeof(char));
+    s->buf = lcalloc(s->capacity + 1, sizeof(char));
     s->buf[0] = '\0';
     return s;
 }
 
 void dyn_string_del(dyn_string *s) {
-    free(s->buf);
-    free(s);
+    lfree(s->buf);
+    lfree(s);
 }
 
 void dyn_string_push(dyn_string *s, char c) {
     if (s->len >= s->capacity) {
         s->capacity *= 2;
-        s->buf = realloc(s->buf, s->capacity + 1);
+        s->buf = lrealloc(s->buf, s->capacity + 1);
     }
     s->buf[s->len] = c;
     s->buf[s->len + 1] = '\0';
     s->len++;
 }
+
+static void dyn_string_reserve(dyn_string *s, size_t extra) {
+    if (s->len + extra <= s->capacity) {
+        return;
+    }
+    while (s->len + extra > s->capacity) {
+        s->capacity *= 2;
+    }
+    s->buf = lrealloc(s->buf, s->capacity + 1);
+}
+
+void dyn_string_append(dyn_string *s, const char *str) {
+    size_t n = strlen(str);
+    dyn_string_reserve(s, n);
+    memcpy(s->buf + s->len, str, n + 1);
+    s->len += n;
+}
+
+void dyn_string_append_n(dyn_string *s, const char *str, size_t n) {
+    dyn_string_reserve(s, n);
+    memcpy(s->buf + s->len, str, n);
+    s->len += n;
+    s->buf[s->len] = '\0';
+}
+
+void dyn_string_clear(dyn_string *s) {
+    s->len = 0;
+    s->buf[0] = '\0';
+}
+
+void dyn_string_appendf(dyn_string *s, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
+
+    dyn_string_reserve(s, n);
+    va_start(va, fmt);
+    vsnprintf(s->buf + s->len, n + 1, fmt, va);
+    va_end(va);
+    s->len += n;
+}
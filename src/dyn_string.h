@@ -1,6 +1,6 @@
 #include <stdlib.h>
 
-typedef struct {
+typedef struct dyn_string {
     size_t len;
     size_t capacity;
     char *buf;
@@ -9,3 +9,7 @@ typedef struct {
 dyn_string *dyn_string_new(void);
 void dyn_string_del(dyn_string *s);
 void dyn_string_push(dyn_string *s, char c);
+void dyn_string_append(dyn_string *s, const char *str);
+void dyn_string_append_n(dyn_string *s, const char *str, size_t n);
+void dyn_string_clear(dyn_string *s);
+void dyn_string_appendf(dyn_string *s, const char *fmt, ...);
@@ -0,0 +1,495 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "interp.h"
+#include "profile.h"
+#include "utils.h"
+
+lval *builtin_list(lenv *e, lval *v);
+
+// The evaluator keeps one frame per S-expression being evaluated on a
+// heap-allocated stack, so Lisp recursion depth is bounded by
+// the interpreter's `max_depth` rather than by the C stack.
+//
+// A frame with `expr == NULL` only waits for the frame above it to finish
+// so that `fn`, whose environment the frame above runs in, stays alive.
+//
+// While profiling or tracing, `callee` is the name the head of `expr` was
+// looked up under. `profiled` is set on frames whose function is on the
+// profiler's shadow stack. `traced` holds when the body of the function
+// `traced_name` started running in the frame, if it is being traced.
+typedef struct {
+    lenv *env;
+    lval *expr;
+    int next;
+    lval *fn;
+    const char *callee;
+    bool profiled;
+    long traced;
+    const char *traced_name;
+} leval_frame;
+
+static __thread leval_frame *eval_stack = NULL;
+static __thread int eval_sp = 0;
+static __thread int eval_cap = 0;
+
+static int eval_max_depth(void) {
+    clisp *c = clisp_current();
+    return c != NULL ? c->max_depth : 1000000;
+}
+
+static bool eval_push(lenv *e, lval *expr, lval *fn) {
+    if (eval_sp >= eval_max_depth()) {
+        return false;
+    }
+
+    if (eval_sp == eval_cap) {
+        eval_cap = eval_cap == 0 ? 64 : eval_cap * 2;
+        eval_stack = realloc(eval_stack, sizeof(leval_frame) * eval_cap);
+    }
+
+    leval_frame *f = &eval_stack[eval_sp++];
+    f->env = e;
+    f->expr = expr;
+    f->next = 0;
+    f->fn = fn;
+    f->callee = NULL;
+    f->profiled = false;
+    f->traced = 0;
+    return true;
+}
+
+// Whether the interpreter on this thread is recording a trace. The global
+// count keeps this to one load while nothing is traced.
+static bool eval_tracing(void) {
+    if (!ltrace_active) {
+        return false;
+    }
+    clisp *c = clisp_current();
+    return c != NULL && c->trace != NULL;
+}
+
+// The name the head of sexpr is called under, for the profiler and tracer.
+// It is interned once per call site and kept in the site's inline cache.
+static const char *eval_callee(lval_expr *sexpr, lval *head) {
+    if (head->type != LVAL_SYMBOL) {
+        return NULL;
+    }
+
+    char *k = LSTR(head->symbol);
+    lcache *c = sexpr->cache;
+    if (c == NULL || REF_SHARED(c)) {
+        return lprof_intern(k);
+    }
+    const char *name = __atomic_load_n(&c->name, __ATOMIC_ACQUIRE);
+    if (name == NULL || strcmp(name, k) != 0) {
+        name = lprof_intern(k);
+        __atomic_store_n(&c->name, name, __ATOMIC_RELEASE);
+    }
+    return name;
+}
+
+// Frees this thread's frame stack once no evaluation is using it
+void lval_eval_trim(void) {
+    if (eval_sp == 0) {
+        free(eval_stack);
+        eval_stack = NULL;
+        eval_cap = 0;
+    }
+}
+
+static lval *eval_depth_error(void) {
+    return lval_error("Maximum evaluation depth of %d exceeded", eval_max_depth());
+}
+
+// Binds the arguments in a to the formals of f, consuming a.
+// Returns an error, or NULL once the arguments are bound.
+static lval *lval_bind(lenv *e, lval *f, lval *a) {
+    lval_lambda *func = &f->lambda;
+    lval_expr *params = &func->formals->qexpr;
+
+    int passed = a->sexpr.count;
+    int expected = params->count;
+
+    while (a->sexpr.count > 0) {
+        if (params->count == 0) {
+            lval_del(a);
+            return lval_error("Function received too many arguments. Got %i, expected %i", passed, expected);
+        }
+
+        lval *symbol = lval_expr_pop(params, 0);
+
+        if (strcmp(LSTR(symbol->symbol), "&") == 0) {
+            if (params->count != 1) {
+                lval_del(a);
+                return lval_error("Syntax error: expected a single symbol after '&'");
+            }
+
+            lval *rest = lval_expr_pop(params, 0);
+            lval *list = builtin_list(e, a);
+            lenv_put(func->env, LSTR(rest->symbol), list, false);
+            lval_del(list);
+            lval_del(symbol);
+            lval_del(rest);
+            a = NULL;
+            break;
+        }
+
+        lval *val = lval_expr_pop(&a->sexpr, 0);
+
+        lenv_put(func->env, LSTR(symbol->symbol), val, false);
+
+        lval_del(symbol);
+        lval_del(val);
+    }
+
+    if (a != NULL) {
+        lval_del(a);
+    }
+
+    if (params->count > 0 &&
+        strcmp(LSTR(params->cell[0]->symbol), "&") == 0) {
+
+        if (params->count != 2) {
+            return lval_error("Syntax error: expected a single symbol after '&'");
+        }
+
+        // Delete '&'
+        lval_del(lval_expr_pop(params, 0));
+
+        // Pop next symbol and create empty list
+        lval *rest = lval_expr_pop(params, 0);
+        lval *val = lval_qexpr();
+
+        lenv_put(func->env, LSTR(rest->symbol), val, false);
+        lval_del(rest);
+        lval_del(val);
+    }
+
+    return NULL;
+}
+
+static lval *lval_body(lval *f) {
+    lval *body = lval_copy(f->lambda.body);
+    body->type = LVAL_SEXPR;
+    body->sexpr = body->qexpr;
+    return body;
+}
+
+// Evaluates anything that is not an S-expression.
+static lval *lval_eval_atom(lenv *e, lval *v) {
+    if (v->type == LVAL_SYMBOL) {
+        lval *x = lenv_get(e, LSTR(v->symbol));
+        lval_del(v);
+        return x;
+    }
+
+    return v;
+}
+
+// Resolves a thunk returned by a builtin into its value.
+lval *lval_force(lval *v) {
+    if (v->type != LVAL_THUNK) {
+        return v;
+    }
+
+    lenv *e = v->thunk.env;
+    lval *x = v->thunk.expr;
+    lval_free(v);
+    return lval_eval(e, x);
+}
+
+lval *lval_call(lenv *e, lval *f, lval *a) {
+    assert(f->type == LVAL_BUILTIN_FUNC || f->type == LVAL_LAMBDA);
+    assert(a->type == LVAL_SEXPR);
+
+    // Calls from builtins (lazy sequences, transduce, sort, the pool) are
+    // charged here, as they never pass through eval_apply
+    if (--lbudget_steps < 0) {
+        lval *err = lbudget_check();
+        if (err != NULL) {
+            lval_del(a);
+            return err;
+        }
+    }
+
+    LSTAT(calls, 1);
+    if (f->type == LVAL_BUILTIN_FUNC) {
+        return lval_force(f->builtin_func(e, a));
+    }
+
+    lval *err = lval_bind(e, f, a);
+    if (err != NULL) {
+        return err;
+    }
+
+    if (f->lambda.formals->qexpr.count == 0) {
+        f->lambda.env->parent = e;
+        bool tracing = eval_tracing();
+        if (lprof_active || tracing) {
+            long traced = tracing ? ltrace_now() : 0;
+            bool profiled = lprof_active;
+            if (profiled) {
+                lprof_enter(NULL);
+            }
+            lval *res = lval_eval(f->lambda.env, lval_body(f));
+            if (profiled) {
+                lprof_leave();
+            }
+            if (traced != 0) {
+                ltrace_call(NULL, traced);
+            }
+            return res;
+        }
+        return lval_eval(f->lambda.env, lval_body(f));
+    }
+
+    return lval_copy(f);
+}
+
+// Applies f to the already-evaluated arguments in a, consuming a but not f.
+lval *lval_apply(lenv *e, lval *f, lval *a) {
+    lval *fn = lval_copy(f);
+    lval *res = lval_call(e, fn, a);
+    lval_del(fn);
+    return res;
+}
+
+// Applies the fully evaluated S-expression in the top frame. Returns the
+// result, or NULL if the top frame has been set up to continue evaluating
+// (a thunk or a lambda body).
+static lval *eval_apply(void) {
+    leval_frame *frame = &eval_stack[eval_sp - 1];
+    lval *v = frame->expr;
+    lval_expr *sexpr = &v->sexpr;
+    LSTAT(evals, 1);
+
+    if (--lbudget_steps < 0) {
+        lval *err = lbudget_check();
+        if (err != NULL) {
+            lval_del(v);
+            return err;
+        }
+    }
+
+    for (int i = 0; i < sexpr->count; i++) {
+        if (sexpr->cell[i]->type == LVAL_ERROR) {
+            return lval_take(v, i);
+        }
+    }
+
+    if (sexpr->count == 0) { return v; }
+    if (sexpr->count == 1) { return lval_take(v, 0); }
+
+    lval *f = lval_expr_pop(sexpr, 0);
+    lbuiltin builtin = NULL;
+    if (f->type == LVAL_SYMBOL) {
+        // Head left unresolved by a cache hit on a builtin
+        lcache *c = sexpr->cache;
+        if (c != NULL && lcache_valid(c, LSTR(f->symbol)) &&
+            c->entry->val->type == LVAL_BUILTIN_FUNC) {
+            builtin = c->entry->val->builtin_func;
+            lval_del(f);
+            f = NULL;
+        } else {
+            lval *x = lenv_get(frame->env, LSTR(f->symbol));
+            lval_del(f);
+            f = x;
+            if (f->type == LVAL_ERROR) {
+                lval_del(v);
+                return f;
+            }
+        }
+    } else if (f->type == LVAL_BUILTIN_FUNC) {
+        builtin = f->builtin_func;
+    }
+
+    if (builtin != NULL) {
+        LSTAT(calls, 1);
+        // Checked once, as `profile` itself turns profiling on and off
+        bool profiled = lprof_active;
+        if (profiled) {
+            lprof_enter(frame->callee);
+        }
+        const char *callee = frame->callee;
+        long traced = eval_tracing() ? ltrace_now() : 0;
+        lval *res = builtin(frame->env, v);
+        if (profiled) {
+            lprof_leave();
+        }
+        if (traced != 0) {
+            ltrace_call(callee, traced);
+        }
+        if (f != NULL) { lval_del(f); }
+        if (res->type != LVAL_THUNK) {
+            return res;
+        }
+
+        // Continue with the thunk in this frame
+        frame = &eval_stack[eval_sp - 1];
+        lenv *e = res->thunk.env;
+        lval *x = res->thunk.expr;
+        lval_free(res);
+        if (x->type != LVAL_SEXPR) {
+            return lval_eval_atom(e, x);
+        }
+
+        frame->env = e;
+        frame->expr = x;
+        frame->next = 0;
+        return NULL;
+    }
+
+    if (f->type != LVAL_LAMBDA) {
+        lval_del(f);
+        lval_del(v);
+        return lval_error("S-expression does not start with a function!");
+    }
+
+    LSTAT(calls, 1);
+    lval *err = lval_bind(frame->env, f, v);
+    if (err != NULL) {
+        lval_del(f);
+        return err;
+    }
+    if (f->lambda.formals->qexpr.count > 0) {
+        return f;
+    }
+
+    f->lambda.env->parent = frame->env;
+    bool profiled = lprof_active;
+    if (profiled) {
+        lprof_enter(frame->callee);
+    }
+    long traced = eval_tracing() ? ltrace_now() : 0;
+    if (frame->fn == NULL) {
+        frame->env = f->lambda.env;
+        frame->expr = lval_body(f);
+        frame->next = 0;
+        frame->fn = f;
+        frame->profiled = profiled;
+        frame->traced = traced;
+        frame->traced_name = frame->callee;
+        return NULL;
+    }
+
+    // This frame must keep its own function alive while the body runs
+    if (eval_sp >= eval_max_depth()) {
+        if (profiled) {
+            lprof_leave();
+        }
+        lval_del(f);
+        return eval_depth_error();
+    }
+    const char *callee = frame->callee;
+    frame->expr = NULL;
+    eval_push(f->lambda.env, lval_body(f), f);
+    eval_stack[eval_sp - 1].profiled = profiled;
+    eval_stack[eval_sp - 1].traced = traced;
+    eval_stack[eval_sp - 1].traced_name = callee;
+    return NULL;
+}
+
+lval *lval_eval(lenv* e, lval* v) {
+    if (v->type != LVAL_SEXPR) {
+        return lval_eval_atom(e, v);
+    }
+
+    int base = eval_sp;
+    if (!eval_push(e, v, NULL)) {
+        lval_del(v);
+        return eval_depth_error();
+    }
+
+    lval *ret = NULL;
+    while (true) {
+        leval_frame *frame = &eval_stack[eval_sp - 1];
+
+        if (ret != NULL) {
+            if (frame->expr == NULL) {
+                // Waiting frame: pass the result through
+                if (frame->fn != NULL) {
+                    lval_del(frame->fn);
+                }
+                if (frame->profiled) {
+                    lprof_leave();
+                }
+                if (frame->traced != 0) {
+                    ltrace_call(frame->traced_name, frame->traced);
+                }
+                eval_sp--;
+                if (eval_sp == base) {
+                    return ret;
+                }
+                continue;
+            }
+
+            frame->expr->sexpr.cell[frame->next++] = ret;
+            ret = NULL;
+        }
+
+        // Evaluate children, descending into nested S-expressions
+        lval_expr *sexpr = &frame->expr->sexpr;
+        bool descended = false;
+        while (frame->next < sexpr->count) {
+            lval *child = sexpr->cell[frame->next];
+
+            if (frame->next == 0 && (lprof_active || eval_tracing())) {
+                frame->callee = eval_callee(sexpr, child);
+            }
+
+            if (child->type == LVAL_SYMBOL && frame->next == 0 &&
+                sexpr->cache != NULL && sexpr->count > 1) {
+                lenv_entry *entry = lcache_lookup(sexpr->cache, frame->env, LSTR(child->symbol));
+                if (entry != NULL) {
+                    // Builtins are dispatched from the cache in eval_apply,
+                    // saving the copy of the function value
+                    if (entry->val->type != LVAL_BUILTIN_FUNC) {
+                        sexpr->cell[0] = lval_copy(entry->val);
+                        lval_del(child);
+                    }
+                    frame->next++;
+                    continue;
+                }
+            }
+
+            if (child->type != LVAL_SEXPR) {
+                sexpr->cell[frame->next++] = lval_eval_atom(frame->env, child);
+                continue;
+            }
+
+            if (!eval_push(frame->env, child, NULL)) {
+                lval_del(child);
+                sexpr->cell[frame->next++] = eval_depth_error();
+                continue;
+            }
+            descended = true;
+            break;
+        }
+        if (descended) {
+            continue;
+        }
+
+        ret = eval_apply();
+        if (ret == NULL) {
+            continue;
+        }
+
+        frame = &eval_stack[eval_sp - 1];
+        if (frame->fn != NULL) {
+            lval_del(frame->fn);
+        }
+        if (frame->profiled) {
+            lprof_leave();
+        }
+        if (frame->traced != 0) {
+            ltrace_call(frame->traced_name, frame->traced);
+        }
+        eval_sp--;
+        if (eval_sp == base) {
+            return ret;
+        }
+    }
+}
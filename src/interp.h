@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "clisp.h"
+#include "stats.h"
+#include "budget.h"
+#include "trace.h"
+
+typedef struct lenv lenv;
+struct dyn_string;
+
+struct clisp {
+    lenv *env;
+    clisp_alloc_fn alloc;
+    void *alloc_ud;
+    clisp_write_fn write;
+    void *write_ud;
+    int max_depth;
+
+    // Output is collected here and handed to `write` in one piece once it
+    // grows past `out_limit`, or when the outermost API call returns
+    struct dyn_string *out;
+    size_t out_limit;
+    // Serialises output from pool threads
+    pthread_mutex_t out_lock;
+
+    // Bumped on every write to the root environment, see lcache
+    unsigned long version;
+    // Names that have ever been bound outside the root environment
+    unsigned long shadowed[16];
+
+    bool exited;
+    int exit_code;
+    // Set by clisp_interrupt, checked with the budget
+    int interrupted;
+    lbudget budget;
+    // Bytes held from the default allocator, see clisp_count_heap
+    bool heap_counted;
+    long heap_live;
+
+    // Totals of the threads' counters, see stats.h
+    lstats stats;
+    // Timeline being recorded, see trace.h
+    ltrace *trace;
+};
+
+void clisp_clear_interrupt(clisp *c);
+// Starts counting the bytes c holds, which costs a lookup of the block size
+// on every allocation and is only possible with the default allocator.
+// Blocks allocated before are not counted, and freeing them does not take
+// the count below zero, so a heap budget is measured against
+// clisp_heap_live at the time it is set.
+bool clisp_count_heap(clisp *c);
+long clisp_heap_live(clisp *c);
+
+// The interpreter running on this thread, NULL outside of the API
+clisp *clisp_current(void);
+clisp *clisp_enter(clisp *c);
+void clisp_leave(clisp *prev);
+
+void *lmalloc(size_t size);
+void *lcalloc(size_t count, size_t size);
+void *lrealloc(void *ptr, size_t size);
+void lfree(void *ptr);
+
+// Printing appends to the buffer returned by lout_begin, which must be
+// handed back to lout_end
+struct dyn_string *lout_begin(void);
+void lout_end(struct dyn_string *out);
+void lprintf(const char *fmt, ...);
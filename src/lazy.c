@@ -0,0 +1,337 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lval.h"
+#include "dyn_string.h"
+#include "lazy.h"
+#include "builtins.h"
+#include "utils.h"
+#include "interp.h"
+
+static lseq *lseq_new(enum LSEQ_KIND kind) {
+    lseq *s = lmalloc(sizeof(lseq));
+    s->kind = kind;
+    s->refs = 1;
+    s->f = NULL;
+    s->src = NULL;
+    s->inner = NULL;
+    s->start = 0;
+    s->end = 0;
+    s->step = 0;
+    return s;
+}
+
+lseq *lseq_retain(lseq *s) {
+    REF_RETAIN(s);
+    return s;
+}
+
+void lseq_release(lseq *s) {
+    if (REF_RELEASE(s) > 0) {
+        return;
+    }
+
+    if (s->f != NULL) { lval_del(s->f); }
+    if (s->src != NULL) { lval_del(s->src); }
+    if (s->inner != NULL) { lseq_release(s->inner); }
+    lfree(s);
+}
+
+lseq_iter *lseq_iter_new(lseq *s) {
+    lseq_iter *it = lmalloc(sizeof(lseq_iter));
+    it->seq = lseq_retain(s);
+    it->inner = s->inner != NULL ? lseq_iter_new(s->inner) : NULL;
+    it->pos = s->kind == LSEQ_RANGE ? s->start : 0;
+    it->cur = NULL;
+    it->file = NULL;
+    it->done = false;
+    return it;
+}
+
+void lseq_iter_del(lseq_iter *it) {
+    if (it->inner != NULL) { lseq_iter_del(it->inner); }
+    if (it->cur != NULL) { lval_del(it->cur); }
+    if (it->file != NULL) { fclose(it->file); }
+    lseq_release(it->seq);
+    lfree(it);
+}
+
+// Calls f on a single argument, consuming the argument but not f.
+static lval *lseq_apply(lenv *e, lval *f, lval *x) {
+    lval *args = lval_sexpr();
+    lval_expr_push_back(&args->sexpr, x);
+    return lval_apply(e, f, args);
+}
+
+// Runs a predicate on a copy of x. Returns NULL on success and stores the
+// outcome in `keep`, otherwise returns the error to propagate.
+static lval *lseq_test(lenv *e, lval *f, lval *x, bool *keep) {
+    lval *res = lseq_apply(e, f, lval_copy(x));
+    if (res->type == LVAL_ERROR) {
+        return res;
+    }
+    if (res->type != LVAL_BOOL) {
+        lval *err = lval_error("Lazy sequence predicate must return a bool, got %s", 
+                               lval_type_name(res->type));
+        lval_del(res);
+        return err;
+    }
+
+    *keep = res->_bool;
+    lval_del(res);
+    return NULL;
+}
+
+// Reads one line from the iterator's file, without the trailing newline.
+static lval *lseq_read_line(lseq_iter *it) {
+    if (it->file == NULL) {
+        it->file = fopen(LSTR(it->seq->src->string), "rb");
+        if (it->file == NULL) {
+            return lval_error("Could not open file %s", LSTR(it->seq->src->string));
+        }
+    }
+
+    int c = getc(it->file);
+    if (c == EOF) {
+        return NULL;
+    }
+
+    dyn_string *str = dyn_string_new();
+    while (c != EOF && c != '\n') {
+        dyn_string_push(str, c);
+        c = getc(it->file);
+    }
+
+    lval *x = lval_string_n(str->buf, str->len);
+    dyn_string_del(str);
+    return x;
+}
+
+// Produces the next element of the sequence, or NULL once it is exhausted.
+// Errors raised by user functions are returned as LVAL_ERROR and end the
+// iteration.
+lval *lseq_iter_next(lenv *e, lseq_iter *it) {
+    if (it->done) {
+        return NULL;
+    }
+
+    lseq *s = it->seq;
+    lval *x = NULL;
+
+    switch (s->kind) {
+        case LSEQ_LIST:
+            if (it->pos < s->src->qexpr.count) {
+                x = lval_copy(s->src->qexpr.cell[it->pos++]);
+            }
+            break;
+        case LSEQ_RANGE:
+            if ((s->step > 0 && it->pos < s->end) || 
+                (s->step < 0 && it->pos > s->end)) {
+                x = lval_int(it->pos);
+                it->pos += s->step;
+            }
+            break;
+        case LSEQ_ITERATE:
+            if (it->cur == NULL) {
+                it->cur = lval_copy(s->src);
+            } else {
+                it->cur = lseq_apply(e, s->f, it->cur);
+            }
+            x = lval_copy(it->cur);
+            break;
+        case LSEQ_MAP:
+            x = lseq_iter_next(e, it->inner);
+            if (x != NULL && x->type != LVAL_ERROR) {
+                x = lseq_apply(e, s->f, x);
+            }
+            break;
+        case LSEQ_FILTER:
+        case LSEQ_TAKE_WHILE:
+            while ((x = lseq_iter_next(e, it->inner)) != NULL) {
+                if (x->type == LVAL_ERROR) {
+                    break;
+                }
+
+                bool keep = false;
+                lval *err = lseq_test(e, s->f, x, &keep);
+                if (err != NULL) {
+                    lval_del(x);
+                    x = err;
+                    break;
+                }
+                if (keep) {
+                    break;
+                }
+
+                lval_del(x);
+                x = NULL;
+                if (s->kind == LSEQ_TAKE_WHILE) {
+                    break;
+                }
+            }
+            break;
+        case LSEQ_FILE:
+            x = lseq_read_line(it);
+            break;
+        case LSEQ_TAKE:
+            if (it->pos < s->end) {
+                it->pos++;
+                x = lseq_iter_next(e, it->inner);
+            }
+            break;
+    }
+
+    if (x == NULL || x->type == LVAL_ERROR) {
+        it->done = true;
+    }
+    return x;
+}
+
+lval *lseq_force(lenv *e, lseq *s) {
+    lval *res = lval_qexpr();
+    lseq_iter *it = lseq_iter_new(s);
+
+    lval *x;
+    while ((x = lseq_iter_next(e, it)) != NULL) {
+        if (x->type == LVAL_ERROR) {
+            lval_del(res);
+            res = x;
+            break;
+        }
+        lval_expr_push_back(&res->qexpr, x);
+    }
+
+    lseq_iter_del(it);
+    return res;
+}
+
+bool lval_is_seq(lval *v) {
+    return v->type == LVAL_QEXPR || v->type == LVAL_LAZY;
+}
+
+// Takes ownership of a Q-expression or lazy sequence and returns a reference
+// to it as a lazy sequence.
+lseq *lseq_from(lval *v) {
+    assert(lval_is_seq(v));
+
+    if (v->type == LVAL_LAZY) {
+        lseq *s = lseq_retain(v->lazy);
+        lval_del(v);
+        return s;
+    }
+
+    lseq *s = lseq_new(LSEQ_LIST);
+    s->src = v;
+    return s;
+}
+
+lval *builtin_range(UNUSED lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count >= 1 && v->sexpr.count <= 3,
+            "Function 'range' expects between 1 and 3 arguments, got %d", v->sexpr.count);
+    LASSERT_ARG_TYPES(v, LVAL_INT);
+
+    lval_expr *args = &v->sexpr;
+    lseq *s = lseq_new(LSEQ_RANGE);
+    s->step = 1;
+
+    if (args->count == 1) {
+        s->end = args->cell[0]->_int;
+    } else {
+        s->start = args->cell[0]->_int;
+        s->end = args->cell[1]->_int;
+    }
+    if (args->count == 3) {
+        s->step = args->cell[2]->_int;
+    }
+
+    lval_del(v);
+    if (s->step == 0) {
+        lseq_release(s);
+        return lval_error("Function 'range' requires a non-zero step");
+    }
+    return lval_lazy(s);
+}
+
+lval *builtin_iterate(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("iterate", v, 2);
+    LASSERT(v, lval_is_func(v->sexpr.cell[0]),
+            "Function 'iterate' expects a function as first argument, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    lseq *s = lseq_new(LSEQ_ITERATE);
+    s->f = lval_expr_pop(&v->sexpr, 0);
+    s->src = lval_take(v, 0);
+    return lval_lazy(s);
+}
+
+lval *builtin_lazy(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("lazy", v, 1);
+    LASSERT(v, lval_is_seq(v->sexpr.cell[0]),
+            "Function 'lazy' expects a Q-expression, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    return lval_lazy(lseq_from(lval_take(v, 0)));
+}
+
+static lval *builtin_lazy_func(lval *v, char *func, enum LSEQ_KIND kind) {
+    LASSERT_ARG_COUNT(func, v, 2);
+    LASSERT(v, lval_is_func(v->sexpr.cell[0]),
+            "Function '%s' expects a function as first argument, got %s",
+            func, lval_type_name(v->sexpr.cell[0]->type));
+    LASSERT(v, lval_is_seq(v->sexpr.cell[1]),
+            "Function '%s' expects a sequence as second argument, got %s",
+            func, lval_type_name(v->sexpr.cell[1]->type));
+
+    lseq *s = lseq_new(kind);
+    s->f = lval_expr_pop(&v->sexpr, 0);
+    s->inner = lseq_from(lval_take(v, 0));
+    return lval_lazy(s);
+}
+
+lval *builtin_lazy_map(UNUSED lenv *e, lval *v) {
+    return builtin_lazy_func(v, "lazy-map", LSEQ_MAP);
+}
+
+lval *builtin_lazy_filter(UNUSED lenv *e, lval *v) {
+    return builtin_lazy_func(v, "lazy-filter", LSEQ_FILTER);
+}
+
+lval *builtin_take_while(UNUSED lenv *e, lval *v) {
+    return builtin_lazy_func(v, "take-while", LSEQ_TAKE_WHILE);
+}
+
+lval *builtin_lazy_take(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("lazy-take", v, 2);
+    LASSERT_ARG_TYPE("lazy-take", v, 0, LVAL_INT);
+    LASSERT(v, lval_is_seq(v->sexpr.cell[1]),
+            "Function 'lazy-take' expects a sequence as second argument, got %s",
+            lval_type_name(v->sexpr.cell[1]->type));
+
+    lseq *s = lseq_new(LSEQ_TAKE);
+    s->end = v->sexpr.cell[0]->_int;
+    s->inner = lseq_from(lval_take(v, 1));
+    return lval_lazy(s);
+}
+
+lval *builtin_file_lines(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("file-lines", v, 1);
+    LASSERT_ARG_TYPE("file-lines", v, 0, LVAL_STRING);
+
+    lseq *s = lseq_new(LSEQ_FILE);
+    s->src = lval_take(v, 0);
+    lstr_cstr(&s->src->string);
+    return lval_lazy(s);
+}
+
+lval *builtin_force(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("force", v, 1);
+    LASSERT(v, lval_is_seq(v->sexpr.cell[0]),
+            "Function 'force' expects a sequence, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    lseq *s = lseq_from(lval_take(v, 0));
+    lval *res = lseq_force(e, s);
+    lseq_release(s);
+    return res;
+}
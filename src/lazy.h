@@ -0,0 +1,62 @@
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct lenv lenv;
+typedef struct lval lval;
+
+enum LSEQ_KIND {
+    LSEQ_LIST,
+    LSEQ_RANGE,
+    LSEQ_ITERATE,
+    LSEQ_MAP,
+    LSEQ_FILTER,
+    LSEQ_TAKE_WHILE,
+    LSEQ_TAKE,
+    LSEQ_FILE,
+};
+
+// An immutable description of a lazy sequence. Values are only produced
+// when an iterator walks it, so sequences are shared by reference count
+// rather than deep-copied.
+typedef struct lseq lseq;
+struct lseq {
+    enum LSEQ_KIND kind;
+    int refs;
+    lval *f;
+    lval *src;
+    lseq *inner;
+    long start;
+    long end;
+    long step;
+};
+
+typedef struct lseq_iter lseq_iter;
+struct lseq_iter {
+    lseq *seq;
+    lseq_iter *inner;
+    long pos;
+    lval *cur;
+    FILE *file;
+    bool done;
+};
+
+lseq *lseq_retain(lseq *s);
+void lseq_release(lseq *s);
+
+lseq_iter *lseq_iter_new(lseq *s);
+lval *lseq_iter_next(lenv *e, lseq_iter *it);
+void lseq_iter_del(lseq_iter *it);
+
+bool lval_is_seq(lval *v);
+lseq *lseq_from(lval *v);
+lval *lseq_force(lenv *e, lseq *s);
+
+lval *builtin_range(lenv *e, lval *v);
+lval *builtin_iterate(lenv *e, lval *v);
+lval *builtin_lazy(lenv *e, lval *v);
+lval *builtin_lazy_map(lenv *e, lval *v);
+lval *builtin_lazy_filter(lenv *e, lval *v);
+lval *builtin_take_while(lenv *e, lval *v);
+lval *builtin_lazy_take(lenv *e, lval *v);
+lval *builtin_file_lines(lenv *e, lval *v);
+lval *builtin_force(lenv *e, lval *v);
@@ -0,0 +1,218 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "lstring.h"
+#include "bignum.h"
+#include "builtins.h"
+#include "dyn_string.h"
+#include "utils.h"
+#include "interp.h"
+
+static lval *lval_lstr(lstr *s) {
+    lval *v = lval_alloc();
+    v->type = LVAL_STRING;
+    v->string = *s;
+    return v;
+}
+
+// Returns the offset of the first needle in haystack at or after start,
+// or -1 if there is none
+static long lstr_find(lstr *haystack, lstr *needle, size_t start) {
+    if (needle->len == 0) {
+        return start <= haystack->len ? (long)start : -1;
+    }
+    if (needle->len > haystack->len) {
+        return -1;
+    }
+
+    const char *h = LSTR(*haystack);
+    const char *n = LSTR(*needle);
+    size_t last = haystack->len - needle->len;
+
+    for (size_t i = start; i <= last; i++) {
+        const char *p = memchr(h + i, n[0], last - i + 1);
+        if (p == NULL) {
+            break;
+        }
+        i = p - h;
+        if (memcmp(p, n, needle->len) == 0) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+lval *builtin_str_concat(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_TYPES(v, LVAL_STRING);
+
+    lstr acc;
+    lstr_init(&acc, "", 0);
+    for (int i = 0; i < v->sexpr.count; i++) {
+        lstr res;
+        lstr_concat(&res, &acc, &v->sexpr.cell[i]->string);
+        lstr_free(&acc);
+        acc = res;
+    }
+
+    lval_del(v);
+    return lval_lstr(&acc);
+}
+
+lval *builtin_substr(UNUSED lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count == 2 || v->sexpr.count == 3,
+            "Function 'substr' expects 2 or 3 arguments, got %d", v->sexpr.count);
+    LASSERT_ARG_TYPE("substr", v, 0, LVAL_STRING);
+    LASSERT_ARG_TYPE("substr", v, 1, LVAL_INT);
+
+    lstr *s = &v->sexpr.cell[0]->string;
+    long start = v->sexpr.cell[1]->_int;
+    long len = (long)s->len - start;
+    if (v->sexpr.count == 3) {
+        LASSERT_ARG_TYPE("substr", v, 2, LVAL_INT);
+        len = v->sexpr.cell[2]->_int;
+    }
+
+    LASSERT(v, start >= 0 && len >= 0 && start + len <= (long)s->len,
+            "Function 'substr' range %ld+%ld out of bounds for string of length %ld",
+            start, len, (long)s->len);
+
+    lstr res;
+    lstr_sub(&res, s, start, len);
+    lval_del(v);
+    return lval_lstr(&res);
+}
+
+lval *builtin_str_len(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("str-len", v, 1);
+    LASSERT_ARG_TYPE("str-len", v, 0, LVAL_STRING);
+
+    long len = v->sexpr.cell[0]->string.len;
+    lval_del(v);
+    return lval_int(len);
+}
+
+lval *builtin_str_split(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("str-split", v, 2);
+    LASSERT_ARG_TYPE("str-split", v, 0, LVAL_STRING);
+    LASSERT_ARG_TYPE("str-split", v, 1, LVAL_STRING);
+    LASSERT(v, v->sexpr.cell[1]->string.len > 0,
+            "Function 'str-split' expects a non-empty separator");
+
+    lstr *s = &v->sexpr.cell[0]->string;
+    lstr *sep = &v->sexpr.cell[1]->string;
+    lval *res = lval_qexpr();
+
+    size_t start = 0;
+    while (true) {
+        long at = lstr_find(s, sep, start);
+        size_t end = at < 0 ? s->len : (size_t)at;
+
+        lstr part;
+        lstr_sub(&part, s, start, end - start);
+        lval_expr_push_back(&res->qexpr, lval_lstr(&part));
+
+        if (at < 0) {
+            break;
+        }
+        start = end + sep->len;
+    }
+
+    lval_del(v);
+    return res;
+}
+
+lval *builtin_str_join(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("str-join", v, 2);
+    LASSERT_ARG_TYPE("str-join", v, 0, LVAL_STRING);
+    LASSERT_ARG_TYPE("str-join", v, 1, LVAL_QEXPR);
+
+    lstr *sep = &v->sexpr.cell[0]->string;
+    lval_expr *parts = &v->sexpr.cell[1]->qexpr;
+
+    size_t len = 0;
+    for (int i = 0; i < parts->count; i++) {
+        LASSERT(v, parts->cell[i]->type == LVAL_STRING,
+                "Function 'str-join' expects a list of strings, got %s",
+                lval_type_name(parts->cell[i]->type));
+        len += parts->cell[i]->string.len + (i > 0 ? sep->len : 0);
+    }
+
+    lstr res;
+    char *p = lstr_reserve(&res, len);
+    for (int i = 0; i < parts->count; i++) {
+        if (i > 0) {
+            memcpy(p, LSTR(*sep), sep->len);
+            p += sep->len;
+        }
+        lstr *part = &parts->cell[i]->string;
+        memcpy(p, LSTR(*part), part->len);
+        p += part->len;
+    }
+
+    lval_del(v);
+    return lval_lstr(&res);
+}
+
+lval *builtin_str_find(UNUSED lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count == 2 || v->sexpr.count == 3,
+            "Function 'str-find' expects 2 or 3 arguments, got %d", v->sexpr.count);
+    LASSERT_ARG_TYPE("str-find", v, 0, LVAL_STRING);
+    LASSERT_ARG_TYPE("str-find", v, 1, LVAL_STRING);
+
+    long start = 0;
+    if (v->sexpr.count == 3) {
+        LASSERT_ARG_TYPE("str-find", v, 2, LVAL_INT);
+        start = v->sexpr.cell[2]->_int;
+    }
+    LASSERT(v, start >= 0 && start <= (long)v->sexpr.cell[0]->string.len,
+            "Function 'str-find' start %ld out of bounds", start);
+
+    long at = lstr_find(&v->sexpr.cell[0]->string, &v->sexpr.cell[1]->string, start);
+    lval_del(v);
+    return lval_int(at);
+}
+
+lval *builtin_str_to_num(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("str->num", v, 1);
+    LASSERT_ARG_TYPE("str->num", v, 0, LVAL_STRING);
+
+    char *s = lstr_cstr(&v->sexpr.cell[0]->string);
+    size_t len = v->sexpr.cell[0]->string.len;
+    char *end;
+    lval *res = NULL;
+
+    errno = 0;
+    long x = strtol(s, &end, 10);
+    if (len > 0 && end == s + len) {
+        res = errno != ERANGE ? lval_int(x) : lval_bigint_parse(s);
+    }
+    if (res == NULL) {
+        errno = 0;
+        double d = strtod(s, &end);
+        if (len > 0 && end == s + len && errno != ERANGE) {
+            res = lval_double(d);
+        }
+    }
+
+    if (res == NULL) {
+        res = lval_error("Function 'str->num' could not parse \"%s\" as a number", s);
+    }
+    lval_del(v);
+    return res;
+}
+
+lval *builtin_num_to_str(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("num->str", v, 1);
+    LASSERT(v, lval_is_integer(v->sexpr.cell[0]) || v->sexpr.cell[0]->type == LVAL_DOUBLE,
+            "Function 'num->str' expects a number, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    dyn_string *out = dyn_string_new();
+    lval_write(out, v->sexpr.cell[0]);
+    lval *res = lval_string_n(out->buf, out->len);
+    dyn_string_del(out);
+    lval_del(v);
+    return res;
+}
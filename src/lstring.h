@@ -0,0 +1,11 @@
+typedef struct lenv lenv;
+typedef struct lval lval;
+
+lval *builtin_str_concat(lenv *e, lval *v);
+lval *builtin_substr(lenv *e, lval *v);
+lval *builtin_str_len(lenv *e, lval *v);
+lval *builtin_str_split(lenv *e, lval *v);
+lval *builtin_str_join(lenv *e, lval *v);
+lval *builtin_str_find(lenv *e, lval *v);
+lval *builtin_str_to_num(lenv *e, lval *v);
+lval *builtin_num_to_str(lenv *e, lval *v);
@@ -5,11 +5,21 @@
 #include <assert.h>
 #include <string.h>
 #include "lval.h"
+#include "lazy.h"
+#include "transduce.h"
+#include "map.h"
+#include "vec.h"
+#include "bignum.h"
+#include "pool.h"
+#include "utils.h"
+#include "interp.h"
+#include "dyn_string.h"
 
 
 char *lval_type_name(enum LVAL_TYPE type) {
     switch (type) {
         case LVAL_INT: return "int";
+        case LVAL_BIGINT: return "bigint";
         case LVAL_DOUBLE: return "double";
         case LVAL_BOOL: return "bool";
         case LVAL_STRING: return "string";
@@ -18,89 +28,341 @@ char *lval_type_name(enum LVAL_TYPE type) {
         case LVAL_QEXPR: return "q-expression";
         case LVAL_BUILTIN_FUNC: return "function";
         case LVAL_LAMBDA: return "function";
+        case LVAL_LAZY: return "lazy sequence";
+        case LVAL_XFORM: return "transducer";
+        case LVAL_MAP: return "map";
+        case LVAL_VEC: return "vector";
+        case LVAL_THUNK: return "thunk";
         case LVAL_ERROR: return "error";
     }
 
     return "unknown";
 }
 
+lval *lval_alloc(void) {
+    LSTAT(lvals, 1);
+    return lmalloc(sizeof(lval));
+}
+
+void lval_free(lval *v) {
+    LSTAT(lvals_freed, 1);
+    lfree(v);
+}
+
 lval *lval_int(long x) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_INT;
     v->_int = x;
     return v;
 }
 
 lval *lval_double(double x) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_DOUBLE;
     v->_double = x;
     return v;
 }
 
-lval *lval_string(char *s) {
-    lval *v = malloc(sizeof(lval));
+static lstr_flat *lstr_flat_new(size_t len) {
+    lstr_flat *f = lmalloc(sizeof(lstr_flat) + len + 1);
+    f->node.refs = 1;
+    f->node.kind = LSTR_FLAT;
+    f->len = len;
+    f->data[len] = '\0';
+    return f;
+}
+
+static void lstr_set_flat(lstr *s, lstr_flat *f, size_t off, size_t len) {
+    s->len = len;
+    if (len <= LSTR_SMALL) {
+        memcpy(s->small, f->data + off, len);
+        s->small[len] = '\0';
+        return;
+    }
+
+    REF_RETAIN(&f->node);
+    s->node = &f->node;
+    s->off = off;
+}
+
+// Sets s to len uninitialised bytes and returns them for the caller to fill
+char *lstr_reserve(lstr *s, size_t len) {
+    s->len = len;
+    if (len <= LSTR_SMALL) {
+        s->small[len] = '\0';
+        return s->small;
+    }
+
+    lstr_flat *f = lstr_flat_new(len);
+    s->node = &f->node;
+    s->off = 0;
+    return f->data;
+}
+
+void lstr_init(lstr *s, const char *buf, size_t len) {
+    memcpy(lstr_reserve(s, len), buf, len);
+}
+
+void lstr_copy(lstr *dst, lstr *src) {
+    *dst = *src;
+    if (src->len > LSTR_SMALL) {
+        REF_RETAIN(src->node);
+    }
+}
+
+// Releases a node. Ropes can be arbitrarily deep, so nodes whose last
+// reference is dropped are kept on an explicit stack instead of recursing.
+static void lstr_node_release(lstr_node *n) {
+    lstr_node **stack = NULL;
+    int sp = 0;
+    int cap = 0;
+
+    while (n != NULL) {
+        if (REF_RELEASE(n) == 0) {
+            if (n->kind == LSTR_CONCAT) {
+                lstr_rope *c = (lstr_rope*)n;
+                lstr_node *children[3] = {
+                    c->flat != NULL ? &c->flat->node : NULL,
+                    c->left.len > LSTR_SMALL ? c->left.node : NULL,
+                    c->right.len > LSTR_SMALL ? c->right.node : NULL,
+                };
+                for (int i = 0; i < 3; i++) {
+                    if (children[i] == NULL) {
+                        continue;
+                    }
+                    if (sp == cap) {
+                        cap = cap == 0 ? 16 : cap * 2;
+                        stack = lrealloc(stack, sizeof(lstr_node*) * cap);
+                    }
+                    stack[sp++] = children[i];
+                }
+            }
+            lfree(n);
+        }
+        n = sp > 0 ? stack[--sp] : NULL;
+    }
+
+    lfree(stack);
+}
+
+void lstr_free(lstr *s) {
+    if (s->len > LSTR_SMALL) {
+        lstr_node_release(s->node);
+    }
+}
+
+// Copies the contents of a rope into one flat buffer. Walks the rope with an
+// explicit stack so deep left-leaning ropes built by appending in a loop
+// cannot overflow the C stack.
+static lstr_flat *lstr_flatten(lstr_rope *c) {
+    lstr_flat *cached = __atomic_load_n(&c->flat, __ATOMIC_ACQUIRE);
+    if (cached != NULL) {
+        return cached;
+    }
+
+    lstr_flat *f = lstr_flat_new(c->left.len + c->right.len);
+    char *p = f->data;
+
+    lstr **stack = lmalloc(sizeof(lstr*) * 16);
+    int sp = 0;
+    int cap = 16;
+    stack[sp++] = &c->right;
+    stack[sp++] = &c->left;
+
+    while (sp > 0) {
+        lstr *x = stack[--sp];
+        if (x->len <= LSTR_SMALL) {
+            memcpy(p, x->small, x->len);
+        } else if (x->node->kind == LSTR_FLAT) {
+            memcpy(p, ((lstr_flat*)x->node)->data + x->off, x->len);
+        } else {
+            lstr_rope *inner = (lstr_rope*)x->node;
+            lstr_flat *inner_flat = __atomic_load_n(&inner->flat, __ATOMIC_ACQUIRE);
+            if (inner_flat != NULL) {
+                memcpy(p, inner_flat->data, x->len);
+            } else {
+                if (sp + 2 > cap) {
+                    cap *= 2;
+                    stack = lrealloc(stack, sizeof(lstr*) * cap);
+                }
+                stack[sp++] = &inner->right;
+                stack[sp++] = &inner->left;
+                continue;
+            }
+        }
+        p += x->len;
+    }
+    lfree(stack);
+
+    // Another thread may have flattened the same rope in the meantime
+    lstr_flat *expected = NULL;
+    if (!__atomic_compare_exchange_n(&c->flat, &expected, f, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        lfree(f);
+        return expected;
+    }
+    return f;
+}
+
+char *lstr_bytes(lstr *s) {
+    if (s->len <= LSTR_SMALL) {
+        return s->small;
+    }
+    if (s->node->kind == LSTR_FLAT) {
+        return ((lstr_flat*)s->node)->data + s->off;
+    }
+    return lstr_flatten((lstr_rope*)s->node)->data;
+}
+
+// Returns the contents of s NUL-terminated, replacing a substring view
+// with its own copy if needed. Only for values the caller owns.
+char *lstr_cstr(lstr *s) {
+    char *bytes = lstr_bytes(s);
+    if (bytes[s->len] == '\0') {
+        return bytes;
+    }
+
+    lstr copy;
+    lstr_init(&copy, bytes, s->len);
+    lstr_free(s);
+    *s = copy;
+    return LSTR(*s);
+}
+
+bool lstr_eq(lstr *a, lstr *b) {
+    return a->len == b->len && memcmp(LSTR(*a), LSTR(*b), a->len) == 0;
+}
+
+// Strings up to this length are concatenated by copying
+#define LSTR_COPY_MAX 64
+
+void lstr_concat(lstr *dst, lstr *a, lstr *b) {
+    size_t len = a->len + b->len;
+    if (len <= LSTR_COPY_MAX) {
+        char buf[LSTR_COPY_MAX];
+        memcpy(buf, LSTR(*a), a->len);
+        memcpy(buf + a->len, LSTR(*b), b->len);
+        lstr_init(dst, buf, len);
+        return;
+    }
+
+    lstr_rope *c = lmalloc(sizeof(lstr_rope));
+    c->node.refs = 1;
+    c->node.kind = LSTR_CONCAT;
+    lstr_copy(&c->left, a);
+    lstr_copy(&c->right, b);
+    c->flat = NULL;
+
+    dst->len = len;
+    dst->node = &c->node;
+    dst->off = 0;
+}
+
+// Takes len bytes of s from start, sharing its storage when not inlined
+void lstr_sub(lstr *dst, lstr *s, size_t start, size_t len) {
+    char *bytes = lstr_bytes(s);
+    if (len <= LSTR_SMALL) {
+        lstr_init(dst, bytes + start, len);
+        return;
+    }
+
+    if (s->node->kind == LSTR_FLAT) {
+        lstr_set_flat(dst, (lstr_flat*)s->node, s->off + start, len);
+    } else {
+        lstr_set_flat(dst, lstr_flatten((lstr_rope*)s->node), start, len);
+    }
+}
+lval *lval_string_n(const char *s, size_t len) {
+    lval *v = lval_alloc();
     v->type = LVAL_STRING;
-    v->string = malloc(strlen(s) + 1);
-    strcpy(v->string, s);
+    lstr_init(&v->string, s, len);
     return v;
 }
 
+lval *lval_string(char *s) {
+    return lval_string_n(s, strlen(s));
+}
+
 lval *lval_bool(bool x) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_BOOL;
     v->_bool = x;
     return v;
 }
 
 lval *lval_error(char *fmt, ...) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_ERROR;
     
     va_list va;
     va_start(va, fmt);
-    v->error = malloc(512);
-
-    vsnprintf(v->error, 511, fmt, va);
-    v->error = realloc(v->error, strlen(v->error) + 1);
+    char buf[512];
+    int n = vsnprintf(buf, sizeof(buf), fmt, va);
     va_end(va);
 
+    if (n < 0) {
+        n = 0;
+    }
+    lstr_init(&v->error, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
     return v;
 }
 
-lval *lval_symbol(char *s) {
-    lval *v = malloc(sizeof(lval));
+lval *lval_symbol_n(const char *s, size_t len) {
+    lval *v = lval_alloc();
     v->type = LVAL_SYMBOL;
-    v->symbol = malloc(strlen(s) + 1);
-    strcpy(v->symbol, s);
+    lstr_init(&v->symbol, s, len);
     return v;
 }
 
+lval *lval_symbol(char *s) {
+    return lval_symbol_n(s, strlen(s));
+}
+
 lval *lval_sexpr(void) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_SEXPR;
     v->sexpr.count = 0;
     v->sexpr.cell = NULL;
+    v->sexpr.cache = NULL;
     return v;
 }
 
 lval *lval_qexpr(void) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_QEXPR;
     v->qexpr.count = 0;
     v->qexpr.cell = NULL;
+    v->qexpr.cache = NULL;
     return v;
 }
 
+// Gives an expression that starts with a symbol an inline cache, shared by
+// every copy made of it so that lambda bodies keep their caches across calls.
+void lval_expr_attach_cache(lval *v) {
+    lval_expr *x = &v->sexpr;
+    if (x->cache != NULL || x->count == 0 || x->cell[0]->type != LVAL_SYMBOL) {
+        return;
+    }
+
+    x->cache = lcalloc(1, sizeof(lcache));
+    x->cache->refs = 1;
+}
+
+static void lcache_release(lcache *c) {
+    if (c != NULL && REF_RELEASE(c) == 0) {
+        lfree(c);
+    }
+}
+
 lval *lval_builtin_func(lbuiltin func) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_BUILTIN_FUNC;
     v->builtin_func = func;
     return v;
 }
 
 lval *lval_func(lval* formals, lval *body) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_LAMBDA;
 
     lval_lambda *lambda = &v->lambda;
@@ -110,6 +372,35 @@ lval *lval_func(lval* formals, lval *body) {
     return v;
 }
 
+lval *lval_thunk_new(lenv *e, lval *expr) {
+    lval *v = lval_alloc();
+    v->type = LVAL_THUNK;
+    v->thunk.env = e;
+    v->thunk.expr = expr;
+    return v;
+}
+
+lval *lval_lazy(lseq *s) {
+    lval *v = lval_alloc();
+    v->type = LVAL_LAZY;
+    v->lazy = s;
+    return v;
+}
+
+lval *lval_map(lmap *m) {
+    lval *v = lval_alloc();
+    v->type = LVAL_MAP;
+    v->map = m;
+    return v;
+}
+
+lval *lval_vec(lvec *vec) {
+    lval *v = lval_alloc();
+    v->type = LVAL_VEC;
+    v->vec = vec;
+    return v;
+}
+
 void lval_del(lval* v) {
     switch (v->type) {
         case LVAL_INT:
@@ -118,46 +409,66 @@ void lval_del(lval* v) {
         case LVAL_BUILTIN_FUNC:
             break;
         case LVAL_STRING:
-            free(v->string);
+            lstr_free(&v->string);
             break;
         case LVAL_ERROR:
-            free(v->error);
+            lstr_free(&v->error);
             break;
         case LVAL_SYMBOL:
-            free(v->symbol);
+            lstr_free(&v->symbol);
             break;
         case LVAL_SEXPR:
             for (int i = 0; i < v->sexpr.count; i++) {
                 lval_del(v->sexpr.cell[i]);
             }
-            free(v->sexpr.cell);
+            lfree(v->sexpr.cell);
+            lcache_release(v->sexpr.cache);
             break;
         case LVAL_QEXPR:
             for (int i = 0; i < v->qexpr.count; i++) {
                 lval_del(v->qexpr.cell[i]);
             }
-            free(v->qexpr.cell);
+            lfree(v->qexpr.cell);
+            lcache_release(v->qexpr.cache);
             break;
         case LVAL_LAMBDA:
             lenv_del(v->lambda.env);
             lval_del(v->lambda.formals);
             lval_del(v->lambda.body);
             break;
+        case LVAL_LAZY:
+            lseq_release(v->lazy);
+            break;
+        case LVAL_XFORM:
+            lxform_release(v->xform);
+            break;
+        case LVAL_MAP:
+            lmap_release(v->map);
+            break;
+        case LVAL_VEC:
+            lvec_release(v->vec);
+            break;
+        case LVAL_BIGINT:
+            lbig_release(v->big);
+            break;
+        case LVAL_THUNK:
+            lval_del(v->thunk.expr);
+            break;
     }
 
-    free(v);
+    lval_free(v);
 }
 
 void lval_expr_push_back(lval_expr* e, lval* x) {
     e->count++;
-    e->cell = realloc(e->cell, sizeof(lval*) * e->count);
+    e->cell = lrealloc(e->cell, sizeof(lval*) * e->count);
     e->cell[e->count - 1] = x;
 }
 
 void lval_expr_push_front(lval_expr* e, lval* x) {
     int n_bytes = sizeof(lval*) * e->count;
     e->count++;
-    e->cell = realloc(e->cell, sizeof(lval*) * e->count);
+    e->cell = lrealloc(e->cell, sizeof(lval*) * e->count);
     // Q-expr wasn't empty before
     // need to move everything forward one
     if (e->count > 1) {
@@ -176,10 +487,10 @@ lval *lval_expr_pop(lval_expr* e, int i) {
 
     e->count--;
     if (e->count == 0) {
-        free(e->cell);
+        lfree(e->cell);
         e->cell = NULL;
     } else {
-        e->cell = realloc(e->cell, sizeof(lval*) * e->count);
+        e->cell = lrealloc(e->cell, sizeof(lval*) * e->count);
     }
     return x;
 }
@@ -200,19 +511,19 @@ lval *lval_take(lval* v, int i) {
     return x;
 }
 
-static void lval_expr_print(lval *v, char open, char close) {
+static void lval_expr_write(dyn_string *out, lval *v, char open, char close) {
     assert(v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
 
     lval_expr *expr = v->type == LVAL_SEXPR ? &v->sexpr : &v->qexpr;
 
-    putchar(open);
+    dyn_string_push(out, open);
     for (int i = 0; i < expr->count; i++) {
-        lval_print(expr->cell[i]);
+        lval_write(out, expr->cell[i]);
         if (i != (expr->count-1)) {
-            putchar(' ');
+            dyn_string_push(out, ' ');
         }
     }
-    putchar(close);
+    dyn_string_push(out, close);
 }
 
 char *lval_str_unescapable = "abfnrtv\\\'\"";
@@ -251,68 +562,125 @@ char *lval_str_escape(char x) {
     return "";
 }
 
-static void lval_str_print(lval *v) {
+static void lval_str_write(dyn_string *out, lval *v) {
     assert(v->type == LVAL_STRING);
 
-    putchar('"');
-
-    for (size_t i = 0; i < strlen(v->string); i++) {
-        if (strchr(lval_str_escapable, v->string[i])) {
-            printf("%s", lval_str_escape(v->string[i]));
-        } else {
-            putchar(v->string[i]);
+    dyn_string_push(out, '"');
+
+    // Copy runs of characters that need no escaping in one go
+    const char *run = LSTR(v->string);
+    const char *c = run;
+    const char *end = run + v->string.len;
+    for (; c != end; c++) {
+        if (*c != '\0' && strchr(lval_str_escapable, *c)) {
+            dyn_string_append_n(out, run, c - run);
+            dyn_string_append(out, lval_str_escape(*c));
+            run = c + 1;
         }
     }
+    dyn_string_append_n(out, run, c - run);
 
-    putchar('"');
+    dyn_string_push(out, '"');
 }
 
-void lval_print(lval *v) {
+static void lval_int_write(dyn_string *out, long x) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (x < 0) {
+        *--p = '-';
+    }
+
+    dyn_string_append_n(out, p, buf + sizeof(buf) - p);
+}
+
+// Appends the printed form of v to out
+void lval_write(dyn_string *out, lval *v) {
     switch (v->type) {
         case LVAL_INT:
-            printf("%li", v->_int);
+            lval_int_write(out, v->_int);
             break;
-        case LVAL_DOUBLE:
-            printf("%f", v->_double);
+        case LVAL_DOUBLE: {
+            char buf[64];
+            int n = snprintf(buf, sizeof(buf), "%f", v->_double);
+            if (n < (int)sizeof(buf)) {
+                dyn_string_append_n(out, buf, n);
+            } else {
+                dyn_string_appendf(out, "%f", v->_double);
+            }
             break;
+        }
         case LVAL_BOOL:
-            printf("%s", v->_bool ? "true" : "false");
+            dyn_string_append(out, v->_bool ? "true" : "false");
             break;
         case LVAL_STRING:
-            lval_str_print(v);
+            lval_str_write(out, v);
             break;
         case LVAL_ERROR:
-            printf("Error: %s", v->error);
+            dyn_string_append(out, "Error: ");
+            dyn_string_append_n(out, LSTR(v->error), v->error.len);
             break;
         case LVAL_SYMBOL:
-            printf("%s", v->symbol);
+            dyn_string_append_n(out, LSTR(v->symbol), v->symbol.len);
             break;
         case LVAL_SEXPR:
-            lval_expr_print(v, '(', ')');
+            lval_expr_write(out, v, '(', ')');
             break;
         case LVAL_QEXPR:
-            lval_expr_print(v, '{', '}');
+            lval_expr_write(out, v, '{', '}');
             break;
         case LVAL_BUILTIN_FUNC:
-            printf("<builtin>");
+            dyn_string_append(out, "<builtin>");
             break;
         case LVAL_LAMBDA:
-            printf("(\\");
-            lval_print(v->lambda.formals);
-            putchar(' ');
-            lval_print(v->lambda.body);
-            putchar(')');
+            dyn_string_append(out, "(\\");
+            lval_write(out, v->lambda.formals);
+            dyn_string_push(out, ' ');
+            lval_write(out, v->lambda.body);
+            dyn_string_push(out, ')');
+            break;
+        case LVAL_LAZY:
+            dyn_string_append(out, "<lazy>");
+            break;
+        case LVAL_XFORM:
+            dyn_string_append(out, "<transducer>");
+            break;
+        case LVAL_MAP:
+            lmap_write(out, v->map);
+            break;
+        case LVAL_VEC:
+            lvec_write(out, v->vec);
+            break;
+        case LVAL_BIGINT:
+            lbig_write(out, v->big);
+            break;
+        case LVAL_THUNK:
+            dyn_string_append(out, "<thunk>");
             break;
     }
 }
 
+void lval_print(lval *v) {
+    dyn_string *out = lout_begin();
+    lval_write(out, v);
+    lout_end(out);
+}
+
 void lval_println(lval *v){
-    lval_print(v);
-    putchar('\n');
+    dyn_string *out = lout_begin();
+    lval_write(out, v);
+    dyn_string_push(out, '\n');
+    lout_end(out);
 }
 
 lval *lval_copy(lval* v) {
-    lval *x = malloc(sizeof(lval));
+    LSTAT(copies, 1);
+    lval *x = lval_alloc();
     x->type = v->type;
     switch (v->type) {
         case LVAL_INT:
@@ -328,33 +696,34 @@ lval *lval_copy(lval* v) {
             x->builtin_func = v->builtin_func;
             break;
         case LVAL_STRING:
-            x->string = malloc(strlen(v->string) + 1);
-            strcpy(x->string, v->string);
+            lstr_copy(&x->string, &v->string);
             break;
         case LVAL_ERROR:
-            x->error = malloc(strlen(v->error) + 1);
-            strcpy(x->error, v->error);
+            lstr_copy(&x->error, &v->error);
             break;
         case LVAL_SYMBOL:
-            x->symbol = malloc(strlen(v->symbol) + 1);
-            strcpy(x->symbol, v->symbol);
+            lstr_copy(&x->symbol, &v->symbol);
             break;
         case LVAL_SEXPR: {
             lval_expr *sexpr = &x->sexpr;
             sexpr->count = v->sexpr.count;
-            sexpr->cell = malloc(sizeof(lval*) * sexpr->count);
+            sexpr->cell = lmalloc(sizeof(lval*) * sexpr->count);
             for (int i = 0; i < sexpr->count; i++) {
                 sexpr->cell[i] = lval_copy(v->sexpr.cell[i]);
             }
+            sexpr->cache = v->sexpr.cache;
+            if (sexpr->cache != NULL) { REF_RETAIN(sexpr->cache); }
             break;
         }
         case LVAL_QEXPR: {
             lval_expr *qexpr = &x->qexpr;
             qexpr->count = v->qexpr.count;
-            qexpr->cell = malloc(sizeof(lval*) * qexpr->count);
+            qexpr->cell = lmalloc(sizeof(lval*) * qexpr->count);
             for (int i = 0; i < qexpr->count; i++) {
                 qexpr->cell[i] = lval_copy(v->qexpr.cell[i]);
             }
+            qexpr->cache = v->qexpr.cache;
+            if (qexpr->cache != NULL) { REF_RETAIN(qexpr->cache); }
             break;
         }
         case LVAL_LAMBDA:
@@ -362,11 +731,34 @@ lval *lval_copy(lval* v) {
             x->lambda.formals = lval_copy(v->lambda.formals);
             x->lambda.body = lval_copy(v->lambda.body);
             break;
+        case LVAL_LAZY:
+            x->lazy = lseq_retain(v->lazy);
+            break;
+        case LVAL_XFORM:
+            x->xform = lxform_retain(v->xform);
+            break;
+        case LVAL_MAP:
+            x->map = lmap_retain(v->map);
+            break;
+        case LVAL_VEC:
+            x->vec = lvec_retain(v->vec);
+            break;
+        case LVAL_BIGINT:
+            x->big = lbig_retain(v->big);
+            break;
+        case LVAL_THUNK:
+            x->thunk.env = v->thunk.env;
+            x->thunk.expr = lval_copy(v->thunk.expr);
+            break;
     }
 
     return x;
 }
 
+bool lval_is_func(lval *v) {
+    return v->type == LVAL_BUILTIN_FUNC || v->type == LVAL_LAMBDA;
+}
+
 bool lval_eq(lval *a, lval *b) {
     if (a->type != b->type) {
         return false;
@@ -380,16 +772,28 @@ bool lval_eq(lval *a, lval *b) {
         case LVAL_BOOL:
             return a->_bool == b->_bool;
         case LVAL_STRING:
-            return strcmp(a->string, b->string) == 0;
+            return lstr_eq(&a->string, &b->string);
         case LVAL_ERROR:
-            return strcmp(a->error, b->error) == 0;
+            return lstr_eq(&a->error, &b->error);
         case LVAL_SYMBOL:
-            return strcmp(a->symbol, b->symbol) == 0;
+            return lstr_eq(&a->symbol, &b->symbol);
         case LVAL_BUILTIN_FUNC:
             return a->builtin_func == b->builtin_func;
         case LVAL_LAMBDA:
             return lval_eq(a->lambda.formals, b->lambda.formals) && 
                    lval_eq(a->lambda.body, b->lambda.body);
+        case LVAL_LAZY:
+            return a->lazy == b->lazy;
+        case LVAL_XFORM:
+            return a->xform == b->xform;
+        case LVAL_MAP:
+            return lmap_eq(a->map, b->map);
+        case LVAL_VEC:
+            return lvec_eq(a->vec, b->vec);
+        case LVAL_BIGINT:
+            return lbig_eq(a->big, b->big);
+        case LVAL_THUNK:
+            return a->thunk.env == b->thunk.env && lval_eq(a->thunk.expr, b->thunk.expr);
         case LVAL_SEXPR:
         case LVAL_QEXPR: {
             lval_expr *ae = a->type == LVAL_SEXPR ? &a->sexpr : &a->qexpr;
@@ -410,23 +814,43 @@ bool lval_eq(lval *a, lval *b) {
     return false;
 }
 
+// Names that have ever been bound outside the root environment are hashed
+// into the interpreter's `shadowed` bitset. A call site whose head is in
+// this set may be shadowed by a local binding, so its cached global entry
+// cannot be trusted.
+static unsigned lenv_shadow_bit(char *k) {
+    unsigned h = 2166136261u;
+    for (; *k != '\0'; k++) {
+        h = (h ^ (unsigned char)*k) * 16777619u;
+    }
+    return h % (sizeof(((clisp*)0)->shadowed) * 8);
+}
+
+static bool lenv_is_shadowed(clisp *c, unsigned bit) {
+    return (__atomic_load_n(&c->shadowed[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+}
+
 lenv* lenv_new(void) {
-    lenv *e = malloc(sizeof(lenv));
+    LSTAT(envs, 1);
+    lenv *e = lmalloc(sizeof(lenv));
     e->count = 0;
     e->parent = NULL;
     e->entries = NULL;
+    e->root = false;
+    e->frozen = false;
     return e;
 }
 
 void lenv_del(lenv *e) {
+    LSTAT(envs_freed, 1);
     for (int i = 0; i < e->count; i++) {
-        free(e->entries[i]->symbol);
+        lfree(e->entries[i]->symbol);
         lval_del(e->entries[i]->val);
-        free(e->entries[i]);
+        lfree(e->entries[i]);
     }
 
-    free(e->entries);
-    free(e);
+    lfree(e->entries);
+    lfree(e);
 }
 
 lenv_entry *lenv_lookup(lenv *e, char *k) {
@@ -441,32 +865,46 @@ lenv_entry *lenv_lookup(lenv *e, char *k) {
 }
 
 lval *lenv_get(lenv *e, char *k) {
-    lenv_entry *entry = lenv_lookup(e, k);
-    if (entry == NULL) {
+    LSTAT(lookups, 1);
+    while (true) {
+        LSTAT(lookup_depth, 1);
+        lenv_entry *entry = lenv_lookup(e, k);
+        if (entry != NULL) {
+            return lval_copy(entry->val);
+        }
         if (e->parent == NULL) {
             return lval_error("unbound symbol '%s'", k);
-        } else {
-            return lenv_get(e->parent, k);
         }
+        e = e->parent;
     }
-
-    return lval_copy(entry->val);
 }
 
 void lenv_put(lenv *e, char *k, lval *v, bool builtin) {
+    assert(!e->frozen);
+    LSTAT(puts, 1);
+
+    clisp *c = clisp_current();
+    if (c != NULL && e->root) {
+        c->version++;
+    } else if (c != NULL) {
+        unsigned bit = lenv_shadow_bit(k);
+        __atomic_fetch_or(&c->shadowed[bit / 64], 1ul << (bit % 64), __ATOMIC_RELAXED);
+    }
+
     for (int i = 0; i < e->count; i++) {
         lenv_entry *entry = e->entries[i];
         if (strcmp(entry->symbol, k) == 0) {
             lval_del(entry->val);
             entry->val = lval_copy(v);
+            return;
         }
     }
 
     e->count++;
-    e->entries = realloc(e->entries, sizeof(lenv_entry*) * e->count);
+    e->entries = lrealloc(e->entries, sizeof(lenv_entry*) * e->count);
 
-    lenv_entry *entry = malloc(sizeof(lenv_entry));
-    entry->symbol = malloc(strlen(k) + 1);
+    lenv_entry *entry = lmalloc(sizeof(lenv_entry));
+    entry->symbol = lmalloc(strlen(k) + 1);
     strcpy(entry->symbol, k);
     entry->val = lval_copy(v);
     entry->builtin = builtin;
@@ -475,17 +913,21 @@ void lenv_put(lenv *e, char *k, lval *v, bool builtin) {
 }
 
 lenv *lenv_copy(lenv *e) {
-    lenv *copy = malloc(sizeof(lenv));
+    LSTAT(envs, 1);
+    LSTAT(env_copies, 1);
+    lenv *copy = lmalloc(sizeof(lenv));
+    copy->root = false;
+    copy->frozen = false;
     copy->parent = e->parent;
     copy->count = e->count;
-    copy->entries = malloc(sizeof(lenv_entry*) * e->count);
+    copy->entries = lmalloc(sizeof(lenv_entry*) * e->count);
 
     for (int i = 0; i < e->count; i++) {
-        lenv_entry *entry = malloc(sizeof(lenv_entry));
+        lenv_entry *entry = lmalloc(sizeof(lenv_entry));
         lenv_entry *existing = e->entries[i];
 
         entry->builtin = existing->builtin;
-        entry->symbol = malloc(strlen(existing->symbol) + 1);
+        entry->symbol = lmalloc(strlen(existing->symbol) + 1);
         strcpy(entry->symbol, existing->symbol);
         entry->val = lval_copy(existing->val);
         
@@ -496,135 +938,65 @@ lenv *lenv_copy(lenv *e) {
 }
 
 void lenv_def(lenv *e, char *k, lval *v) {
-    while (e->parent != NULL) {
+    // Environments frozen by a parallel builtin are read-only, so definitions
+    // made by its workers stay in their own frame
+    while (e->parent != NULL && !e->parent->frozen) {
         e = e->parent;
     }
 
     lenv_put(e, k, v, false);
 }
 
-lval *lval_eval(lenv* e, lval* v);
-lval *builtin_list(lenv *e, lval *v);
-
-static lval *lval_call(lenv *e, lval *f, lval *a) {
-    assert(f->type == LVAL_BUILTIN_FUNC || f->type == LVAL_LAMBDA);
-    assert(a->type == LVAL_SEXPR);
-    
-    if (f->type == LVAL_BUILTIN_FUNC) {
-        return f->builtin_func(e, a);
-    }
-
-    lval_lambda *func = &f->lambda;
-    lval_expr *params = &func->formals->qexpr;
-    
-    int passed = a->sexpr.count;
-    int expected = params->count;
-
-    while (a->sexpr.count > 0) {
-        if (params->count == 0) {
-            lval_del(a);
-            return lval_error("Function received too many arguments. Got %i, expected %i", passed, expected);
-        }
-
-        lval *symbol = lval_expr_pop(params, 0);
+bool lcache_valid(lcache *c, char *k) {
+    clisp *interp = clisp_current();
+    return interp != NULL && c->entry != NULL && c->version == interp->version &&
+           !lenv_is_shadowed(interp, c->shadow_bit) && strcmp(c->entry->symbol, k) == 0;
+}
 
-        if (strcmp(symbol->symbol, "&") == 0) {
-            if (params->count != 1) {
-                lval_del(a);
-                return lval_error("Syntax error: expected a single symbol after '&'");
-            }
-            
-            lval *rest = lval_expr_pop(params, 0);
-            lenv_put(func->env, rest->symbol, builtin_list(e, a), false);
-            lval_del(symbol);
-            lval_del(rest);
-            break;
+// Resolves the head symbol k of a call site through its inline cache.
+// Returns the root environment entry it is bound to, or NULL if it has to be
+// looked up the slow way.
+lenv_entry *lcache_lookup(lcache *c, lenv *e, char *k) {
+    if (lcache_valid(c, k)) {
+        if (!lpool_in_worker() && !REF_SHARED(c)) {
+            c->hits++;
         }
-
-        lval *val = lval_expr_pop(&a->sexpr, 0);
-
-        lenv_put(func->env, symbol->symbol, val, false);
-
-        lval_del(symbol);
-        lval_del(val);
+        LSTAT(lookups, 1);
+        LSTAT(lookup_depth, c->depth);
+        return c->entry;
     }
 
-    lval_del(a);
-
-    if (params->count > 0 && 
-        strcmp(params->cell[0]->symbol, "&") == 0) {
-        
-        if (params->count != 2) {
-            return lval_error("Syntax error: expected a single symbol after '&'");
-        }
-        
-        // Delete '&'
-        lval_del(lval_expr_pop(params, 0));
-
-        // Pop next symbol and create empty list
-        lval *rest = lval_expr_pop(params, 0);
-        lval *val = lval_qexpr();
-        
-        lenv_put(func->env, rest->symbol, val, false);
-        lval_del(rest);
-        lval_del(val);
+    // Caches are shared between pool threads, which may only read them, and
+    // with the children of a zygote, which must not write to them
+    clisp *interp = clisp_current();
+    if (interp == NULL || lpool_in_worker() || REF_SHARED(c)) {
+        return NULL;
     }
 
-    if (func->formals->qexpr.count == 0) {
-        func->env->parent = e;
-        
-        lval *body = lval_copy(func->body);
-        body->type = LVAL_SEXPR;
-        body->sexpr = body->qexpr;
-        return lval_eval(func->env, body);
-    }
-    
-    return lval_copy(f);
-}
+    c->misses++;
+    c->entry = NULL;
 
-
-static lval *lval_eval_sexpr(lenv *e, lval* v) {
-    assert(v->type == LVAL_SEXPR);
-
-    lval_expr *sexpr = &v->sexpr;
-
-    // Evaluate children
-    for (int i = 0; i < sexpr->count; i++) {
-        sexpr->cell[i] = lval_eval(e, sexpr->cell[i]);
+    unsigned bit = lenv_shadow_bit(k);
+    if (lenv_is_shadowed(interp, bit)) {
+        return NULL;
     }
 
-    // Error checking
-    for (int i = 0; i < sexpr->count; i++) {
-        if (sexpr->cell[i]->type == LVAL_ERROR) {
-            return lval_take(v, i);
-        }
-    }
-
-    if (sexpr->count == 0) { return v; }
-    if (sexpr->count == 1) { return lval_take(v, 0); }
-
-    lval *f = lval_expr_pop(sexpr, 0);
-    if (f->type != LVAL_BUILTIN_FUNC && f->type != LVAL_LAMBDA) {
-        lval_del(f); 
-        lval_del(v);
-        return lval_error("S-expression does not start with a function!");
+    int depth = 1;
+    while (e->parent != NULL) {
+        e = e->parent;
+        depth++;
     }
-    
-    lval *result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
-}
-
-lval *lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYMBOL) {
-        lval *x = lenv_get(e, v->symbol);
-        lval_del(v);
-        return x;
+    if (!e->root) {
+        return NULL;
     }
 
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    c->entry = lenv_lookup(e, k);
+    c->version = interp->version;
+    c->shadow_bit = bit;
+    c->depth = depth;
+    if (c->entry != NULL) {
+        LSTAT(lookups, 1);
+        LSTAT(lookup_depth, depth);
     }
-
-    return v;
+    return c->entry;
 }
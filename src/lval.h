@@ -1,7 +1,9 @@
 #include <stdbool.h>
+#include <stddef.h>
 
 enum LVAL_TYPE { 
     LVAL_INT, 
+    LVAL_BIGINT,
     LVAL_DOUBLE, 
     LVAL_BOOL,
     LVAL_STRING,
@@ -10,34 +12,133 @@ enum LVAL_TYPE {
     LVAL_QEXPR,
     LVAL_BUILTIN_FUNC,
     LVAL_LAMBDA,
+    LVAL_LAZY,
+    LVAL_XFORM,
+    LVAL_MAP,
+    LVAL_VEC,
+    LVAL_THUNK,
     LVAL_ERROR,
 };
 
 char *lval_type_name(enum LVAL_TYPE type);
 
+typedef struct lenv_entry lenv_entry;
+
+// A monomorphic inline cache for the function at the head of a call site.
+// It remembers the root environment entry the head symbol resolved to and
+// is valid while `version` matches the interpreter's version.
+typedef struct {
+    int refs;
+    unsigned long version;
+    unsigned shadow_bit;
+    lenv_entry *entry;
+    unsigned long hits;
+    unsigned long misses;
+    // Environments between the call site and the root when it was filled,
+    // counted as the depth of each lookup the cache answers
+    int depth;
+    // The head symbol's name as interned for the profiler and tracer, filled
+    // in the first time the site runs while either is on
+    const char *name;
+} lcache;
+
 typedef struct {
     int count; 
     struct lval** cell;
+    lcache *cache;
 } lval_expr;
 
 struct lval;
 typedef struct lval lval;
 
-typedef struct {
+struct lenv_entry {
     char *symbol;
     lval *val;
     bool builtin;
-} lenv_entry;
+};
 
 typedef struct lenv lenv;
 struct lenv {
     lenv *parent;
     int count;
     lenv_entry **entries;
+    bool root;
+    bool frozen;
 };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+// A pending evaluation returned by builtins such as `if` and `eval`, so the
+// evaluator can continue with it in place instead of recursing.
+typedef struct {
+    lenv *env;
+    lval *expr;
+} lval_thunk;
+
+typedef struct lseq lseq;
+typedef struct lxform lxform;
+typedef struct lmap lmap;
+typedef struct lvec lvec;
+typedef struct lbig lbig;
+
+#define LSTR_SMALL 15
+
+typedef struct lstr_node lstr_node;
+
+// Length-prefixed contents of a string, symbol or error. Up to LSTR_SMALL
+// bytes are stored inline. Longer contents are a view of `len` bytes at
+// `off` into a reference counted node shared between copies, which lets
+// substrings share storage with the string they were taken from.
+typedef struct {
+    size_t len;
+    union {
+        char small[LSTR_SMALL + 1];
+        struct {
+            lstr_node *node;
+            size_t off;
+        };
+    };
+} lstr;
+
+enum LSTR_KIND {
+    LSTR_FLAT,
+    LSTR_CONCAT,
+};
+
+// Heap string nodes. A rope of LSTR_CONCAT nodes makes concatenation O(1);
+// it is flattened, once, the first time its bytes are needed.
+struct lstr_node {
+    int refs;
+    enum LSTR_KIND kind;
+};
+
+typedef struct {
+    lstr_node node;
+    size_t len;
+    char data[];
+} lstr_flat;
+
+typedef struct {
+    lstr_node node;
+    lstr left;
+    lstr right;
+    lstr_flat *flat;
+} lstr_rope;
+
+// The bytes of s. Symbols and errors are always NUL-terminated, strings
+// only up to their length unless made so by lstr_cstr.
+#define LSTR(s) ((s).len <= LSTR_SMALL ? (s).small : lstr_bytes(&(s)))
+
+void lstr_init(lstr *s, const char *buf, size_t len);
+char *lstr_reserve(lstr *s, size_t len);
+void lstr_copy(lstr *dst, lstr *src);
+void lstr_free(lstr *s);
+bool lstr_eq(lstr *a, lstr *b);
+char *lstr_bytes(lstr *s);
+char *lstr_cstr(lstr *s);
+void lstr_concat(lstr *dst, lstr *a, lstr *b);
+void lstr_sub(lstr *dst, lstr *s, size_t start, size_t len);
+
 typedef struct {
     lenv *env;
     lval *formals;
@@ -48,15 +149,21 @@ struct lval {
     enum LVAL_TYPE type;
     union {
         long _int; 
+        lbig *big;
         double _double;
         bool _bool;
-        char *string;
-        char *error;
-        char *symbol;
+        lstr string;
+        lstr error;
+        lstr symbol;
         lval_expr sexpr;
         lval_expr qexpr;
         lbuiltin builtin_func;
         lval_lambda lambda;
+        lseq *lazy;
+        lxform *xform;
+        lmap *map;
+        lvec *vec;
+        lval_thunk thunk;
     };
 };
 
@@ -68,19 +175,35 @@ void lenv_put(lenv *e, char *k, lval *v, bool builtin);
 void lenv_def(lenv *e, char *k, lval *v);
 lenv *lenv_copy(lenv *e);
 
+void lval_expr_attach_cache(lval *v);
+lenv_entry *lcache_lookup(lcache *c, lenv *e, char *k);
+bool lcache_valid(lcache *c, char *k);
+
 lenv *lenv_base(void);
 
+// Allocate and free the lval itself, without its contents
+lval *lval_alloc(void);
+void lval_free(lval *v);
+
 lval *lval_int(long x);
 lval *lval_double(double x);
 lval *lval_bool(bool x);
 lval *lval_string(char *s);
+lval *lval_string_n(const char *s, size_t len);
 lval *lval_error(char *fmt, ...);
+lval *lval_symbol_n(const char *s, size_t len);
 lval *lval_symbol(char *s);
 lval *lval_sexpr(void);
 lval *lval_qexpr(void);
 lval *lval_builtin_func(lbuiltin func);
 lval *lval_func(lval *formals, lval *body);
+lval *lval_thunk_new(lenv *e, lval *expr);
+lval *lval_lazy(lseq *s);
+lval *lval_map(lmap *m);
+lval *lval_vec(lvec *v);
+lval *lval_copy(lval *v);
 bool lval_eq(lval* a, lval *b);
+bool lval_is_func(lval *v);
 void lval_del(lval* v);
 
 extern char *lval_str_unescapable;
@@ -91,8 +214,15 @@ char *lval_str_escape(char x);
 
 void lval_print(lval *v);
 void lval_println(lval *v);
+struct dyn_string;
+void lval_write(struct dyn_string *out, lval *v);
+
 
 lval *lval_eval(lenv *e, lval *v);
+void lval_eval_trim(void);
+lval *lval_force(lval *v);
+lval *lval_call(lenv *e, lval *f, lval *a);
+lval *lval_apply(lenv *e, lval *f, lval *a);
 
 lval *lval_expr_pop(lval_expr* e, int i);
 void lval_expr_push_back(lval_expr* e, lval* x);
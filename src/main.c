@@ -1,12 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <editline/readline.h>
 #include <histedit.h>
-#include "builtins.h"
-#include "utils.h"
-#include "parser.h"
 #include "lval.h"
+#include "compile.h"
+#include "pool.h"
+#include "profile.h"
+#include "serve.h"
+#include "zygote.h"
+#include "dyn_string.h"
+#include "interp.h"
 
 #ifdef _WIN32
 #include <string.h>
@@ -23,28 +28,195 @@ char *readline(char* prompt) {
 void add_history(char* unused) {}
 #endif
 
+// Options followed by a value, which is not a file to load
+static const char *main_valued_options[] = {
+    "--max-depth", "--threads", "--profile", "--trace", "--trace-threshold",
+    "--serve", "--serve-workers", "--serve-timeout", "--zygote", "--preload",
+    "--fuel", "--deadline", "--max-heap",
+};
+
+static bool main_takes_value(const char *arg) {
+    for (size_t i = 0; i < sizeof(main_valued_options) / sizeof(char *); i++) {
+        if (strcmp(arg, main_valued_options[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Peak resident set of this process in KB, or -1 without /proc. Unlike
+// getrusage's maxrss it does not include what the parent held before exec.
+static long main_peak_rss_kb(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
 int main(int argc, char** argv) {
-    lenv *e = lenv_base();
+    clisp_config config = {
+        .stdlib = "lib/stdlib.clsp",
+        .trace_threshold_us = 100,
+    };
+    // Folded stacks of the whole run are written here, see profile.h
+    const char *profile = NULL;
+    bool stats = false;
+    lserve_config serve = {0};
+    // Control file of a zygote, see zygote.h
+    const char *zygote = NULL;
 
-    if (argc >= 2) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--max-depth") == 0) {
+            config.max_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            lpool_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            config.trace = argv[++i];
+        } else if (strcmp(argv[i], "--trace-threshold") == 0) {
+            config.trace_threshold_us = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--fuel") == 0) {
+            config.fuel = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--deadline") == 0) {
+            config.deadline_ms = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-heap") == 0) {
+            config.max_heap = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serve.path = argv[++i];
+        } else if (strcmp(argv[i], "--serve-workers") == 0) {
+            serve.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--serve-timeout") == 0) {
+            serve.timeout_ms = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--zygote") == 0) {
+            zygote = argv[++i];
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        }
+    }
+
+    if (serve.path != NULL) {
+        const char **files = malloc(sizeof(char *) * argc);
         for (int i = 1; i < argc; i++) {
-            load_file(e, argv[i]);
+            if (main_takes_value(argv[i]) && i + 1 < argc) {
+                i++;
+            } else if (strncmp(argv[i], "--", 2) != 0) {
+                files[serve.file_count++] = argv[i];
+            }
+        }
+        serve.files = files;
+        serve.stdlib = config.stdlib;
+        serve.max_depth = config.max_depth;
+        int code = lserve_run(&serve);
+        free(files);
+        return code;
+    }
+
+    if (zygote != NULL) {
+        if (!lzygote_init()) {
+            fprintf(stderr, "Could not reserve the zygote's heap\n");
+            return 1;
+        }
+        // Every child would write to the same trace, and the profiler's
+        // timer would not survive the fork
+        config.alloc = lzygote_alloc;
+        config.trace = NULL;
+        clisp *c = clisp_new(&config);
+        for (int i = 1; i + 1 < argc; i++) {
+            if (strcmp(argv[i], "--preload") == 0) {
+                clisp_load_file(c, argv[++i]);
+            } else if (main_takes_value(argv[i])) {
+                i++;
+            }
         }
+        return lzygote_run(c, zygote);
+    }
+
+    if (profile != NULL) {
+        lprof_start();
+    }
+
+    clisp *c = clisp_new(&config);
+    if (config.trace != NULL && c->trace == NULL) {
+        fprintf(stderr, "Could not write %s\n", config.trace);
     }
 
-    while (true) {
+    for (int i = 1; i < argc; i++) {
+        if (main_takes_value(argv[i]) && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--stats") == 0) {
+            continue;
+        }
+        if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            clisp *prev = clisp_enter(c);
+            lval *res = compile_file(c->env, argv[++i]);
+            bool failed = res->type == LVAL_ERROR;
+            if (failed) {
+                lval_println(res);
+            }
+            lval_del(res);
+            clisp_leave(prev);
+            clisp_free(c);
+            return failed ? 1 : 0;
+        }
+
+        if (clisp_load_file(c, argv[i]) == CLISP_EXIT) {
+            break;
+        }
+    }
+
+    while (!c->exited) {
         char *input = readline("~> ");
+        if (input == NULL) {
+            break;
+        }
 
-        lval *expr = lval_sexpr();
-        parse_expr(expr, input, 0, '\0');
-        lval *v = lval_eval(e, expr);
-        lval_println(v);
-        lval_del(v);
+        clisp_eval_string(c, input, CLISP_REPL);
         
         add_history(input);
         free(input);
     }
     
-    lenv_del(e);
-    return 0;
+    int code = clisp_exit_code(c);
+    if (stats) {
+        dyn_string *out = dyn_string_new();
+        lstats_write(out, c);
+        long rss = main_peak_rss_kb();
+        if (rss >= 0) {
+            dyn_string_appendf(out, "%-14s %ld\n", "peak-rss-kb", rss);
+        }
+        fputs(out->buf, stderr);
+        dyn_string_del(out);
+    }
+    clisp_free(c);
+
+    if (profile != NULL) {
+        dyn_string *out = dyn_string_new();
+        lprof_stop(out);
+        FILE *f = fopen(profile, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Could not write %s\n", profile);
+            code = 1;
+        } else {
+            fwrite(out->buf, 1, out->len, f);
+            fclose(f);
+        }
+        dyn_string_del(out);
+    }
+    return code;
 }
@@ -0,0 +1,669 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "map.h"
+#include "bignum.h"
+#include "builtins.h"
+#include "dyn_string.h"
+#include "utils.h"
+#include "interp.h"
+
+#define LMAP_MIN_CAP 8
+#define LHAMT_BITS 5
+
+static uint64_t lmap_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t lmap_bytes_hash(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return lmap_mix(h);
+}
+
+// Hashes a map key. Returns false if v cannot be used as a key.
+static bool lmap_hash(lval *v, uint64_t *hash) {
+    switch (v->type) {
+        case LVAL_INT:
+            *hash = lmap_mix((uint64_t)v->_int);
+            return true;
+        case LVAL_BIGINT:
+            *hash = lmap_bytes_hash(0x2325cbf29ce48422ULL + v->big->neg,
+                                    (const char *)v->big->limbs, sizeof(uint32_t) * v->big->len);
+            return true;
+        case LVAL_STRING:
+            *hash = lmap_bytes_hash(0xcbf29ce484222325ULL, LSTR(v->string), v->string.len);
+            return true;
+        case LVAL_SYMBOL:
+            *hash = lmap_bytes_hash(0x84222325cbf29ce4ULL, LSTR(v->symbol), v->symbol.len);
+            return true;
+        case LVAL_QEXPR: {
+            uint64_t h = 0x9e3779b97f4a7c15ULL + v->qexpr.count;
+            for (int i = 0; i < v->qexpr.count; i++) {
+                uint64_t x;
+                if (!lmap_hash(v->qexpr.cell[i], &x)) {
+                    return false;
+                }
+                h = lmap_mix(h ^ x) + i;
+            }
+            *hash = h;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static lval *lmap_key_error(char *func, lval *key) {
+    return lval_error("Function '%s' expects an integer, string, symbol or q-expression "
+                      "of these as key, got %s", func, lval_type_name(key->type));
+}
+
+static lmap_leaf *lmap_leaf_new(uint64_t hash, lval *key, lval *val) {
+    lmap_leaf *l = lmalloc(sizeof(lmap_leaf));
+    l->refs = 1;
+    l->hash = hash;
+    l->key = key;
+    l->val = val;
+    return l;
+}
+
+static lmap_leaf *lmap_leaf_retain(lmap_leaf *l) {
+    REF_RETAIN(l);
+    return l;
+}
+
+static void lmap_leaf_release(lmap_leaf *l) {
+    if (REF_RELEASE(l) > 0) {
+        return;
+    }
+
+    lval_del(l->key);
+    lval_del(l->val);
+    lfree(l);
+}
+
+static bool lmap_leaf_is(lmap_leaf *l, uint64_t hash, lval *key) {
+    return l->hash == hash && lval_eq(l->key, key);
+}
+
+static unsigned lhamt_bit(uint64_t hash, int shift) {
+    return 1u << ((hash >> shift) & 31);
+}
+
+// Position in a node's dense slots of the child for `bit`
+static int lhamt_pos(lhamt_node *n, unsigned bit) {
+    return __builtin_popcount(n->bitmap & (bit - 1));
+}
+
+static lhamt_node *lhamt_node_new(int count) {
+    lhamt_node *n = lmalloc(sizeof(lhamt_node) + sizeof(lhamt_slot) * count);
+    n->refs = 1;
+    n->bitmap = 0;
+    n->count = count;
+    return n;
+}
+
+static lhamt_node *lhamt_retain(lhamt_node *n) {
+    REF_RETAIN(n);
+    return n;
+}
+
+static void lhamt_release(lhamt_node *n) {
+    if (REF_RELEASE(n) > 0) {
+        return;
+    }
+
+    for (int i = 0; i < n->count; i++) {
+        if (n->slots[i].node != NULL) {
+            lhamt_release(n->slots[i].node);
+        } else {
+            lmap_leaf_release(n->slots[i].leaf);
+        }
+    }
+    lfree(n);
+}
+
+// Copies n with its slot at `at` replaced (extra == 0), removed (-1) or
+// preceded by a new one (1). Every other slot is shared with n; the slot
+// at `at` in the copy, if any, is left for the caller to fill.
+static lhamt_node *lhamt_edit(lhamt_node *n, int at, int extra) {
+    lhamt_node *res = lhamt_node_new(n->count + extra);
+    res->bitmap = n->bitmap;
+
+    for (int i = 0, j = 0; i < n->count; i++, j++) {
+        if (i == at) {
+            if (extra == 1) { j++; }
+            else if (extra == -1) { j--; continue; }
+            else { continue; }
+        }
+        res->slots[j] = n->slots[i];
+        if (res->slots[j].node != NULL) {
+            lhamt_retain(res->slots[j].node);
+        } else {
+            lmap_leaf_retain(res->slots[j].leaf);
+        }
+    }
+    return res;
+}
+
+static lmap_leaf *lhamt_get(lhamt_node *n, uint64_t hash, lval *key) {
+    for (int shift = 0; n != NULL; shift += LHAMT_BITS) {
+        if (shift >= 64) {
+            for (int i = 0; i < n->count; i++) {
+                if (lmap_leaf_is(n->slots[i].leaf, hash, key)) {
+                    return n->slots[i].leaf;
+                }
+            }
+            return NULL;
+        }
+
+        unsigned bit = lhamt_bit(hash, shift);
+        if (!(n->bitmap & bit)) {
+            return NULL;
+        }
+        lhamt_slot *s = &n->slots[lhamt_pos(n, bit)];
+        if (s->leaf != NULL) {
+            return lmap_leaf_is(s->leaf, hash, key) ? s->leaf : NULL;
+        }
+        n = s->node;
+    }
+    return NULL;
+}
+
+// A node holding two leaves with different keys, consuming both
+static lhamt_node *lhamt_pair(lmap_leaf *a, lmap_leaf *b, int shift) {
+    if (shift >= 64) {
+        lhamt_node *n = lhamt_node_new(2);
+        n->slots[0] = (lhamt_slot){ NULL, a };
+        n->slots[1] = (lhamt_slot){ NULL, b };
+        return n;
+    }
+
+    unsigned abit = lhamt_bit(a->hash, shift);
+    unsigned bbit = lhamt_bit(b->hash, shift);
+    if (abit == bbit) {
+        lhamt_node *n = lhamt_node_new(1);
+        n->bitmap = abit;
+        n->slots[0] = (lhamt_slot){ lhamt_pair(a, b, shift + LHAMT_BITS), NULL };
+        return n;
+    }
+
+    lhamt_node *n = lhamt_node_new(2);
+    n->bitmap = abit | bbit;
+    n->slots[abit < bbit ? 0 : 1] = (lhamt_slot){ NULL, a };
+    n->slots[abit < bbit ? 1 : 0] = (lhamt_slot){ NULL, b };
+    return n;
+}
+
+// Returns a copy of n with leaf added or replacing the leaf for its key,
+// consuming leaf but not n
+static lhamt_node *lhamt_put(lhamt_node *n, int shift, lmap_leaf *leaf, bool *added) {
+    if (n == NULL) {
+        n = lhamt_node_new(1);
+        n->bitmap = lhamt_bit(leaf->hash, shift);
+        n->slots[0] = (lhamt_slot){ NULL, leaf };
+        *added = true;
+        return n;
+    }
+
+    if (shift >= 64) {
+        for (int i = 0; i < n->count; i++) {
+            if (lmap_leaf_is(n->slots[i].leaf, leaf->hash, leaf->key)) {
+                lhamt_node *res = lhamt_edit(n, i, 0);
+                res->slots[i] = (lhamt_slot){ NULL, leaf };
+                return res;
+            }
+        }
+        lhamt_node *res = lhamt_edit(n, n->count, 1);
+        res->slots[n->count] = (lhamt_slot){ NULL, leaf };
+        *added = true;
+        return res;
+    }
+
+    unsigned bit = lhamt_bit(leaf->hash, shift);
+    int at = lhamt_pos(n, bit);
+    if (!(n->bitmap & bit)) {
+        lhamt_node *res = lhamt_edit(n, at, 1);
+        res->bitmap |= bit;
+        res->slots[at] = (lhamt_slot){ NULL, leaf };
+        *added = true;
+        return res;
+    }
+
+    lhamt_slot *s = &n->slots[at];
+    lhamt_node *res = lhamt_edit(n, at, 0);
+    if (s->node != NULL) {
+        res->slots[at] = (lhamt_slot){ lhamt_put(s->node, shift + LHAMT_BITS, leaf, added), NULL };
+    } else if (lmap_leaf_is(s->leaf, leaf->hash, leaf->key)) {
+        res->slots[at] = (lhamt_slot){ NULL, leaf };
+    } else {
+        lmap_leaf *old = lmap_leaf_retain(s->leaf);
+        res->slots[at] = (lhamt_slot){ lhamt_pair(old, leaf, shift + LHAMT_BITS), NULL };
+        *added = true;
+    }
+    return res;
+}
+
+// Returns n without key: n itself, retained, if key is not in it, or NULL
+// if nothing is left
+static lhamt_node *lhamt_del(lhamt_node *n, int shift, uint64_t hash, lval *key, bool *removed) {
+    if (shift >= 64) {
+        for (int i = 0; i < n->count; i++) {
+            if (lmap_leaf_is(n->slots[i].leaf, hash, key)) {
+                *removed = true;
+                return n->count == 1 ? NULL : lhamt_edit(n, i, -1);
+            }
+        }
+        return lhamt_retain(n);
+    }
+
+    unsigned bit = lhamt_bit(hash, shift);
+    if (!(n->bitmap & bit)) {
+        return lhamt_retain(n);
+    }
+
+    int at = lhamt_pos(n, bit);
+    lhamt_slot *s = &n->slots[at];
+    lhamt_node *child = NULL;
+    if (s->leaf != NULL) {
+        if (!lmap_leaf_is(s->leaf, hash, key)) {
+            return lhamt_retain(n);
+        }
+        *removed = true;
+    } else {
+        child = lhamt_del(s->node, shift + LHAMT_BITS, hash, key, removed);
+        if (!*removed) {
+            lhamt_release(child);
+            return lhamt_retain(n);
+        }
+    }
+
+    if (child == NULL) {
+        if (n->count == 1) {
+            return NULL;
+        }
+        lhamt_node *res = lhamt_edit(n, at, -1);
+        res->bitmap &= ~bit;
+        return res;
+    }
+
+    // Pull a lone remaining leaf up into this node
+    lhamt_node *res = lhamt_edit(n, at, 0);
+    if (child->count == 1 && child->slots[0].leaf != NULL) {
+        res->slots[at] = (lhamt_slot){ NULL, lmap_leaf_retain(child->slots[0].leaf) };
+        lhamt_release(child);
+    } else {
+        res->slots[at] = (lhamt_slot){ child, NULL };
+    }
+    return res;
+}
+
+static bool lhamt_each(lhamt_node *n, lmap_visit visit, void *ctx) {
+    for (int i = 0; i < n->count; i++) {
+        bool more = n->slots[i].node != NULL
+            ? lhamt_each(n->slots[i].node, visit, ctx)
+            : visit(n->slots[i].leaf, ctx);
+        if (!more) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool lmap_each(lmap *m, lmap_visit visit, void *ctx) {
+    if (m->kind == LMAP_HAMT) {
+        return m->root == NULL || lhamt_each(m->root, visit, ctx);
+    }
+
+    for (long i = 0; i < m->cap; i++) {
+        if (m->slots[i].leaf != NULL && !visit(m->slots[i].leaf, ctx)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static lmap *lmap_new(enum LMAP_KIND kind) {
+    lmap *m = lmalloc(sizeof(lmap));
+    m->refs = 1;
+    m->kind = kind;
+    m->count = 0;
+    m->cap = 0;
+    m->slots = NULL;
+    m->root = NULL;
+    return m;
+}
+
+lmap *lmap_retain(lmap *m) {
+    REF_RETAIN(m);
+    return m;
+}
+
+void lmap_release(lmap *m) {
+    if (REF_RELEASE(m) > 0) {
+        return;
+    }
+
+    if (m->kind == LMAP_HAMT) {
+        if (m->root != NULL) { lhamt_release(m->root); }
+    } else {
+        for (long i = 0; i < m->cap; i++) {
+            if (m->slots[i].leaf != NULL) { lmap_leaf_release(m->slots[i].leaf); }
+        }
+        lfree(m->slots);
+    }
+    lfree(m);
+}
+
+static lmap_leaf *lmap_get(lmap *m, uint64_t hash, lval *key) {
+    if (m->kind == LMAP_HAMT) {
+        return lhamt_get(m->root, hash, key);
+    }
+    if (m->cap == 0) {
+        return NULL;
+    }
+
+    long mask = m->cap - 1;
+    for (long i = hash & mask; m->slots[i].leaf != NULL; i = (i + 1) & mask) {
+        if (m->slots[i].hash == hash && lval_eq(m->slots[i].leaf->key, key)) {
+            return m->slots[i].leaf;
+        }
+    }
+    return NULL;
+}
+
+// Inserts a leaf whose key is not yet in the table, which has room for it
+static void lmap_hash_insert(lmap *m, lmap_leaf *leaf) {
+    long mask = m->cap - 1;
+    long i = leaf->hash & mask;
+    while (m->slots[i].leaf != NULL) {
+        i = (i + 1) & mask;
+    }
+    m->slots[i] = (lmap_slot){ leaf->hash, leaf };
+}
+
+static void lmap_hash_resize(lmap *m, long cap) {
+    lmap_slot *old = m->slots;
+    long old_cap = m->cap;
+
+    m->cap = cap;
+    m->slots = lcalloc(cap, sizeof(lmap_slot));
+    for (long i = 0; i < old_cap; i++) {
+        if (old[i].leaf != NULL) {
+            lmap_hash_insert(m, old[i].leaf);
+        }
+    }
+    lfree(old);
+}
+
+// Returns a map equal to m that the caller may update in place, consuming m
+static lmap *lmap_own(lmap *m) {
+    if (!REF_SHARED(m) && __atomic_load_n(&m->refs, __ATOMIC_ACQUIRE) == 1) {
+        return m;
+    }
+
+    lmap *res = lmap_new(m->kind);
+    res->count = m->count;
+    if (m->kind == LMAP_HAMT) {
+        res->root = m->root != NULL ? lhamt_retain(m->root) : NULL;
+    } else if (m->cap > 0) {
+        res->cap = m->cap;
+        res->slots = lmalloc(sizeof(lmap_slot) * m->cap);
+        memcpy(res->slots, m->slots, sizeof(lmap_slot) * m->cap);
+        for (long i = 0; i < m->cap; i++) {
+            if (res->slots[i].leaf != NULL) { lmap_leaf_retain(res->slots[i].leaf); }
+        }
+    }
+    lmap_release(m);
+    return res;
+}
+
+// Sets key to val in a map owned by the caller, consuming key and val
+static void lmap_put(lmap *m, uint64_t hash, lval *key, lval *val) {
+    lmap_leaf *leaf = lmap_leaf_new(hash, key, val);
+
+    if (m->kind == LMAP_HAMT) {
+        bool added = false;
+        lhamt_node *root = lhamt_put(m->root, 0, leaf, &added);
+        if (m->root != NULL) { lhamt_release(m->root); }
+        m->root = root;
+        m->count += added;
+        return;
+    }
+
+    long mask = m->cap - 1;
+    for (long i = hash & mask; m->cap > 0 && m->slots[i].leaf != NULL; i = (i + 1) & mask) {
+        if (m->slots[i].hash == hash && lval_eq(m->slots[i].leaf->key, key)) {
+            lmap_leaf_release(m->slots[i].leaf);
+            m->slots[i].leaf = leaf;
+            return;
+        }
+    }
+
+    // Keep the load factor at most 3/4
+    if ((m->count + 1) * 4 > m->cap * 3) {
+        lmap_hash_resize(m, m->cap == 0 ? LMAP_MIN_CAP : m->cap * 2);
+    }
+    lmap_hash_insert(m, leaf);
+    m->count++;
+}
+
+// Removes key from a map owned by the caller
+static void lmap_del(lmap *m, uint64_t hash, lval *key) {
+    if (m->kind == LMAP_HAMT) {
+        if (m->root == NULL) {
+            return;
+        }
+        bool removed = false;
+        lhamt_node *root = lhamt_del(m->root, 0, hash, key, &removed);
+        lhamt_release(m->root);
+        m->root = root;
+        m->count -= removed;
+        return;
+    }
+    if (m->cap == 0) {
+        return;
+    }
+
+    long mask = m->cap - 1;
+    long i = hash & mask;
+    while (true) {
+        if (m->slots[i].leaf == NULL) {
+            return;
+        }
+        if (m->slots[i].hash == hash && lval_eq(m->slots[i].leaf->key, key)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+
+    lmap_leaf_release(m->slots[i].leaf);
+    m->count--;
+
+    // Shift back the entries after the hole that probed past it
+    for (long j = (i + 1) & mask; m->slots[j].leaf != NULL; j = (j + 1) & mask) {
+        long home = m->slots[j].hash & mask;
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+    m->slots[i].leaf = NULL;
+}
+
+static bool lmap_eq_visit(lmap_leaf *l, void *ctx) {
+    lmap_leaf *other = lmap_get(ctx, l->hash, l->key);
+    return other != NULL && lval_eq(l->val, other->val);
+}
+
+bool lmap_eq(lmap *a, lmap *b) {
+    return a == b || (a->count == b->count && lmap_each(a, lmap_eq_visit, b));
+}
+
+typedef struct {
+    struct dyn_string *out;
+    bool first;
+} lmap_writer;
+
+static bool lmap_write_visit(lmap_leaf *l, void *ctx) {
+    lmap_writer *w = ctx;
+    if (!w->first) {
+        dyn_string_push(w->out, ' ');
+    }
+    w->first = false;
+
+    lval_write(w->out, l->key);
+    dyn_string_push(w->out, ' ');
+    lval_write(w->out, l->val);
+    return true;
+}
+
+void lmap_write(struct dyn_string *out, lmap *m) {
+    lmap_writer w = { out, true };
+    dyn_string_append(out, "#{");
+    lmap_each(m, lmap_write_visit, &w);
+    dyn_string_push(out, '}');
+}
+
+// Builds a map from alternating keys and values, given either as the
+// arguments or as a single Q-expression
+static lval *lval_map_new(char *func, enum LMAP_KIND kind, lval *v) {
+    if (v->sexpr.count == 1 && v->sexpr.cell[0]->type == LVAL_QEXPR) {
+        v = lval_take(v, 0);
+        v->type = LVAL_SEXPR;
+    }
+
+    LASSERT(v, v->sexpr.count % 2 == 0,
+            "Function '%s' expects keys and values in pairs, got %d arguments",
+            func, v->sexpr.count);
+
+    lmap *m = lmap_new(kind);
+    while (v->sexpr.count > 0) {
+        uint64_t hash;
+        if (!lmap_hash(v->sexpr.cell[0], &hash)) {
+            lval *err = lmap_key_error(func, v->sexpr.cell[0]);
+            lmap_release(m);
+            lval_del(v);
+            return err;
+        }
+        lval *key = lval_expr_pop(&v->sexpr, 0);
+        lval *val = lval_expr_pop(&v->sexpr, 0);
+        lmap_put(m, hash, key, val);
+    }
+
+    lval_del(v);
+    return lval_map(m);
+}
+
+lval *builtin_map_new(UNUSED lenv *e, lval *v) {
+    return lval_map_new("map-new", LMAP_HASH, v);
+}
+
+lval *builtin_hamt_new(UNUSED lenv *e, lval *v) {
+    return lval_map_new("hamt-new", LMAP_HAMT, v);
+}
+
+lval *builtin_map_get(UNUSED lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count == 2 || v->sexpr.count == 3,
+            "Function 'map-get' expects 2 or 3 arguments, got %d", v->sexpr.count);
+    LASSERT_ARG_TYPE("map-get", v, 0, LVAL_MAP);
+
+    lval *key = v->sexpr.cell[1];
+    uint64_t hash;
+    if (!lmap_hash(key, &hash)) {
+        lval *err = lmap_key_error("map-get", key);
+        lval_del(v);
+        return err;
+    }
+
+    lmap_leaf *l = lmap_get(v->sexpr.cell[0]->map, hash, key);
+    if (l != NULL) {
+        lval *res = lval_copy(l->val);
+        lval_del(v);
+        return res;
+    }
+    if (v->sexpr.count == 3) {
+        return lval_take(v, 2);
+    }
+
+    dyn_string *printed = dyn_string_new();
+    lval_write(printed, key);
+    lval *err = lval_error("Function 'map-get' found no key %s", printed->buf);
+    dyn_string_del(printed);
+    lval_del(v);
+    return err;
+}
+
+lval *builtin_map_put(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("map-put", v, 3);
+    LASSERT_ARG_TYPE("map-put", v, 0, LVAL_MAP);
+
+    uint64_t hash;
+    if (!lmap_hash(v->sexpr.cell[1], &hash)) {
+        lval *err = lmap_key_error("map-put", v->sexpr.cell[1]);
+        lval_del(v);
+        return err;
+    }
+
+    lval *val = lval_expr_pop(&v->sexpr, 2);
+    lval *key = lval_expr_pop(&v->sexpr, 1);
+    lval *res = lval_take(v, 0);
+    res->map = lmap_own(res->map);
+    lmap_put(res->map, hash, key, val);
+    return res;
+}
+
+lval *builtin_map_del(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("map-del", v, 2);
+    LASSERT_ARG_TYPE("map-del", v, 0, LVAL_MAP);
+
+    lval *key = v->sexpr.cell[1];
+    uint64_t hash;
+    if (!lmap_hash(key, &hash)) {
+        lval *err = lmap_key_error("map-del", key);
+        lval_del(v);
+        return err;
+    }
+
+    lval *res = v->sexpr.cell[0];
+    if (lmap_get(res->map, hash, key) != NULL) {
+        res->map = lmap_own(res->map);
+        lmap_del(res->map, hash, key);
+    }
+    return lval_take(v, 0);
+}
+
+static bool lmap_keys_visit(lmap_leaf *l, void *ctx) {
+    lval *keys = ctx;
+    lval_expr_push_back(&keys->qexpr, lval_copy(l->key));
+    return true;
+}
+
+lval *builtin_map_keys(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("map-keys", v, 1);
+    LASSERT_ARG_TYPE("map-keys", v, 0, LVAL_MAP);
+
+    lval *keys = lval_qexpr();
+    lmap_each(v->sexpr.cell[0]->map, lmap_keys_visit, keys);
+    lval_del(v);
+    return keys;
+}
+
+lval *builtin_map_len(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("map-len", v, 1);
+    LASSERT_ARG_TYPE("map-len", v, 0, LVAL_MAP);
+
+    long count = v->sexpr.cell[0]->map->count;
+    lval_del(v);
+    return lval_int(count);
+}
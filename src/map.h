@@ -0,0 +1,74 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct lenv lenv;
+typedef struct lval lval;
+struct dyn_string;
+
+// A key and its value. Leaves are shared by reference count between the
+// maps that contain them, so copying a map never copies its contents.
+typedef struct {
+    int refs;
+    uint64_t hash;
+    lval *key;
+    lval *val;
+} lmap_leaf;
+
+typedef struct {
+    uint64_t hash;
+    lmap_leaf *leaf;
+} lmap_slot;
+
+typedef struct lhamt_node lhamt_node;
+
+// Exactly one of `node` and `leaf` is set
+typedef struct {
+    lhamt_node *node;
+    lmap_leaf *leaf;
+} lhamt_slot;
+
+// A node of a hash array mapped trie. Each level consumes LHAMT_BITS of the
+// hash; `bitmap` records which of the 32 children are present and `slots`
+// holds them densely. Below the last level a node holds colliding leaves.
+struct lhamt_node {
+    int refs;
+    uint32_t bitmap;
+    int count;
+    lhamt_slot slots[];
+};
+
+enum LMAP_KIND {
+    LMAP_HASH,
+    LMAP_HAMT,
+};
+
+// Maps are immutable values. A hash map is an open-addressing table which
+// is updated in place while nothing else references it and copied
+// otherwise. A HAMT shares everything but the path to the changed key with
+// the map it was updated from.
+typedef struct lmap lmap;
+struct lmap {
+    int refs;
+    enum LMAP_KIND kind;
+    long count;
+    long cap;
+    lmap_slot *slots;
+    lhamt_node *root;
+};
+
+typedef bool (*lmap_visit)(lmap_leaf *l, void *ctx);
+
+lmap *lmap_retain(lmap *m);
+void lmap_release(lmap *m);
+bool lmap_eq(lmap *a, lmap *b);
+void lmap_write(struct dyn_string *out, lmap *m);
+// Calls visit on every leaf of m until it returns false
+bool lmap_each(lmap *m, lmap_visit visit, void *ctx);
+
+lval *builtin_map_new(lenv *e, lval *v);
+lval *builtin_hamt_new(lenv *e, lval *v);
+lval *builtin_map_get(lenv *e, lval *v);
+lval *builtin_map_put(lenv *e, lval *v);
+lval *builtin_map_del(lenv *e, lval *v);
+lval *builtin_map_keys(lenv *e, lval *v);
+lval *builtin_map_len(lenv *e, lval *v);
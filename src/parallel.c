@@ -0,0 +1,240 @@
+#include <stdlib.h>
+
+#include "lval.h"
+#include "pool.h"
+#include "parallel.h"
+#include "builtins.h"
+#include "utils.h"
+#include "interp.h"
+
+// Number of chunks `preduce` splits its input into
+#define PREDUCE_CHUNKS 256
+
+// A parallel job over the cells of a Q-expression. Each worker evaluates in
+// a fresh frame chained to the caller's environment, which stays frozen
+// for the duration of the job.
+typedef struct {
+    clisp *owner;
+    lpool_task task;
+    lenv *env;
+    lval *f;
+    lval **items;
+    long count;
+    lval **results;
+    long chunk;
+    long error_at;
+} lpar_job;
+
+// Calls f on copies of the given arguments in a new frame above the job's
+// environment.
+static lval *lpar_apply(lpar_job *job, lval *x, lval *y) {
+    lenv *frame = lenv_new();
+    frame->parent = job->env;
+
+    lval *args = lval_sexpr();
+    lval_expr_push_back(&args->sexpr, x);
+    if (y != NULL) {
+        lval_expr_push_back(&args->sexpr, y);
+    }
+
+    lval *res = lval_apply(frame, job->f, args);
+    lenv_del(frame);
+    return res;
+}
+
+// Records that task i failed. Tasks after the earliest failure are skipped,
+// so the error reported is always the one a sequential run would hit.
+static void lpar_fail(lpar_job *job, long i) {
+    long cur = __atomic_load_n(&job->error_at, __ATOMIC_RELAXED);
+    while (i < cur &&
+           !__atomic_compare_exchange_n(&job->error_at, &cur, i, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static bool lpar_skip(lpar_job *job, long i) {
+    return i > __atomic_load_n(&job->error_at, __ATOMIC_RELAXED);
+}
+
+static void lpar_map_task(void *ctx, long i) {
+    lpar_job *job = ctx;
+    if (lpar_skip(job, i)) {
+        return;
+    }
+
+    lval *res = lpar_apply(job, lval_copy(job->items[i]), NULL);
+    if (res->type == LVAL_ERROR) {
+        lpar_fail(job, i);
+    }
+    job->results[i] = res;
+}
+
+static void lpar_filter_task(void *ctx, long i) {
+    lpar_job *job = ctx;
+    lpar_map_task(ctx, i);
+
+    lval *res = job->results[i];
+    if (res != NULL && res->type != LVAL_ERROR && res->type != LVAL_BOOL) {
+        job->results[i] = lval_error("Function 'pfilter' expects a predicate returning a bool, got %s",
+                                     lval_type_name(res->type));
+        lval_del(res);
+        lpar_fail(job, i);
+    }
+}
+
+static void lpar_reduce_task(void *ctx, long c) {
+    lpar_job *job = ctx;
+    if (lpar_skip(job, c)) {
+        return;
+    }
+
+    long lo = c * job->chunk;
+    long hi = lo + job->chunk < job->count ? lo + job->chunk : job->count;
+
+    lval *acc = lval_copy(job->items[lo]);
+    for (long i = lo + 1; i < hi && acc->type != LVAL_ERROR; i++) {
+        acc = lpar_apply(job, acc, lval_copy(job->items[i]));
+    }
+
+    if (acc->type == LVAL_ERROR) {
+        lpar_fail(job, c);
+    }
+    job->results[c] = acc;
+}
+
+// Runs a task on behalf of the interpreter that started the job
+static void lpar_task(void *ctx, long i) {
+    lpar_job *job = ctx;
+    clisp *prev = clisp_enter(job->owner);
+    job->task(ctx, i);
+    clisp_leave(prev);
+}
+
+// Freezes the chain of environments the workers can see and runs the job.
+// Returns the first error in task order, or NULL if every task succeeded.
+static lval *lpar_run(lenv *e, lpar_job *job, lpool_task task, long n) {
+    job->owner = clisp_current();
+    job->task = task;
+    job->env = e;
+    job->results = lcalloc(n, sizeof(lval*));
+    job->error_at = n;
+
+    int frozen = 0;
+    for (lenv *x = e; x != NULL && !x->frozen; x = x->parent) {
+        x->frozen = true;
+        frozen++;
+    }
+
+    lpool_run(lpar_task, job, n);
+
+    for (lenv *x = e; frozen > 0; x = x->parent, frozen--) {
+        x->frozen = false;
+    }
+
+    if (job->error_at == n) {
+        return NULL;
+    }
+
+    lval *err = job->results[job->error_at];
+    job->results[job->error_at] = NULL;
+    for (long i = 0; i < n; i++) {
+        if (job->results[i] != NULL) {
+            lval_del(job->results[i]);
+        }
+    }
+    lfree(job->results);
+    return err;
+}
+
+static lval *builtin_pfunc(lenv *e, lval *v, char *func, lpool_task task) {
+    LASSERT_ARG_COUNT(func, v, 2);
+    LASSERT(v, lval_is_func(v->sexpr.cell[0]),
+            "Function '%s' expects a function as first argument, got %s",
+            func, lval_type_name(v->sexpr.cell[0]->type));
+    LASSERT_ARG_TYPE(func, v, 1, LVAL_QEXPR);
+
+    lval *list = v->sexpr.cell[1];
+    lpar_job job = {
+        .f = v->sexpr.cell[0],
+        .items = list->qexpr.cell,
+        .count = list->qexpr.count,
+    };
+
+    lval *err = lpar_run(e, &job, task, job.count);
+    if (err != NULL) {
+        lval_del(v);
+        return err;
+    }
+
+    lval *res = lval_qexpr();
+    for (long i = 0; i < job.count; i++) {
+        lval *x = job.results[i];
+        if (task == lpar_map_task) {
+            lval_expr_push_back(&res->qexpr, x);
+            continue;
+        }
+
+        if (x->_bool) {
+            lval_expr_push_back(&res->qexpr, lval_copy(list->qexpr.cell[i]));
+        }
+        lval_del(x);
+    }
+
+    lfree(job.results);
+    lval_del(v);
+    return res;
+}
+
+lval *builtin_pmap(lenv *e, lval *v) {
+    return builtin_pfunc(e, v, "pmap", lpar_map_task);
+}
+
+lval *builtin_pfilter(lenv *e, lval *v) {
+    return builtin_pfunc(e, v, "pfilter", lpar_filter_task);
+}
+
+// Folds each chunk of the list in parallel, then folds the chunk results
+// into init from left to right, so f has to be associative.
+lval *builtin_preduce(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("preduce", v, 3);
+    LASSERT(v, lval_is_func(v->sexpr.cell[0]),
+            "Function 'preduce' expects a function as first argument, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+    LASSERT_ARG_TYPE("preduce", v, 2, LVAL_QEXPR);
+
+    lval *list = v->sexpr.cell[2];
+    lpar_job job = {
+        .f = v->sexpr.cell[0],
+        .items = list->qexpr.cell,
+        .count = list->qexpr.count,
+    };
+
+    long chunks = job.count < PREDUCE_CHUNKS ? job.count : PREDUCE_CHUNKS;
+    if (chunks > 0) {
+        job.chunk = (job.count + chunks - 1) / chunks;
+        chunks = (job.count + job.chunk - 1) / job.chunk;
+    }
+
+    lval *err = lpar_run(e, &job, lpar_reduce_task, chunks);
+    if (err != NULL) {
+        lval_del(v);
+        return err;
+    }
+
+    lval *acc = lval_copy(v->sexpr.cell[1]);
+    for (long c = 0; c < chunks; c++) {
+        if (acc->type == LVAL_ERROR) {
+            lval_del(job.results[c]);
+            continue;
+        }
+
+        lval *args = lval_sexpr();
+        lval_expr_push_back(&args->sexpr, acc);
+        lval_expr_push_back(&args->sexpr, job.results[c]);
+        acc = lval_apply(e, job.f, args);
+    }
+
+    lfree(job.results);
+    lval_del(v);
+    return acc;
+}
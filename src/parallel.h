@@ -0,0 +1,6 @@
+typedef struct lenv lenv;
+typedef struct lval lval;
+
+lval *builtin_pmap(lenv *e, lval *v);
+lval *builtin_pfilter(lenv *e, lval *v);
+lval *builtin_preduce(lenv *e, lval *v);
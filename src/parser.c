@@ -6,158 +6,172 @@
 
 #include "lval.h"
 #include "dyn_string.h"
+#include "interp.h"
+#include "bignum.h"
+#include "pool.h"
+#include "scan.h"
 
-static inline bool valid_symbol_char(char c) {
-    return isalpha(c) || strchr("0123456789_+-*%^\\/=<>!&|", c) != NULL;
-}
+// Files are split into chunks of about this many bytes, parsed in parallel
+#define PARSE_CHUNK (256 << 10)
+#define PARSE_MAX_CHUNKS 1024
 
-static inline bool is_numeric(char c) {
-    return strchr("-0123456789.", c) != NULL;
-}
+// Set when an error ended parsing early, which skips the rest of the input
+static __thread bool parse_stopped = false;
 
 static lval *parse_int(char *s) {
     errno = 0;
     long x = strtol(s, NULL, 10);
-    return errno != ERANGE ? lval_int(x) : lval_error("invalid number");
+    if (errno != ERANGE) {
+        return lval_int(x);
+    }
+
+    lval *big = lval_bigint_parse(s);
+    return big != NULL ? big : lval_error("invalid number");
 }
 
 static lval *parse_double(char *s) {
     errno = 0;
     double x = strtod(s, NULL);
-    free(s);
 
     return errno != ERANGE ? lval_double(x) : lval_error("invalid floating point number");
 }
 
 static int parse_number(lval *v, const char *s, int i) {
-    dyn_string *str = dyn_string_new();
-
-    while ((valid_symbol_char(s[i]) || s[i] == '.') && s[i] != '\0') {
-        if (!is_numeric(s[i])) {
+    int start = i;
+    bool is_double = false;
+    while (LSCAN_IS(s[i], LSCAN_SYMBOL | LSCAN_NUMERIC)) {
+        if (!LSCAN_IS(s[i], LSCAN_NUMERIC)) {
             return -1;
         }
-        dyn_string_push(str, s[i]);
+        is_double |= s[i] == '.';
         i++;
     }
 
-    if (strcmp(str->buf, "-") == 0) {
+    if (i - start == 1 && s[start] == '-') {
         return -1;
     }
 
-    bool is_double = false;
-    for (size_t i = 0; i < str->len; i++) {
-        char c = str->buf[i];
-        if (c == '.') {
-            is_double = true;
-        }
+    // Numbers long enough to need a bignum are copied to the heap
+    char buf[64];
+    dyn_string *str = NULL;
+    char *num = buf;
+    if (i - start < (int)sizeof(buf)) {
+        memcpy(buf, s + start, i - start);
+        buf[i - start] = '\0';
+    } else {
+        str = dyn_string_new();
+        dyn_string_append_n(str, s + start, i - start);
+        num = str->buf;
     }
 
     if (is_double) {
-        lval_expr_push_back(&v->sexpr, parse_double(str->buf));
+        lval_expr_push_back(&v->sexpr, parse_double(num));
     } else {
-        lval_expr_push_back(&v->sexpr, parse_int(str->buf));
+        lval_expr_push_back(&v->sexpr, parse_int(num));
     }
 
+    if (str != NULL) {
+        dyn_string_del(str);
+    }
     return i;
 }
 
-static int parse_symbol(lval *v, const char *s, int i) {
-    dyn_string *str = dyn_string_new();
-
+static int parse_symbol(lval *v, const char *s, int i, int len) {
     if (isdigit(s[i])) {
         lval_expr_push_back(&v->sexpr, lval_error("symbol can't start with a number"));
     }
-    while (valid_symbol_char(s[i]) && s[i] != '\0') {
-        dyn_string_push(str, s[i]);
-        i++;
-    }
+    int start = i;
+    i = lscan_symbol(s, i, len);
+    int n = i - start;
 
     // Parse bool
-    if (strcmp(str->buf, "true") == 0) {
+    if (n == 4 && memcmp(s + start, "true", 4) == 0) {
         lval_expr_push_back(&v->sexpr, lval_bool(true));
-    } else if (strcmp(str->buf, "false") == 0) {
+    } else if (n == 5 && memcmp(s + start, "false", 5) == 0) {
         lval_expr_push_back(&v->sexpr, lval_bool(false));
     } else {
-        lval_expr_push_back(&v->sexpr, lval_symbol(str->buf));
+        lval_expr_push_back(&v->sexpr, lval_symbol_n(s + start, n));
     }
 
-    dyn_string_del(str);
-    
     return i;
 }
 
-static int parse_string(lval *v, const char *s, int i) {
+static int parse_string(lval *v, const char *s, int i, int len) {
     dyn_string *str = dyn_string_new();
 
-    while (s[i] != '"') {
-        char c = s[i];
-        if (c == '\0') {
+    while (true) {
+        int run = lscan_string(s, i, len);
+        dyn_string_append_n(str, s + i, run - i);
+        i = run;
+        if (i >= len) {
             lval_expr_push_back(&v->sexpr, lval_error("Unexpected end of input while parsing string literal"));
             dyn_string_del(str);
-            return i + 1;
+            parse_stopped = true;
+            return len;
         }
-
-        if (c == '\\') {
-            i++;
-
-            if (strchr(lval_str_unescapable, s[i])) {
-                c = lval_str_unescape(s[i]);
-            } else {
-                lval_expr_push_back(&v->sexpr, lval_error("Invalid escape character %c", c));
-                dyn_string_del(str);
-                return i + 1;
-            }
+        if (s[i] == '"') {
+            break;
         }
 
-        dyn_string_push(str, c);
+        // A backslash
         i++;
+        if (i >= len) {
+            continue;
+        }
+        if (strchr(lval_str_unescapable, s[i])) {
+            dyn_string_push(str, lval_str_unescape(s[i]));
+            i++;
+        } else {
+            lval_expr_push_back(&v->sexpr, lval_error("Invalid escape character %c", '\\'));
+            dyn_string_del(str);
+            return i + 1;
+        }
     }
 
-    lval_expr_push_back(&v->sexpr, lval_string(str->buf));
+    lval_expr_push_back(&v->sexpr, lval_string_n(str->buf, str->len));
     dyn_string_del(str);
 
     return i+1;
 }
 
-int parse_expr(lval *v, const char *s, int i, char end) {
-    while (s[i] != end) {
-        if (s[i] == '\0') {
-            lval_expr_push_back(&v->sexpr, lval_error("Missing %c at end of input", end));
-            return strlen(s) + 1;
+// Reads forms into v up to `end` from s[i], where s holds len bytes
+static int parse_form(lval *v, const char *s, int i, int len, char end) {
+    while (true) {
+        i = lscan_space(s, i, len);
+        if (i >= len) {
+            break;
         }
-
-        // Skip whitespace
-        if (strchr(" \t\v\r\n", s[i])) {
-            i++;
-            continue;
+        char c = s[i];
+        if (c == end) {
+            return i + 1;
         }
 
         // Read comment
-        if (s[i] == ';') {
-            while (s[i] != '\n' && s[i] != '\0') {
-                i++;
-            }
-            i++;
+        if (c == ';') {
+            const char *nl = memchr(s + i, '\n', len - i);
+            i = nl != NULL ? nl - s + 1 : len;
             continue;
         }
 
         // Read S-expression
-        if (s[i] == '(') {
+        if (c == '(') {
             lval *x = lval_sexpr();
             lval_expr_push_back(&v->sexpr, x);
-            i = parse_expr(x, s, i+1, ')');
+            i = parse_form(x, s, i+1, len, ')');
+            lval_expr_attach_cache(x);
             continue;
         }
 
         // Read Q-expression
-        if (s[i] == '{') {
+        if (c == '{') {
             lval *x = lval_qexpr();
             lval_expr_push_back(&v->sexpr, x);
-            i = parse_expr(x, s, i+1, '}');
+            i = parse_form(x, s, i+1, len, '}');
+            lval_expr_attach_cache(x);
             continue;
         }
 
-        if (is_numeric(s[i])) {
+        if (LSCAN_IS(c, LSCAN_NUMERIC)) {
             int res = parse_number(v, s, i);
             if (res != -1) {
                 i = res;
@@ -166,22 +180,162 @@ int parse_expr(lval *v, const char *s, int i, char end) {
         }
 
         // Read symbol
-        if (valid_symbol_char(s[i])) {
-            i = parse_symbol(v, s, i);
+        if (LSCAN_IS(c, LSCAN_SYMBOL)) {
+            i = parse_symbol(v, s, i, len);
             continue;
         }
 
         // Read string
-        if (s[i] == '"') {
-            i = parse_string(v, s, i);
+        if (c == '"') {
+            i = parse_string(v, s, i + 1, len);
             continue;
         }
 
-        lval_expr_push_back(&v->sexpr, lval_error("Unknown character %c", s[i]));
-        return strlen(s) + 1;
+        lval_expr_push_back(&v->sexpr, lval_error("Unknown character %c", c));
+        parse_stopped = true;
+        return len;
     }
 
-    return i+1;
+    if (end != '\0') {
+        lval_expr_push_back(&v->sexpr, lval_error("Missing %c at end of input", end));
+        parse_stopped = true;
+        return len;
+    }
+    return len + 1;
+}
+
+int parse_expr(lval *v, const char *s, int i, char end) {
+    return parse_form(v, s, i, i + strlen(s + i), end);
+}
+
+// Finds where the input can be cut between top-level forms: newlines
+// outside strings, comments and brackets, at most one per `chunk` bytes.
+// Follows the parser's reading of strings, so that a cut is only ever made
+// where parse_expr would be between two forms, or past an error which ends
+// parsing anyway.
+static int parse_cuts(const char *s, long len, long chunk, long *cuts, int max) {
+    long i = 0;
+    long depth = 0;
+    long next = chunk;
+    int n = 0;
+
+    while (i < len && n < max) {
+        i += strcspn(s + i, "\";(){}\n");
+        if (i >= len) {
+            break;
+        }
+
+        switch (s[i]) {
+        case '"':
+            i++;
+            while (i < len) {
+                i += strcspn(s + i, "\"\\");
+                if (i >= len || s[i] == '"') {
+                    i++;
+                    break;
+                }
+                // An invalid escape ends the string right after it
+                bool valid = i + 1 < len && strchr(lval_str_unescapable, s[i + 1]);
+                i += 2;
+                if (!valid) {
+                    break;
+                }
+            }
+            break;
+        case ';': {
+            const char *nl = memchr(s + i, '\n', len - i);
+            i = nl != NULL ? nl - s : len;
+            break;
+        }
+        case '(':
+        case '{':
+            depth++;
+            i++;
+            break;
+        case ')':
+        case '}':
+            // A closing bracket at the top level stops the parser
+            if (--depth < 0) {
+                return n;
+            }
+            i++;
+            break;
+        default:
+            if (depth == 0 && i >= next) {
+                cuts[n++] = i;
+                next = i + chunk;
+            }
+            i++;
+        }
+    }
+    return n;
+}
+
+typedef struct {
+    clisp *owner;
+    char *input;
+    // Chunk i runs from starts[i] up to the terminator the cut left
+    long *starts;
+    lval **results;
+    bool *stopped;
+} parse_job;
+
+static void parse_chunk(void *ctx, long i) {
+    parse_job *job = ctx;
+    clisp *prev = clisp_enter(job->owner);
+    parse_stopped = false;
+    lval *x = lval_sexpr();
+    parse_expr(x, job->input + job->starts[i], 0, '\0');
+    job->results[i] = x;
+    job->stopped[i] = parse_stopped;
+    clisp_leave(prev);
+}
+
+// Parses the chunks between the cuts on the worker pool and joins their
+// forms in order, giving the same result as parsing the whole input
+static lval *parse_chunks(char *input, long *cuts, int n) {
+    int count = n + 1;
+    parse_job job;
+    job.owner = clisp_current();
+    job.input = input;
+    job.starts = lmalloc(sizeof(long) * count);
+    job.results = lmalloc(sizeof(lval*) * count);
+    job.stopped = lmalloc(sizeof(bool) * count);
+
+    job.starts[0] = 0;
+    for (int i = 0; i < n; i++) {
+        input[cuts[i]] = '\0';
+        job.starts[i + 1] = cuts[i] + 1;
+    }
+    lpool_run(parse_chunk, &job, count);
+
+    // Nothing after an error that stopped the parser is part of the result
+    int used = 0;
+    int total = 0;
+    while (used < count) {
+        total += job.results[used]->sexpr.count;
+        if (job.stopped[used++]) {
+            break;
+        }
+    }
+
+    lval *expr = lval_sexpr();
+    expr->sexpr.cell = total > 0 ? lmalloc(sizeof(lval*) * total) : NULL;
+    for (int i = 0; i < count; i++) {
+        lval *x = job.results[i];
+        if (i < used && x->sexpr.count > 0) {
+            memcpy(expr->sexpr.cell + expr->sexpr.count, x->sexpr.cell,
+                   sizeof(lval*) * x->sexpr.count);
+            expr->sexpr.count += x->sexpr.count;
+            x->sexpr.count = 0;
+        }
+        lval_del(x);
+    }
+
+    lfree(job.starts);
+    lfree(job.results);
+    lfree(job.stopped);
+    return expr;
 }
 
 lval *parse_file(const char *filename) {
@@ -195,14 +349,23 @@ lval *parse_file(const char *filename) {
     long length = ftell(f);
 
     fseek(f, 0, SEEK_SET);
-    char *input = calloc(length+1, sizeof(char));
+    char *input = lcalloc(length+1, sizeof(char));
     fread(input, 1, length, f);
 
     fclose(f);
 
-    lval *expr = lval_sexpr();
-    parse_expr(expr, input, 0, '\0');
-    free(input);
+    // Parsing stops at the first NUL, as it does for the whole input
+    long cuts[PARSE_MAX_CHUNKS - 1];
+    int n = parse_cuts(input, strlen(input), PARSE_CHUNK, cuts, PARSE_MAX_CHUNKS - 1);
+
+    lval *expr;
+    if (n > 0) {
+        expr = parse_chunks(input, cuts, n);
+    } else {
+        expr = lval_sexpr();
+        parse_expr(expr, input, 0, '\0');
+    }
+    lfree(input);
 
     return expr;
 }
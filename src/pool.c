@@ -0,0 +1,189 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// A work-stealing pool. Each job is an index range that is split evenly
+// across the participants' deques up front. Participants take indices from
+// the front of their own deque and, once it is empty, steal the back half
+// of another participant's deque.
+typedef struct {
+    pthread_mutex_t lock;
+    long lo;
+    long hi;
+} lpool_deque;
+
+// Number of threads taking part in a job, including the caller. Zero means
+// one per online processor.
+int lpool_threads = 0;
+
+static int pool_size = 0;
+static lpool_deque *pool_deques = NULL;
+
+// Held by the thread whose job currently owns the pool
+static pthread_mutex_t pool_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static unsigned long pool_generation = 0;
+static int pool_active = 0;
+static lpool_task pool_task = NULL;
+static void *pool_ctx = NULL;
+
+static __thread bool pool_in_worker = false;
+
+bool lpool_in_worker(void) {
+    return pool_in_worker;
+}
+
+void lpool_forget(void) {
+    pool_deques = NULL;
+    pool_size = 0;
+    pool_generation = 0;
+    pool_active = 0;
+    pthread_cond_init(&pool_start, NULL);
+    pthread_cond_init(&pool_done, NULL);
+}
+
+static bool lpool_take(lpool_deque *d, long *i) {
+    pthread_mutex_lock(&d->lock);
+    bool found = d->lo < d->hi;
+    if (found) {
+        *i = d->lo++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool lpool_steal(int id) {
+    lpool_deque *own = &pool_deques[id];
+
+    for (int k = 1; k < pool_size; k++) {
+        lpool_deque *victim = &pool_deques[(id + k) % pool_size];
+
+        pthread_mutex_lock(&victim->lock);
+        long lo = victim->lo;
+        long hi = victim->hi;
+        if (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            victim->hi = mid;
+            pthread_mutex_unlock(&victim->lock);
+
+            pthread_mutex_lock(&own->lock);
+            own->lo = mid;
+            own->hi = hi;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return false;
+}
+
+static void lpool_work(int id, lpool_task task, void *ctx) {
+    long i;
+    do {
+        while (lpool_take(&pool_deques[id], &i)) {
+            task(ctx, i);
+        }
+    } while (lpool_steal(id));
+}
+
+static void *lpool_worker(void *arg) {
+    int id = (int)(long)arg;
+    unsigned long seen = 0;
+    pool_in_worker = true;
+
+    while (true) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_generation == seen) {
+            pthread_cond_wait(&pool_start, &pool_lock);
+        }
+        seen = pool_generation;
+        lpool_task task = pool_task;
+        void *ctx = pool_ctx;
+        pthread_mutex_unlock(&pool_lock);
+
+        lpool_work(id, task, ctx);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_active == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    return NULL;
+}
+
+static void lpool_init(void) {
+    pool_size = lpool_threads;
+    if (pool_size <= 0) {
+        pool_size = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (pool_size <= 0) {
+        pool_size = 1;
+    }
+
+    pool_deques = malloc(sizeof(lpool_deque) * pool_size);
+    for (int i = 0; i < pool_size; i++) {
+        pthread_mutex_init(&pool_deques[i].lock, NULL);
+        pool_deques[i].lo = 0;
+        pool_deques[i].hi = 0;
+    }
+
+    // The caller is participant 0, the pool threads run detached forever
+    for (long i = 1; i < pool_size; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, lpool_worker, (void*)i) != 0) {
+            pool_size = (int)i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void lpool_run(lpool_task task, void *ctx, long n) {
+    // Nested jobs run sequentially on the worker that started them, as do
+    // jobs from other interpreters while the pool is busy
+    if (pool_in_worker || pthread_mutex_trylock(&pool_job_lock) != 0) {
+        bool was_worker = pool_in_worker;
+        pool_in_worker = true;
+        for (long i = 0; i < n; i++) {
+            task(ctx, i);
+        }
+        pool_in_worker = was_worker;
+        return;
+    }
+
+    if (pool_deques == NULL) {
+        lpool_init();
+    }
+
+    for (int i = 0; i < pool_size; i++) {
+        pool_deques[i].lo = n * i / pool_size;
+        pool_deques[i].hi = n * (i + 1) / pool_size;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool_task = task;
+    pool_ctx = ctx;
+    pool_active = pool_size - 1;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+
+    pool_in_worker = true;
+    lpool_work(0, task, ctx);
+    pool_in_worker = false;
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_active > 0) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&pool_job_lock);
+}
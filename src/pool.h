@@ -0,0 +1,13 @@
+#include <stdbool.h>
+
+// Runs task(ctx, i) for every i in [0, n) on the worker pool and the
+// calling thread, returning once all of them have finished.
+typedef void (*lpool_task)(void *ctx, long i);
+
+extern int lpool_threads;
+
+void lpool_run(lpool_task task, void *ctx, long n);
+bool lpool_in_worker(void);
+// Called in a child process after fork, which has none of the pool's
+// threads. The next job starts new ones.
+void lpool_forget(void);
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "lval.h"
+#include "profile.h"
+#include "builtins.h"
+#include "dyn_string.h"
+#include "utils.h"
+#include "interp.h"
+
+// Period of the SIGPROF timer, in microseconds of CPU time
+#define LPROF_INTERVAL_US 1000
+// Frames sampled per thread. Deeper calls are still tracked, but samples
+// only keep their outermost LPROF_MAX_DEPTH frames.
+#define LPROF_MAX_DEPTH 256
+// The signal handler cannot allocate, so samples are aggregated into a
+// fixed table of distinct stacks whose frames live in one fixed array.
+// Samples that do not fit are dropped.
+#define LPROF_SLOTS 16384
+#define LPROF_FRAMES (1 << 18)
+
+bool lprof_active = false;
+
+static __thread const char *prof_stack[LPROF_MAX_DEPTH];
+static __thread volatile sig_atomic_t prof_depth = 0;
+
+typedef struct {
+    uint64_t hash;
+    int start;
+    int depth;
+    unsigned long count;
+} lprof_slot;
+
+// Guards the tables below against handlers running on several threads
+static char prof_busy = 0;
+static lprof_slot *prof_slots = NULL;
+static int prof_slots_used = 0;
+static const char **prof_frames = NULL;
+static int prof_frames_used = 0;
+static unsigned long prof_dropped = 0;
+
+// Interned names are kept for the life of the process, as frames of a
+// running evaluation may still point at them after a profile is written
+static pthread_mutex_t prof_names_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **prof_names = NULL;
+static size_t prof_names_count = 0;
+static size_t prof_names_cap = 0;
+
+static uint64_t prof_hash_str(const char *s) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 1099511628211ull;
+    }
+    return h;
+}
+
+static void prof_names_insert(char *name) {
+    size_t mask = prof_names_cap - 1;
+    size_t i = prof_hash_str(name) & mask;
+    while (prof_names[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    prof_names[i] = name;
+}
+
+const char *lprof_intern(const char *name) {
+    pthread_mutex_lock(&prof_names_lock);
+
+    if (prof_names_count * 2 >= prof_names_cap) {
+        char **old = prof_names;
+        size_t old_cap = prof_names_cap;
+        prof_names_cap = old_cap == 0 ? 256 : old_cap * 2;
+        prof_names = calloc(prof_names_cap, sizeof(char *));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i] != NULL) {
+                prof_names_insert(old[i]);
+            }
+        }
+        free(old);
+    }
+
+    size_t mask = prof_names_cap - 1;
+    size_t i = prof_hash_str(name) & mask;
+    while (prof_names[i] != NULL && strcmp(prof_names[i], name) != 0) {
+        i = (i + 1) & mask;
+    }
+    if (prof_names[i] == NULL) {
+        prof_names[i] = strdup(name);
+        prof_names_count++;
+    }
+
+    const char *res = prof_names[i];
+    pthread_mutex_unlock(&prof_names_lock);
+    return res;
+}
+
+void lprof_enter(const char *name) {
+    int depth = prof_depth;
+    if (depth < LPROF_MAX_DEPTH) {
+        prof_stack[depth] = name;
+    }
+    // The frame must be in place before a handler on this thread sees it
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    prof_depth = depth + 1;
+}
+
+void lprof_leave(void) {
+    if (prof_depth > 0) {
+        prof_depth--;
+    }
+}
+
+static bool prof_same(const lprof_slot *s, const char **stack, int depth) {
+    if (s->depth != depth) {
+        return false;
+    }
+    for (int i = 0; i < depth; i++) {
+        if (prof_frames[s->start + i] != stack[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void prof_record(const char **stack, int depth) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)stack[i]) * 1099511628211ull;
+    }
+
+    size_t mask = LPROF_SLOTS - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        lprof_slot *s = &prof_slots[i];
+        if (s->count > 0) {
+            if (s->hash == hash && prof_same(s, stack, depth)) {
+                s->count++;
+                return;
+            }
+            continue;
+        }
+
+        if (prof_slots_used >= LPROF_SLOTS / 4 * 3 ||
+            prof_frames_used + depth > LPROF_FRAMES) {
+            prof_dropped++;
+            return;
+        }
+        for (int k = 0; k < depth; k++) {
+            prof_frames[prof_frames_used + k] = stack[k];
+        }
+        s->hash = hash;
+        s->start = prof_frames_used;
+        s->depth = depth;
+        s->count = 1;
+        prof_frames_used += depth;
+        prof_slots_used++;
+        return;
+    }
+}
+
+// SIGPROF handler, sampling the shadow stack of whichever thread the
+// signal interrupted
+static void prof_sample(UNUSED int sig) {
+    if (!__atomic_load_n(&lprof_active, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (__atomic_test_and_set(&prof_busy, __ATOMIC_ACQUIRE)) {
+        __atomic_fetch_add(&prof_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (prof_slots != NULL) {
+        int depth = prof_depth;
+        prof_record(prof_stack, depth < LPROF_MAX_DEPTH ? depth : LPROF_MAX_DEPTH);
+    }
+
+    __atomic_clear(&prof_busy, __ATOMIC_RELEASE);
+}
+
+bool lprof_start(void) {
+    if (__atomic_exchange_n(&lprof_active, true, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+
+    // The handler stays installed once a profile has run: a SIGPROF still
+    // pending when the timer is stopped would otherwise kill the process
+    static bool installed = false;
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = prof_sample;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, NULL);
+        installed = true;
+    }
+
+    while (__atomic_test_and_set(&prof_busy, __ATOMIC_ACQUIRE)) {}
+    prof_slots = calloc(LPROF_SLOTS, sizeof(lprof_slot));
+    prof_frames = malloc(sizeof(char *) * LPROF_FRAMES);
+    prof_slots_used = 0;
+    prof_frames_used = 0;
+    prof_dropped = 0;
+    __atomic_clear(&prof_busy, __ATOMIC_RELEASE);
+
+    prof_depth = 0;
+
+    struct itimerval timer = {
+        .it_interval = { 0, LPROF_INTERVAL_US },
+        .it_value = { 0, LPROF_INTERVAL_US },
+    };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    return true;
+}
+
+static int prof_line_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+void lprof_stop(dyn_string *out) {
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+
+    // Wait for a handler still running on another thread
+    while (__atomic_test_and_set(&prof_busy, __ATOMIC_ACQUIRE)) {}
+    lprof_slot *slots = prof_slots;
+    const char **frames = prof_frames;
+    int count = prof_slots_used;
+    unsigned long dropped = prof_dropped;
+    prof_slots = NULL;
+    prof_frames = NULL;
+    __atomic_clear(&prof_busy, __ATOMIC_RELEASE);
+    __atomic_store_n(&lprof_active, false, __ATOMIC_RELEASE);
+
+    // Lines are sorted so that profiles of the same program diff cleanly
+    char **lines = malloc(sizeof(char *) * (count > 0 ? count : 1));
+    int n = 0;
+    dyn_string *line = dyn_string_new();
+    for (int i = 0; i < LPROF_SLOTS; i++) {
+        lprof_slot *s = &slots[i];
+        if (s->count == 0) {
+            continue;
+        }
+
+        dyn_string_clear(line);
+        if (s->depth == 0) {
+            dyn_string_append(line, "(toplevel)");
+        }
+        for (int k = 0; k < s->depth; k++) {
+            const char *name = frames[s->start + k];
+            if (k > 0) {
+                dyn_string_push(line, ';');
+            }
+            dyn_string_append(line, name != NULL ? name : "(anonymous)");
+        }
+        dyn_string_appendf(line, " %lu\n", s->count);
+        lines[n++] = strdup(line->buf);
+    }
+    dyn_string_del(line);
+
+    qsort(lines, n, sizeof(char *), prof_line_cmp);
+    for (int i = 0; i < n; i++) {
+        dyn_string_append(out, lines[i]);
+        free(lines[i]);
+    }
+    if (dropped > 0) {
+        dyn_string_appendf(out, "(dropped) %lu\n", dropped);
+    }
+
+    free(lines);
+    free(slots);
+    free(frames);
+}
+
+// (profile {expr}) evaluates expr and prints its folded stacks, and
+// (profile "file" {expr}) writes them to file instead. Inside another
+// profile only expr is evaluated, its samples going to the outer one.
+lval *builtin_profile(lenv *e, lval *v) {
+    int count = v->sexpr.count;
+    LASSERT(v, count == 1 || count == 2,
+            "Function 'profile' expects an optional file name and an expression, got %d arguments",
+            count);
+    if (count == 2) {
+        LASSERT_ARG_TYPE("profile", v, 0, LVAL_STRING);
+    }
+    LASSERT_ARG_TYPE("profile", v, count - 1, LVAL_QEXPR);
+
+    lval *expr = lval_expr_pop(&v->sexpr, count - 1);
+    expr->type = LVAL_SEXPR;
+    expr->sexpr = expr->qexpr;
+
+    bool started = lprof_start();
+    lval *res = lval_eval(e, expr);
+    if (!started) {
+        lval_del(v);
+        return res;
+    }
+
+    dyn_string *out = dyn_string_new();
+    lprof_stop(out);
+
+    if (count == 1) {
+        lprintf("%s", out->buf);
+    } else {
+        char *path = lstr_cstr(&v->sexpr.cell[0]->string);
+        FILE *f = fopen(path, "w");
+        if (f == NULL) {
+            lval_del(res);
+            res = lval_error("Could not write %s", path);
+        } else {
+            fwrite(out->buf, 1, out->len, f);
+            fclose(f);
+        }
+    }
+
+    dyn_string_del(out);
+    lval_del(v);
+    return res;
+}
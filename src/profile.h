@@ -0,0 +1,25 @@
+#include <stdbool.h>
+
+typedef struct lval lval;
+typedef struct lenv lenv;
+struct dyn_string;
+
+// Sampling profiler. While a profile is recorded every thread keeps a
+// shadow stack of the Lisp functions it is running, and a SIGPROF timer
+// samples it into folded stacks ("outer;inner count" lines) that
+// flamegraph tools read. The evaluator only tests `lprof_active` when it
+// is off.
+extern bool lprof_active;
+
+// Returns a copy of name that lives until the profile is written
+const char *lprof_intern(const char *name);
+// Pushes a function, NULL for one that was not called through a binding
+void lprof_enter(const char *name);
+void lprof_leave(void);
+
+// Starts recording, returning false if a profile is already running
+bool lprof_start(void);
+// Stops recording and appends the folded stacks to out
+void lprof_stop(struct dyn_string *out);
+
+lval *builtin_profile(lenv *e, lval *v);
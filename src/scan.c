@@ -0,0 +1,122 @@
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "scan.h"
+
+#define S LSCAN_SPACE
+#define Y LSCAN_SYMBOL
+#define N LSCAN_NUMERIC
+
+const unsigned char lscan_class[256] = {
+    [' '] = S, ['\t'] = S, ['\v'] = S, ['\r'] = S, ['\n'] = S,
+    ['A'] = Y, ['B'] = Y, ['C'] = Y, ['D'] = Y, ['E'] = Y, ['F'] = Y, ['G'] = Y, ['H'] = Y, ['I'] = Y, ['J'] = Y, ['K'] = Y, ['L'] = Y, ['M'] = Y,
+    ['N'] = Y, ['O'] = Y, ['P'] = Y, ['Q'] = Y, ['R'] = Y, ['S'] = Y, ['T'] = Y, ['U'] = Y, ['V'] = Y, ['W'] = Y, ['X'] = Y, ['Y'] = Y, ['Z'] = Y,
+    ['a'] = Y, ['b'] = Y, ['c'] = Y, ['d'] = Y, ['e'] = Y, ['f'] = Y, ['g'] = Y, ['h'] = Y, ['i'] = Y, ['j'] = Y, ['k'] = Y, ['l'] = Y, ['m'] = Y,
+    ['n'] = Y, ['o'] = Y, ['p'] = Y, ['q'] = Y, ['r'] = Y, ['s'] = Y, ['t'] = Y, ['u'] = Y, ['v'] = Y, ['w'] = Y, ['x'] = Y, ['y'] = Y, ['z'] = Y,
+    ['0'] = Y | N, ['1'] = Y | N, ['2'] = Y | N, ['3'] = Y | N, ['4'] = Y | N, ['5'] = Y | N, ['6'] = Y | N, ['7'] = Y | N, ['8'] = Y | N, ['9'] = Y | N,
+    ['_'] = Y, ['+'] = Y, ['*'] = Y, ['%'] = Y, ['^'] = Y, ['\\'] = Y, ['/'] = Y, ['='] = Y, ['<'] = Y, ['>'] = Y, ['!'] = Y, ['&'] = Y, ['|'] = Y,
+    ['-'] = Y | N, ['.'] = N,
+};
+
+#undef S
+#undef Y
+#undef N
+
+#ifdef __SSE2__
+// Bytes of x in the ASCII range [lo, hi]. Bytes past 0x7f compare as
+// negative and fall outside every range.
+static inline __m128i scan_range(__m128i x, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+}
+
+static inline __m128i scan_eq(__m128i x, char c) {
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
+}
+
+static inline __m128i scan_space_mask(__m128i x) {
+    __m128i m = _mm_or_si128(scan_eq(x, ' '), scan_eq(x, '\n'));
+    m = _mm_or_si128(m, scan_range(x, '\t', '\r'));
+    // '\f' sits between '\v' and '\r' but is not whitespace to the reader
+    return _mm_andnot_si128(scan_eq(x, '\f'), m);
+}
+
+static inline __m128i scan_symbol_mask(__m128i x) {
+    __m128i m = scan_range(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+    m = _mm_or_si128(m, scan_range(x, '0', '9'));
+    // The rest of "_+-*%^\\/=<>!&|"
+    m = _mm_or_si128(m, scan_range(x, '<', '>'));
+    m = _mm_or_si128(m, scan_eq(x, '!'));
+    m = _mm_or_si128(m, scan_eq(x, '%'));
+    m = _mm_or_si128(m, scan_eq(x, '&'));
+    m = _mm_or_si128(m, scan_eq(x, '*'));
+    m = _mm_or_si128(m, scan_eq(x, '+'));
+    m = _mm_or_si128(m, scan_eq(x, '-'));
+    m = _mm_or_si128(m, scan_eq(x, '/'));
+    m = _mm_or_si128(m, scan_eq(x, '\\'));
+    m = _mm_or_si128(m, scan_eq(x, '^'));
+    m = _mm_or_si128(m, scan_eq(x, '_'));
+    return _mm_or_si128(m, scan_eq(x, '|'));
+}
+
+static inline __m128i scan_string_mask(__m128i x) {
+    return _mm_or_si128(scan_eq(x, '"'), scan_eq(x, '\\'));
+}
+
+// Index of the first byte of the block at s + i that is in the mask, or -1
+static inline int scan_first(__m128i m) {
+    unsigned bits = (unsigned)_mm_movemask_epi8(m);
+    return bits != 0 ? __builtin_ctz(bits) : -1;
+}
+#endif
+
+int lscan_space(const char *s, int i, int len) {
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        int at = scan_first(_mm_xor_si128(scan_space_mask(x), _mm_set1_epi8(-1)));
+        if (at >= 0) {
+            return i + at;
+        }
+    }
+#endif
+    while (i < len && LSCAN_IS(s[i], LSCAN_SPACE)) {
+        i++;
+    }
+    return i;
+}
+
+int lscan_symbol(const char *s, int i, int len) {
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        int at = scan_first(_mm_xor_si128(scan_symbol_mask(x), _mm_set1_epi8(-1)));
+        if (at >= 0) {
+            return i + at;
+        }
+    }
+#endif
+    while (i < len && LSCAN_IS(s[i], LSCAN_SYMBOL)) {
+        i++;
+    }
+    return i;
+}
+
+int lscan_string(const char *s, int i, int len) {
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        int at = scan_first(scan_string_mask(x));
+        if (at >= 0) {
+            return i + at;
+        }
+    }
+#endif
+    while (i < len && s[i] != '"' && s[i] != '\\') {
+        i++;
+    }
+    return i;
+}
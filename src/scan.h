@@ -0,0 +1,22 @@
+#include <stddef.h>
+
+// Classes of the bytes the reader tells apart. A byte can be in several.
+enum LSCAN_CLASS {
+    LSCAN_SPACE = 1,
+    LSCAN_SYMBOL = 2,
+    // Bytes of a number, which starts with one of them
+    LSCAN_NUMERIC = 4,
+};
+
+extern const unsigned char lscan_class[256];
+
+#define LSCAN_IS(c, class) ((lscan_class[(unsigned char)(c)] & (class)) != 0)
+
+// Each returns the index of the first byte in s[i, len) past the run it
+// skips, or len. Whole blocks of 16 bytes are classified at once where
+// SSE2 is available.
+int lscan_space(const char *s, int i, int len);
+int lscan_symbol(const char *s, int i, int len);
+// Skips the plain bytes of a string literal, stopping at a quote or a
+// backslash
+int lscan_string(const char *s, int i, int len);
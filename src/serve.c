@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lval.h"
+#include "parser.h"
+#include "serve.h"
+#include "interp.h"
+
+// Requests larger than this close the connection
+#define LSERVE_MAX_REQUEST (64 << 20)
+// How often the main thread checks for requests past their timeout
+#define LSERVE_TICK_MS 10
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    clisp *c;
+
+    // Everything the interpreter writes during a request
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+
+    // Guards the fields below, which the main thread reads to time out
+    // requests and to shut down
+    pthread_mutex_t lock;
+    int conn;
+    // When the running request started in milliseconds, 0 when idle
+    long started;
+    bool timed_out;
+
+    long requests;
+    long errors;
+    long timeouts;
+} lserve_worker;
+
+static const lserve_config *serve_config;
+static int serve_fd = -1;
+static int serve_stopping = 0;
+
+static long serve_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void serve_write(void *ud, const char *buf, size_t len) {
+    lserve_worker *w = ud;
+    if (w->out_len + len > w->out_cap) {
+        w->out_cap = (w->out_len + len) * 2;
+        w->out = realloc(w->out, w->out_cap);
+    }
+    memcpy(w->out + w->out_len, buf, len);
+    w->out_len += len;
+}
+
+// Creates the worker's interpreter with everything preloaded and its root
+// environment frozen, showing what loading printed if asked to
+static void serve_worker_init(lserve_worker *w, bool show) {
+    size_t keep = w->out_len;
+    clisp_config config = {
+        .write = serve_write,
+        .write_ud = w,
+        .stdlib = serve_config->stdlib,
+        .max_depth = serve_config->max_depth,
+    };
+    w->c = clisp_new(&config);
+    for (int i = 0; i < serve_config->file_count; i++) {
+        clisp_load_file(w->c, serve_config->files[i]);
+    }
+    w->c->env->frozen = true;
+
+    if (show && w->out_len > keep) {
+        fwrite(w->out + keep, 1, w->out_len - keep, stdout);
+        fflush(stdout);
+    }
+    w->out_len = keep;
+}
+
+static bool serve_read(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool serve_send(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Evaluates src in a fresh child of the root environment, stopping at the
+// first error
+static enum LSERVE_STATUS serve_eval(lserve_worker *w, const char *src) {
+    clisp *c = w->c;
+    clisp *prev = clisp_enter(c);
+    lenv *env = lenv_new();
+    env->parent = c->env;
+
+    lval *expr = lval_sexpr();
+    parse_expr(expr, src, 0, '\0');
+    lval *res = lval_sexpr();
+    while (expr->sexpr.count > 0 && res->type != LVAL_ERROR && !c->exited) {
+        lval_del(res);
+        res = lval_eval(env, lval_expr_pop(&expr->sexpr, 0));
+    }
+
+    enum LSERVE_STATUS status = res->type == LVAL_ERROR ? LSERVE_ERROR : LSERVE_OK;
+    if (!c->exited) {
+        lval_println(res);
+    }
+    lval_del(res);
+    lval_del(expr);
+    lenv_del(env);
+
+    clisp_flush(c);
+    clisp_leave(prev);
+    lval_eval_trim();
+    return status;
+}
+
+static void serve_connection(lserve_worker *w, int conn) {
+    unsigned char header[5];
+    while (serve_read(conn, header, 4)) {
+        uint32_t len = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 |
+                       (uint32_t)header[2] << 8 | header[3];
+        if (len > LSERVE_MAX_REQUEST) {
+            return;
+        }
+        char *src = malloc(len + 1);
+        if (!serve_read(conn, src, len)) {
+            free(src);
+            return;
+        }
+        src[len] = '\0';
+
+        pthread_mutex_lock(&w->lock);
+        w->started = serve_now_ms();
+        pthread_mutex_unlock(&w->lock);
+
+        enum LSERVE_STATUS status = serve_eval(w, src);
+        free(src);
+
+        pthread_mutex_lock(&w->lock);
+        w->started = 0;
+        if (w->timed_out) {
+            status = LSERVE_TIMEOUT;
+            w->timed_out = false;
+        }
+        w->requests++;
+        w->errors += status == LSERVE_ERROR;
+        w->timeouts += status == LSERVE_TIMEOUT;
+        pthread_mutex_unlock(&w->lock);
+        clisp_clear_interrupt(w->c);
+
+        // A request that called `exit` leaves a fresh interpreter behind
+        if (w->c->exited) {
+            clisp_free(w->c);
+            serve_worker_init(w, false);
+        }
+
+        uint32_t n = (uint32_t)w->out_len;
+        header[0] = (unsigned char)status;
+        header[1] = n >> 24;
+        header[2] = n >> 16;
+        header[3] = n >> 8;
+        header[4] = n;
+        bool sent = serve_send(conn, header, 5) && serve_send(conn, w->out, w->out_len);
+        w->out_len = 0;
+        if (!sent) {
+            return;
+        }
+    }
+}
+
+static void *serve_worker(void *arg) {
+    lserve_worker *w = arg;
+
+    while (!__atomic_load_n(&serve_stopping, __ATOMIC_RELAXED)) {
+        int conn = accept(serve_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->conn = conn;
+        pthread_mutex_unlock(&w->lock);
+        if (!__atomic_load_n(&serve_stopping, __ATOMIC_RELAXED)) {
+            serve_connection(w, conn);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->conn = -1;
+        pthread_mutex_unlock(&w->lock);
+        close(conn);
+    }
+    return NULL;
+}
+
+static int serve_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int lserve_run(const lserve_config *config) {
+    serve_config = config;
+    serve_fd = serve_listen(config->path);
+    if (serve_fd < 0) {
+        return 1;
+    }
+
+    // Signals are taken by the main thread with sigtimedwait, which also
+    // paces the timeout checks
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int count = config->workers;
+    if (count <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        count = n > 0 ? (int)n : 1;
+    }
+
+    lserve_worker *workers = calloc(count, sizeof(lserve_worker));
+    for (int i = 0; i < count; i++) {
+        lserve_worker *w = &workers[i];
+        w->id = i;
+        w->conn = -1;
+        pthread_mutex_init(&w->lock, NULL);
+        serve_worker_init(w, i == 0);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_create(&workers[i].thread, NULL, serve_worker, &workers[i]);
+    }
+    fprintf(stderr, "Serving on %s with %d workers\n", config->path, count);
+
+    struct timespec tick = { 0, LSERVE_TICK_MS * 1000000L };
+    while (true) {
+        int sig = sigtimedwait(&signals, NULL, &tick);
+        if (sig == SIGINT || sig == SIGTERM) {
+            break;
+        }
+        if (config->timeout_ms <= 0) {
+            continue;
+        }
+
+        long now = serve_now_ms();
+        for (int i = 0; i < count; i++) {
+            lserve_worker *w = &workers[i];
+            pthread_mutex_lock(&w->lock);
+            if (w->started != 0 && !w->timed_out && now - w->started >= config->timeout_ms) {
+                w->timed_out = true;
+                clisp_interrupt(w->c);
+            }
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+
+    // Wake up workers waiting in accept or for a request, and stop the
+    // requests still running, which are still answered
+    __atomic_store_n(&serve_stopping, 1, __ATOMIC_RELAXED);
+    shutdown(serve_fd, SHUT_RDWR);
+    for (int i = 0; i < count; i++) {
+        lserve_worker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        if (w->conn >= 0) {
+            shutdown(w->conn, SHUT_RD);
+        }
+        if (w->started != 0) {
+            clisp_interrupt(w->c);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    for (int i = 0; i < count; i++) {
+        lserve_worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        fprintf(stderr, "worker %d: %ld requests, %ld errors, %ld timeouts\n",
+                w->id, w->requests, w->errors, w->timeouts);
+        clisp_free(w->c);
+        free(w->out);
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(workers);
+
+    close(serve_fd);
+    unlink(config->path);
+    return 0;
+}
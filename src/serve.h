@@ -0,0 +1,37 @@
+// Serves evaluation requests on a Unix domain socket from a pool of worker
+// interpreters that have loaded the standard library and the application
+// files once, up front.
+//
+// A connection carries any number of requests, each a 4-byte big-endian
+// length followed by that much source. Every request is answered with a
+// status byte (LSERVE_OK, LSERVE_ERROR or LSERVE_TIMEOUT), a 4-byte
+// big-endian length and the text: whatever the request printed, followed by
+// the value of its last expression or the error that stopped it.
+//
+// Requests run in a fresh environment whose parent is the worker's root
+// environment, which is frozen, so definitions made by one request are not
+// seen by the next. A worker serves one connection at a time.
+enum LSERVE_STATUS {
+    LSERVE_OK,
+    LSERVE_ERROR,
+    LSERVE_TIMEOUT,
+};
+
+typedef struct {
+    // Path of the socket, which is replaced if it exists
+    const char *path;
+    // Number of worker interpreters, 0 selects one per online processor
+    int workers;
+    // Requests running longer than this are interrupted, 0 for no limit
+    long timeout_ms;
+    // Standard library and files every worker loads
+    const char *stdlib;
+    const char **files;
+    int file_count;
+    // Maximum evaluation depth of the workers, 0 selects the default
+    int max_depth;
+} lserve_config;
+
+// Serves until SIGINT or SIGTERM, then writes each worker's counters to
+// stderr. Returns the process exit status.
+int lserve_run(const lserve_config *config);
@@ -0,0 +1,145 @@
+#include <string.h>
+
+#include "lval.h"
+#include "builtins.h"
+#include "dyn_string.h"
+#include "utils.h"
+#include "interp.h"
+
+__thread lstats lstats_local;
+
+// lstats only holds longs, which are added up one by one
+#define LSTATS_FIELDS (sizeof(lstats) / sizeof(long))
+
+void lstats_flush(clisp *c) {
+    long *src = (long *)&lstats_local;
+    long *dst = (long *)&c->stats;
+    for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+        if (src[i] != 0) {
+            __atomic_fetch_add(&dst[i], src[i], __ATOMIC_RELAXED);
+        }
+    }
+    memset(&lstats_local, 0, sizeof(lstats));
+}
+
+static void lstats_read(clisp *c, lstats *out) {
+    lstats_flush(c);
+    long *src = (long *)&c->stats;
+    long *dst = (long *)out;
+    for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+typedef struct {
+    char *name;
+    long value;
+} lstats_entry;
+
+#define LSTATS_ENTRIES 13
+
+static void lstats_entries(const lstats *s, lstats_entry *out) {
+    lstats_entry entries[LSTATS_ENTRIES] = {
+        { "lvals", s->lvals },
+        { "lvals-live", s->lvals - s->lvals_freed },
+        { "envs", s->envs },
+        { "envs-live", s->envs - s->envs_freed },
+        { "allocs", s->allocs },
+        { "bytes", s->bytes },
+        { "copies", s->copies },
+        { "env-copies", s->env_copies },
+        { "puts", s->puts },
+        { "lookups", s->lookups },
+        { "lookup-depth", s->lookup_depth },
+        { "evals", s->evals },
+        { "calls", s->calls },
+    };
+    memcpy(out, entries, sizeof(entries));
+}
+
+void lstats_write(dyn_string *out, clisp *c) {
+    lstats s;
+    lstats_read(c, &s);
+    lstats_entry entries[LSTATS_ENTRIES];
+    lstats_entries(&s, entries);
+
+    for (int i = 0; i < LSTATS_ENTRIES; i++) {
+        dyn_string_appendf(out, "%-14s %ld\n", entries[i].name, entries[i].value);
+    }
+}
+
+// (stats {}) returns {{name count} ...} for everything counted since the
+// interpreter started or was last reset. (stats {expr}) evaluates expr and
+// returns only what it cost instead, except for the live counts, which are
+// those left once it has run.
+lval *builtin_stats(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("stats", v, 1);
+    LASSERT_ARG_TYPE("stats", v, 0, LVAL_QEXPR);
+    clisp *c = clisp_current();
+    LASSERT(v, c != NULL, "Function 'stats' needs a running interpreter");
+
+    lval *expr = lval_take(v, 0);
+    lstats before, after;
+    memset(&before, 0, sizeof(lstats));
+
+    if (expr->qexpr.count > 0) {
+        expr->type = LVAL_SEXPR;
+        expr->sexpr = expr->qexpr;
+        lstats_read(c, &before);
+        lval *res = lval_eval(e, expr);
+        lstats_read(c, &after);
+        if (res->type == LVAL_ERROR) {
+            return res;
+        }
+        lval_del(res);
+    } else {
+        lval_del(expr);
+        lstats_read(c, &after);
+    }
+
+    // Taking the freed counts as they are keeps the live ones absolute
+    long *a = (long *)&after;
+    long *b = (long *)&before;
+    before.lvals_freed = before.lvals;
+    before.envs_freed = before.envs;
+    for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+        a[i] -= b[i];
+    }
+
+    lstats_entry entries[LSTATS_ENTRIES];
+    lstats_entries(&after, entries);
+
+    lval *res = lval_qexpr();
+    for (int i = 0; i < LSTATS_ENTRIES; i++) {
+        lval *entry = lval_qexpr();
+        lval_expr_push_back(&entry->qexpr, lval_symbol(entries[i].name));
+        lval_expr_push_back(&entry->qexpr, lval_int(entries[i].value));
+        lval_expr_push_back(&res->qexpr, entry);
+    }
+    return res;
+}
+
+lval *builtin_stats_reset(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("stats-reset", v, 1);
+    LASSERT_ARG_TYPE("stats-reset", v, 0, LVAL_QEXPR);
+    clisp *c = clisp_current();
+    LASSERT(v, c != NULL, "Function 'stats-reset' needs a running interpreter");
+
+    lstats_flush(c);
+    lstats *s = &c->stats;
+    long lvals = __atomic_load_n(&s->lvals, __ATOMIC_RELAXED);
+    long envs = __atomic_load_n(&s->envs, __ATOMIC_RELAXED);
+    long *f = (long *)s;
+    for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+        if (&f[i] != &s->lvals_freed && &f[i] != &s->envs_freed) {
+            __atomic_store_n(&f[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    // The freed counts are rebased rather than cleared, so whatever is still
+    // alive stays counted as live
+    __atomic_fetch_sub(&s->lvals_freed, lvals, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&s->envs_freed, envs, __ATOMIC_RELAXED);
+
+    lval_del(v);
+    return lval_sexpr();
+}
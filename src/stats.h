@@ -0,0 +1,40 @@
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct clisp clisp;
+struct dyn_string;
+
+// Allocation and evaluation counters. Every thread counts into its own
+// copy, which is added to the interpreter's totals whenever the thread
+// leaves it, so counting is a plain increment.
+typedef struct {
+    long lvals;
+    long lvals_freed;
+    long envs;
+    long envs_freed;
+    // Blocks and bytes requested from the allocator; growing a block counts
+    // only the bytes it grew by
+    long allocs;
+    long bytes;
+    // lval_copy calls, nested values included
+    long copies;
+    long env_copies;
+    long puts;
+    // Symbol lookups, inline cache hits included, and the environments
+    // they searched
+    long lookups;
+    long lookup_depth;
+    // S-expressions applied, and the builtins and lambdas they called
+    long evals;
+    long calls;
+} lstats;
+
+extern __thread lstats lstats_local;
+
+#define LSTAT(field, n) (lstats_local.field += (n))
+
+// Adds this thread's counts to c and clears them
+void lstats_flush(clisp *c);
+void lstats_write(struct dyn_string *out, clisp *c);
+
+lval *builtin_stats(lenv *e, lval *v);
+lval *builtin_stats_reset(lenv *e, lval *v);
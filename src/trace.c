@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lval.h"
+#include "dyn_string.h"
+#include "utils.h"
+#include "interp.h"
+
+// Events buffered per interpreter before they are written out
+#define TRACE_BATCH 8192
+#define TRACE_NAME 64
+// Once the writer runs, a batch is also handed over when its first event
+// is this old
+#define TRACE_FLUSH_MS 100
+
+typedef struct {
+    // 'X' for a span, 'C' for counters
+    char ph;
+    const char *cat;
+    char name[TRACE_NAME];
+    int tid;
+    // Nanoseconds since the trace was opened
+    long ts;
+    long dur;
+    long lvals;
+    long envs;
+    long bytes;
+} ltrace_event;
+
+struct ltrace {
+    FILE *out;
+    int pid;
+    long origin;
+    long threshold;
+
+    // Held while an event is added, and while batches are handed over
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ltrace_event *batch;
+    long count;
+    // When the first event of the batch was recorded
+    long batch_start;
+    // Batch the writer is writing out, NULL once it is done
+    ltrace_event *full;
+    long full_count;
+    // Buffer the writer has finished with, to fill next
+    ltrace_event *spare;
+    // Started when the first batch fills
+    pthread_t writer;
+    bool writer_started;
+    bool closing;
+    // Only touched by the writer, or by ltrace_close once it has stopped
+    bool written;
+};
+
+int ltrace_active = 0;
+
+static int trace_tids = 0;
+static __thread int trace_tid = 0;
+
+long ltrace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void trace_write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') {
+            fputc('\\', f);
+            fputc(ch, f);
+        } else if (ch < 0x20) {
+            fprintf(f, "\\u%04x", ch);
+        } else {
+            fputc(ch, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void trace_write(ltrace *t, ltrace_event *ev) {
+    FILE *f = t->out;
+    fputs(t->written ? ",\n" : "\n", f);
+    t->written = true;
+
+    fputs("{\"name\":", f);
+    trace_write_string(f, ev->name);
+    fprintf(f, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+            ev->ph, ev->ts / 1000.0, t->pid, ev->tid);
+    if (ev->ph == 'X') {
+        fprintf(f, ",\"cat\":\"%s\",\"dur\":%.3f}", ev->cat, ev->dur / 1000.0);
+    } else {
+        fprintf(f, ",\"args\":{\"lvals\":%ld,\"envs\":%ld,\"bytes\":%ld}}",
+                ev->lvals, ev->envs, ev->bytes);
+    }
+}
+
+static void trace_write_batch(ltrace *t, ltrace_event *batch, long count) {
+    for (long i = 0; i < count; i++) {
+        trace_write(t, &batch[i]);
+    }
+    fflush(t->out);
+}
+
+static void *trace_writer(void *arg) {
+    ltrace *t = arg;
+    pthread_mutex_lock(&t->lock);
+    while (!t->closing || t->full != NULL) {
+        if (t->full == NULL) {
+            pthread_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+
+        ltrace_event *batch = t->full;
+        long count = t->full_count;
+        pthread_mutex_unlock(&t->lock);
+        trace_write_batch(t, batch, count);
+        pthread_mutex_lock(&t->lock);
+
+        t->spare = batch;
+        t->full = NULL;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+// Hands the batch to the writer and starts filling the spare one, with
+// t->lock held. Waits only if the writer is still on the previous batch.
+static void trace_hand_over(ltrace *t) {
+    while (t->full != NULL) {
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+
+    if (!t->writer_started) {
+        if (pthread_create(&t->writer, NULL, trace_writer, t) != 0) {
+            trace_write_batch(t, t->batch, t->count);
+            t->count = 0;
+            return;
+        }
+        t->writer_started = true;
+    }
+
+    t->full = t->batch;
+    t->full_count = t->count;
+    t->batch = t->spare;
+    t->spare = NULL;
+    t->count = 0;
+    pthread_cond_broadcast(&t->cond);
+}
+
+bool ltrace_open(clisp *c, const char *path, long threshold_us) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+    fputs("{\"traceEvents\":[", f);
+
+    ltrace *t = calloc(1, sizeof(ltrace));
+    t->out = f;
+    t->pid = (int)getpid();
+    t->origin = ltrace_now();
+    t->threshold = threshold_us * 1000;
+    t->batch = malloc(sizeof(ltrace_event) * TRACE_BATCH);
+    t->spare = malloc(sizeof(ltrace_event) * TRACE_BATCH);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+
+    c->trace = t;
+    __atomic_add_fetch(&ltrace_active, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void ltrace_close(clisp *c) {
+    ltrace *t = c->trace;
+    if (t == NULL) {
+        return;
+    }
+    __atomic_sub_fetch(&ltrace_active, 1, __ATOMIC_RELAXED);
+    c->trace = NULL;
+
+    if (t->writer_started) {
+        pthread_mutex_lock(&t->lock);
+        t->closing = true;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        pthread_join(t->writer, NULL);
+    }
+    trace_write_batch(t, t->batch, t->count);
+    fputs("\n]}\n", t->out);
+    fclose(t->out);
+
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t->batch);
+    free(t->spare);
+    free(t);
+}
+
+static ltrace *trace_current(void) {
+    clisp *c = clisp_current();
+    return c != NULL ? c->trace : NULL;
+}
+
+static void trace_push(ltrace *t, ltrace_event *ev) {
+    if (trace_tid == 0) {
+        trace_tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+    }
+    ev->tid = trace_tid;
+
+    // Spans are recorded when they end
+    long at = ev->ph == 'X' ? ev->ts + ev->dur : ev->ts;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->count == 0) {
+        t->batch_start = at;
+    }
+    t->batch[t->count++] = *ev;
+    // Until the first batch fills there is no writer to hand an old one to
+    if (t->count == TRACE_BATCH ||
+        (t->writer_started && at - t->batch_start >= TRACE_FLUSH_MS * 1000000L)) {
+        trace_hand_over(t);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void trace_span(ltrace *t, const char *cat, const char *name, long start, long end) {
+    ltrace_event ev;
+    ev.ph = 'X';
+    ev.cat = cat;
+    snprintf(ev.name, TRACE_NAME, "%s", name);
+    ev.ts = start - t->origin;
+    ev.dur = end - start;
+    trace_push(t, &ev);
+}
+
+void ltrace_span(const char *cat, const char *name, long start) {
+    ltrace *t = trace_current();
+    if (t != NULL) {
+        trace_span(t, cat, name, start, ltrace_now());
+    }
+}
+
+void ltrace_call(const char *name, long start) {
+    ltrace *t = trace_current();
+    if (t == NULL) {
+        return;
+    }
+
+    long end = ltrace_now();
+    if (end - start >= t->threshold) {
+        trace_span(t, "call", name != NULL ? name : "(anonymous)", start, end);
+    }
+}
+
+void ltrace_counters(void) {
+    clisp *c = clisp_current();
+    if (c == NULL || c->trace == NULL) {
+        return;
+    }
+
+    lstats_flush(c);
+    ltrace_event ev;
+    ev.ph = 'C';
+    snprintf(ev.name, TRACE_NAME, "heap");
+    ev.ts = ltrace_now() - c->trace->origin;
+    ev.lvals = __atomic_load_n(&c->stats.lvals, __ATOMIC_RELAXED) -
+               __atomic_load_n(&c->stats.lvals_freed, __ATOMIC_RELAXED);
+    ev.envs = __atomic_load_n(&c->stats.envs, __ATOMIC_RELAXED) -
+              __atomic_load_n(&c->stats.envs_freed, __ATOMIC_RELAXED);
+    ev.bytes = __atomic_load_n(&c->stats.bytes, __ATOMIC_RELAXED);
+    trace_push(c->trace, &ev);
+}
+
+// Appends v to out as lval_write does, but stops once out holds limit bytes
+static void trace_label_write(dyn_string *out, lval *v, size_t limit) {
+    if (out->len >= limit) {
+        return;
+    }
+
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: {
+            lval_expr *expr = v->type == LVAL_SEXPR ? &v->sexpr : &v->qexpr;
+            dyn_string_push(out, v->type == LVAL_SEXPR ? '(' : '{');
+            for (int i = 0; i < expr->count && out->len < limit; i++) {
+                if (i > 0) {
+                    dyn_string_push(out, ' ');
+                }
+                trace_label_write(out, expr->cell[i], limit);
+            }
+            dyn_string_push(out, v->type == LVAL_SEXPR ? ')' : '}');
+            break;
+        }
+        case LVAL_LAMBDA:
+            dyn_string_append(out, "(\\");
+            trace_label_write(out, v->lambda.formals, limit);
+            dyn_string_push(out, ' ');
+            trace_label_write(out, v->lambda.body, limit);
+            dyn_string_push(out, ')');
+            break;
+        case LVAL_STRING: {
+            size_t n = v->string.len;
+            if (n > limit - out->len) {
+                n = limit - out->len;
+            }
+            dyn_string_push(out, '"');
+            dyn_string_append_n(out, LSTR(v->string), n);
+            dyn_string_push(out, '"');
+            break;
+        }
+        default:
+            lval_write(out, v);
+            break;
+    }
+}
+
+void ltrace_label(lval *v, char *buf, size_t size) {
+    dyn_string *out = dyn_string_new();
+    trace_label_write(out, v, size);
+    snprintf(buf, size, "%s", out->buf);
+    dyn_string_del(out);
+}
@@ -0,0 +1,41 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct lval lval;
+typedef struct clisp clisp;
+typedef struct ltrace ltrace;
+
+// Timeline of an interpreter in the Chrome trace event format, which
+// chrome://tracing and Perfetto open. Events are copied into a buffer owned
+// by the interpreter, and full buffers are swapped with a spare one and
+// written out by a writer thread. The writer is only started once the first
+// buffer fills, as a second thread alone puts malloc on its slower locked
+// path for the whole process; shorter traces are written on close.
+//
+// Recorded are `load` of each file, each top-level form a file evaluates,
+// heap counters after each of those forms, and calls of builtins and
+// lambdas that take at least the configured threshold.
+
+// Number of interpreters tracing, checked by the evaluator before it looks
+// at the current interpreter's trace
+extern int ltrace_active;
+
+// Starts writing c's timeline to path. Returns false if it cannot be
+// created.
+bool ltrace_open(clisp *c, const char *path, long threshold_us);
+// Writes the remaining events and closes the file
+void ltrace_close(clisp *c);
+
+// Timestamp in nanoseconds to pass as `start` below
+long ltrace_now(void);
+
+// Records a span from start until now in the current interpreter
+void ltrace_span(const char *cat, const char *name, long start);
+// Records a call from start until now if it took long enough. The name is
+// NULL for functions that were not called through a binding.
+void ltrace_call(const char *name, long start);
+// Records the current interpreter's live objects and allocated bytes
+void ltrace_counters(void);
+
+// Writes v into buf for naming a span, stopping once size bytes are written
+void ltrace_label(lval *v, char *buf, size_t size);
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "lazy.h"
+#include "transduce.h"
+#include "builtins.h"
+#include "utils.h"
+#include "interp.h"
+
+static lxform *lxform_new(int count) {
+    lxform *x = lmalloc(sizeof(lxform));
+    x->refs = 1;
+    x->count = count;
+    x->stages = lcalloc(count, sizeof(xstage));
+    return x;
+}
+
+lxform *lxform_retain(lxform *x) {
+    REF_RETAIN(x);
+    return x;
+}
+
+void lxform_release(lxform *x) {
+    if (REF_RELEASE(x) > 0) {
+        return;
+    }
+
+    for (int i = 0; i < x->count; i++) {
+        if (x->stages[i].f != NULL) {
+            lval_del(x->stages[i].f);
+        }
+    }
+    lfree(x->stages);
+    lfree(x);
+}
+
+static lval *lval_xform(enum XSTAGE_KIND kind, lval *f, long n) {
+    lxform *x = lxform_new(1);
+    x->stages[0].kind = kind;
+    x->stages[0].f = f;
+    x->stages[0].n = n;
+
+    lval *v = lval_alloc();
+    v->type = LVAL_XFORM;
+    v->xform = x;
+    return v;
+}
+
+lval *lval_xcat(void) {
+    return lval_xform(XSTAGE_CAT, NULL, 0);
+}
+
+typedef struct {
+    lenv *e;
+    lxform *xf;
+    long *taken;
+    lval *rf;
+    lval *acc;
+    // The last take stage that has let through all it will, -1 if none.
+    // A cat stage only stops its inner sequence for a take after it.
+    int reduced;
+} xrun;
+
+static lval *xrun_apply(xrun *r, lval *f, lval *x, lval *y) {
+    lval *args = lval_sexpr();
+    lval_expr_push_back(&args->sexpr, x);
+    if (y != NULL) {
+        lval_expr_push_back(&args->sexpr, y);
+    }
+    return lval_apply(r->e, f, args);
+}
+
+// Pushes x through the stages starting at `i` and folds whatever comes out
+// into the accumulator. Consumes x; returns an error or NULL.
+static lval *xrun_step(xrun *r, int i, lval *x) {
+    for (; i < r->xf->count; i++) {
+        xstage *s = &r->xf->stages[i];
+
+        switch (s->kind) {
+            case XSTAGE_MAP:
+                x = xrun_apply(r, s->f, x, NULL);
+                if (x->type == LVAL_ERROR) {
+                    return x;
+                }
+                break;
+            case XSTAGE_FILTER: {
+                lval *keep = xrun_apply(r, s->f, lval_copy(x), NULL);
+                if (keep->type != LVAL_BOOL) {
+                    lval *err = keep->type == LVAL_ERROR ? keep :
+                        lval_error("Function 'xfilter' predicate must return a bool, got %s",
+                                   lval_type_name(keep->type));
+                    if (err != keep) { lval_del(keep); }
+                    lval_del(x);
+                    return err;
+                }
+
+                bool pass = keep->_bool;
+                lval_del(keep);
+                if (!pass) {
+                    lval_del(x);
+                    return NULL;
+                }
+                break;
+            }
+            case XSTAGE_TAKE:
+                if (r->taken[i] >= s->n) {
+                    r->reduced = r->reduced > i ? r->reduced : i;
+                    lval_del(x);
+                    return NULL;
+                }
+                if (++r->taken[i] >= s->n) {
+                    r->reduced = r->reduced > i ? r->reduced : i;
+                }
+                break;
+            case XSTAGE_CAT: {
+                if (!lval_is_seq(x)) {
+                    lval *err = lval_error("Stage 'xcat' expects sequences, got %s",
+                                           lval_type_name(x->type));
+                    lval_del(x);
+                    return err;
+                }
+
+                lseq *seq = lseq_from(x);
+                lseq_iter *it = lseq_iter_new(seq);
+                lval *y, *err = NULL;
+                while (err == NULL && (y = lseq_iter_next(r->e, it)) != NULL) {
+                    err = y->type == LVAL_ERROR ? y : xrun_step(r, i + 1, y);
+                    if (r->reduced > i) {
+                        break;
+                    }
+                }
+                lseq_iter_del(it);
+                lseq_release(seq);
+                return err;
+            }
+        }
+    }
+
+    r->acc = xrun_apply(r, r->rf, r->acc, x);
+    if (r->acc->type == LVAL_ERROR) {
+        lval *err = r->acc;
+        r->acc = NULL;
+        return err;
+    }
+    return NULL;
+}
+
+lval *builtin_xmap(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("xmap", v, 1);
+    LASSERT(v, lval_is_func(v->sexpr.cell[0]),
+            "Function 'xmap' expects a function, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    return lval_xform(XSTAGE_MAP, lval_take(v, 0), 0);
+}
+
+lval *builtin_xfilter(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("xfilter", v, 1);
+    LASSERT(v, lval_is_func(v->sexpr.cell[0]),
+            "Function 'xfilter' expects a function, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    return lval_xform(XSTAGE_FILTER, lval_take(v, 0), 0);
+}
+
+lval *builtin_xtake(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("xtake", v, 1);
+    LASSERT_ARG_TYPE("xtake", v, 0, LVAL_INT);
+
+    long n = v->sexpr.cell[0]->_int;
+    lval_del(v);
+    return lval_xform(XSTAGE_TAKE, NULL, n);
+}
+
+lval *builtin_xcomp(UNUSED lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count > 0, "Function 'xcomp' expects at least one transducer");
+    LASSERT_ARG_TYPES(v, LVAL_XFORM);
+
+    int count = 0;
+    for (int i = 0; i < v->sexpr.count; i++) {
+        count += v->sexpr.cell[i]->xform->count;
+    }
+
+    lxform *x = lxform_new(count);
+    int n = 0;
+    for (int i = 0; i < v->sexpr.count; i++) {
+        lxform *part = v->sexpr.cell[i]->xform;
+        for (int j = 0; j < part->count; j++) {
+            x->stages[n] = part->stages[j];
+            if (x->stages[n].f != NULL) {
+                x->stages[n].f = lval_copy(x->stages[n].f);
+            }
+            n++;
+        }
+    }
+    lval_del(v);
+
+    lval *res = lval_alloc();
+    res->type = LVAL_XFORM;
+    res->xform = x;
+    return res;
+}
+
+lval *builtin_transduce(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("transduce", v, 4);
+    LASSERT_ARG_TYPE("transduce", v, 0, LVAL_XFORM);
+    LASSERT(v, lval_is_func(v->sexpr.cell[1]),
+            "Function 'transduce' expects a reducing function as second argument, got %s",
+            lval_type_name(v->sexpr.cell[1]->type));
+    LASSERT(v, lval_is_seq(v->sexpr.cell[3]),
+            "Function 'transduce' expects a sequence as fourth argument, got %s",
+            lval_type_name(v->sexpr.cell[3]->type));
+
+    xrun r;
+    r.e = e;
+    r.xf = lxform_retain(v->sexpr.cell[0]->xform);
+    r.taken = lcalloc(r.xf->count, sizeof(long));
+    r.rf = lval_copy(v->sexpr.cell[1]);
+    r.acc = lval_copy(v->sexpr.cell[2]);
+    r.reduced = -1;
+
+    for (int i = 0; i < r.xf->count; i++) {
+        if (r.xf->stages[i].kind == XSTAGE_TAKE && r.xf->stages[i].n <= 0) {
+            r.reduced = i;
+        }
+    }
+
+    lseq *seq = lseq_from(lval_take(v, 3));
+    lseq_iter *it = lseq_iter_new(seq);
+
+    lval *x, *err = NULL;
+    while (r.reduced < 0 && (x = lseq_iter_next(e, it)) != NULL) {
+        err = x->type == LVAL_ERROR ? x : xrun_step(&r, 0, x);
+        if (err != NULL) {
+            break;
+        }
+    }
+
+    lseq_iter_del(it);
+    lseq_release(seq);
+    lxform_release(r.xf);
+    lval_del(r.rf);
+    lfree(r.taken);
+
+    if (err != NULL) {
+        if (r.acc != NULL) { lval_del(r.acc); }
+        return err;
+    }
+    return r.acc;
+}
@@ -0,0 +1,35 @@
+typedef struct lenv lenv;
+typedef struct lval lval;
+
+enum XSTAGE_KIND {
+    XSTAGE_MAP,
+    XSTAGE_FILTER,
+    XSTAGE_TAKE,
+    XSTAGE_CAT,
+};
+
+typedef struct {
+    enum XSTAGE_KIND kind;
+    lval *f;
+    long n;
+} xstage;
+
+// A transducer is a fused chain of stages that `transduce` pushes each
+// element through before handing it to the reducing function.
+typedef struct lxform lxform;
+struct lxform {
+    int refs;
+    int count;
+    xstage *stages;
+};
+
+lxform *lxform_retain(lxform *x);
+void lxform_release(lxform *x);
+
+lval *lval_xcat(void);
+
+lval *builtin_xmap(lenv *e, lval *v);
+lval *builtin_xfilter(lenv *e, lval *v);
+lval *builtin_xtake(lenv *e, lval *v);
+lval *builtin_xcomp(lenv *e, lval *v);
+lval *builtin_transduce(lenv *e, lval *v);
@@ -1,5 +1,10 @@
 #define UNUSED __attribute__((unused))
 
-typedef struct lenv lenv;
-
-void load_file(lenv *e, char *filename);
+// Reference counts of shared structures are updated from pool threads.
+// Structures in the heap a zygote shares with its children are never
+// written, so their counts are left alone and they are never freed.
+extern char *lshared_lo;
+extern char *lshared_hi;
+#define REF_SHARED(x) ((char *)(x) < lshared_hi && (char *)(x) >= lshared_lo)
+#define REF_RETAIN(x) (REF_SHARED(x) ? 2 : __atomic_add_fetch(&(x)->refs, 1, __ATOMIC_RELAXED))
+#define REF_RELEASE(x) (REF_SHARED(x) ? 1 : __atomic_sub_fetch(&(x)->refs, 1, __ATOMIC_ACQ_REL))
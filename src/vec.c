@@ -0,0 +1,340 @@
+#include <stdlib.h>
+
+#include "lval.h"
+#include "vec.h"
+#include "lazy.h"
+#include "map.h"
+#include "transduce.h"
+#include "builtins.h"
+#include "dyn_string.h"
+#include "pool.h"
+#include "utils.h"
+#include "interp.h"
+
+#define LVEC_MIN_CAP 8
+
+// Only pool workers can reach a vector concurrently
+void lvec_lock(lvec *v) {
+    if (lpool_in_worker()) {
+        pthread_mutex_lock(&v->lock);
+    }
+}
+
+void lvec_unlock(lvec *v) {
+    if (lpool_in_worker()) {
+        pthread_mutex_unlock(&v->lock);
+    }
+}
+
+static lvec *lvec_new(void) {
+    lvec *v = lmalloc(sizeof(lvec));
+    v->refs = 1;
+    v->count = 0;
+    v->cap = 0;
+    v->items = NULL;
+    pthread_mutex_init(&v->lock, NULL);
+    return v;
+}
+
+lvec *lvec_retain(lvec *v) {
+    REF_RETAIN(v);
+    return v;
+}
+
+void lvec_release(lvec *v) {
+    if (REF_RELEASE(v) > 0) {
+        return;
+    }
+
+    for (long i = 0; i < v->count; i++) {
+        lval_del(v->items[i]);
+    }
+    lfree(v->items);
+    pthread_mutex_destroy(&v->lock);
+    lfree(v);
+}
+
+// Appends x, consuming it. The caller holds the lock.
+static void lvec_push(lvec *v, lval *x) {
+    if (v->count == v->cap) {
+        v->cap = v->cap == 0 ? LVEC_MIN_CAP : v->cap * 2;
+        v->items = lrealloc(v->items, sizeof(lval*) * v->cap);
+    }
+    v->items[v->count++] = x;
+}
+
+bool lvec_eq(lvec *a, lvec *b) {
+    if (a == b) {
+        return true;
+    }
+
+    // Lock in address order so that concurrent comparisons cannot deadlock
+    lvec *first = a < b ? a : b;
+    lvec *second = a < b ? b : a;
+    lvec_lock(first);
+    lvec_lock(second);
+
+    bool eq = a->count == b->count;
+    for (long i = 0; eq && i < a->count; i++) {
+        eq = lval_eq(a->items[i], b->items[i]);
+    }
+
+    lvec_unlock(second);
+    lvec_unlock(first);
+    return eq;
+}
+
+void lvec_write(struct dyn_string *out, lvec *v) {
+    lvec_lock(v);
+    dyn_string_append(out, "#[");
+    for (long i = 0; i < v->count; i++) {
+        if (i > 0) {
+            dyn_string_push(out, ' ');
+        }
+        lval_write(out, v->items[i]);
+    }
+    dyn_string_push(out, ']');
+    lvec_unlock(v);
+}
+
+lval *builtin_vec(lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("vec", v, 1);
+    LASSERT(v, lval_is_seq(v->sexpr.cell[0]),
+            "Function 'vec' expects a sequence, got %s",
+            lval_type_name(v->sexpr.cell[0]->type));
+
+    lseq *s = lseq_from(lval_take(v, 0));
+    lseq_iter *it = lseq_iter_new(s);
+    lvec *vec = lvec_new();
+
+    lval *x;
+    lval *err = NULL;
+    while ((x = lseq_iter_next(e, it)) != NULL) {
+        if (x->type == LVAL_ERROR) {
+            err = x;
+            break;
+        }
+        lvec_push(vec, x);
+    }
+
+    lseq_iter_del(it);
+    lseq_release(s);
+    if (err != NULL) {
+        lvec_release(vec);
+        return err;
+    }
+    return lval_vec(vec);
+}
+
+static bool lvec_reaches(lval *x, lvec *target);
+
+static bool lvec_reaches_leaf(lmap_leaf *l, void *ctx) {
+    return !lvec_reaches(l->key, ctx) && !lvec_reaches(l->val, ctx);
+}
+
+// Only the values a function has bound itself, not its callers' scopes
+static bool lvec_reaches_env(lenv *e, lvec *target) {
+    for (int i = 0; e != NULL && i < e->count; i++) {
+        if (lvec_reaches(e->entries[i]->val, target)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool lvec_reaches_seq(lseq *s, lvec *target) {
+    for (; s != NULL; s = s->inner) {
+        if ((s->f != NULL && lvec_reaches(s->f, target)) ||
+            (s->src != NULL && lvec_reaches(s->src, target))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether target can be reached from x. Vectors are the only values shared
+// by reference, so storing a vector that reaches the one it is stored in
+// would make a cycle, which printing, comparing and freeing never leave.
+static bool lvec_reaches(lval *x, lvec *target) {
+    switch (x->type) {
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        for (int i = 0; i < x->sexpr.count; i++) {
+            if (lvec_reaches(x->sexpr.cell[i], target)) {
+                return true;
+            }
+        }
+        return false;
+    case LVAL_VEC: {
+        if (x->vec == target) {
+            return true;
+        }
+        lvec_lock(x->vec);
+        bool found = false;
+        for (long i = 0; !found && i < x->vec->count; i++) {
+            found = lvec_reaches(x->vec->items[i], target);
+        }
+        lvec_unlock(x->vec);
+        return found;
+    }
+    case LVAL_MAP:
+        return !lmap_each(x->map, lvec_reaches_leaf, target);
+    case LVAL_LAMBDA:
+        return lvec_reaches_env(x->lambda.env, target) ||
+               lvec_reaches(x->lambda.formals, target) ||
+               lvec_reaches(x->lambda.body, target);
+    case LVAL_LAZY:
+        return lvec_reaches_seq(x->lazy, target);
+    case LVAL_XFORM:
+        for (int i = 0; i < x->xform->count; i++) {
+            lval *f = x->xform->stages[i].f;
+            if (f != NULL && lvec_reaches(f, target)) {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+// Checks the vector and index arguments shared by vec-get and vec-set!
+static lval *lvec_check_args(char *func, lval *v) {
+    if (v->sexpr.cell[0]->type != LVAL_VEC || v->sexpr.cell[1]->type != LVAL_INT) {
+        return lval_error("Function '%s' expects a vector and an int index, got %s and %s",
+                          func, lval_type_name(v->sexpr.cell[0]->type),
+                          lval_type_name(v->sexpr.cell[1]->type));
+    }
+    return NULL;
+}
+
+static lval *lvec_index_error(char *func, long i, long count) {
+    return lval_error("Function '%s' index %ld out of bounds for vector of length %ld",
+                      func, i, count);
+}
+
+lval *builtin_vec_get(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("vec-get", v, 2);
+    lval *err = lvec_check_args("vec-get", v);
+    if (err != NULL) {
+        lval_del(v);
+        return err;
+    }
+
+    lvec *vec = v->sexpr.cell[0]->vec;
+    long i = v->sexpr.cell[1]->_int;
+
+    lvec_lock(vec);
+    lval *res = i >= 0 && i < vec->count
+        ? lval_copy(vec->items[i])
+        : lvec_index_error("vec-get", i, vec->count);
+    lvec_unlock(vec);
+
+    lval_del(v);
+    return res;
+}
+
+lval *builtin_vec_set(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("vec-set!", v, 3);
+    lval *err = lvec_check_args("vec-set!", v);
+    if (err != NULL) {
+        lval_del(v);
+        return err;
+    }
+
+    LASSERT(v, !lvec_reaches(v->sexpr.cell[2], v->sexpr.cell[0]->vec),
+            "Function 'vec-set!' cannot store a vector inside itself");
+
+    long i = v->sexpr.cell[1]->_int;
+    lval *x = lval_expr_pop(&v->sexpr, 2);
+    lval *res = lval_take(v, 0);
+    lvec *vec = res->vec;
+
+    lvec_lock(vec);
+    lval *old = NULL;
+    if (i >= 0 && i < vec->count) {
+        old = vec->items[i];
+        vec->items[i] = x;
+    } else {
+        err = lvec_index_error("vec-set!", i, vec->count);
+    }
+    lvec_unlock(vec);
+
+    if (err != NULL) {
+        lval_del(x);
+        lval_del(res);
+        return err;
+    }
+    lval_del(old);
+    return res;
+}
+
+lval *builtin_vec_push(UNUSED lenv *e, lval *v) {
+    LASSERT(v, v->sexpr.count >= 2,
+            "Function 'vec-push!' expects a vector and at least one value, got %d arguments",
+            v->sexpr.count);
+    LASSERT_ARG_TYPE("vec-push!", v, 0, LVAL_VEC);
+
+    lvec *vec = v->sexpr.cell[0]->vec;
+    for (int i = 1; i < v->sexpr.count; i++) {
+        LASSERT(v, !lvec_reaches(v->sexpr.cell[i], vec),
+                "Function 'vec-push!' cannot store a vector inside itself");
+    }
+    lvec_lock(vec);
+    for (int i = 1; i < v->sexpr.count; i++) {
+        lvec_push(vec, v->sexpr.cell[i]);
+    }
+    lvec_unlock(vec);
+
+    // The pushed values now belong to the vector
+    v->sexpr.count = 1;
+    return lval_take(v, 0);
+}
+
+lval *builtin_vec_pop(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("vec-pop!", v, 1);
+    LASSERT_ARG_TYPE("vec-pop!", v, 0, LVAL_VEC);
+
+    lvec *vec = v->sexpr.cell[0]->vec;
+    lvec_lock(vec);
+    lval *res = vec->count > 0 ? vec->items[--vec->count] : NULL;
+    lvec_unlock(vec);
+
+    lval_del(v);
+    if (res == NULL) {
+        return lval_error("Function 'vec-pop!' passed an empty vector");
+    }
+    return res;
+}
+
+lval *builtin_vec_len(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("vec-len", v, 1);
+    LASSERT_ARG_TYPE("vec-len", v, 0, LVAL_VEC);
+
+    lvec *vec = v->sexpr.cell[0]->vec;
+    lvec_lock(vec);
+    long count = vec->count;
+    lvec_unlock(vec);
+
+    lval_del(v);
+    return lval_int(count);
+}
+
+lval *builtin_vec_to_list(UNUSED lenv *e, lval *v) {
+    LASSERT_ARG_COUNT("vec->list", v, 1);
+    LASSERT_ARG_TYPE("vec->list", v, 0, LVAL_VEC);
+
+    lvec *vec = v->sexpr.cell[0]->vec;
+    lval *res = lval_qexpr();
+
+    lvec_lock(vec);
+    res->qexpr.count = vec->count;
+    res->qexpr.cell = lmalloc(sizeof(lval*) * vec->count);
+    for (long i = 0; i < vec->count; i++) {
+        res->qexpr.cell[i] = lval_copy(vec->items[i]);
+    }
+    lvec_unlock(vec);
+
+    lval_del(v);
+    return res;
+}
@@ -0,0 +1,35 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef struct lenv lenv;
+typedef struct lval lval;
+struct dyn_string;
+
+// A mutable array. Unlike every other value a vector is shared by
+// reference: copies of it refer to the same storage, so an update through
+// one is seen through all of them. Workers of a parallel job take `lock`
+// around every access.
+typedef struct lvec lvec;
+struct lvec {
+    int refs;
+    long count;
+    long cap;
+    lval **items;
+    pthread_mutex_t lock;
+};
+
+lvec *lvec_retain(lvec *v);
+// Taken around reading or changing items, see above
+void lvec_lock(lvec *v);
+void lvec_unlock(lvec *v);
+void lvec_release(lvec *v);
+bool lvec_eq(lvec *a, lvec *b);
+void lvec_write(struct dyn_string *out, lvec *v);
+
+lval *builtin_vec(lenv *e, lval *v);
+lval *builtin_vec_get(lenv *e, lval *v);
+lval *builtin_vec_set(lenv *e, lval *v);
+lval *builtin_vec_push(lenv *e, lval *v);
+lval *builtin_vec_pop(lenv *e, lval *v);
+lval *builtin_vec_len(lenv *e, lval *v);
+lval *builtin_vec_to_list(lenv *e, lval *v);
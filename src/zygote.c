@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "zygote.h"
+#include "pool.h"
+#include "utils.h"
+#include "interp.h"
+
+// Address space reserved for the arena, only touched as it is used
+#define ZYGOTE_ARENA ((size_t)1 << 32)
+// Freed blocks of up to this many 16-byte units are kept for reuse while
+// the zygote is being built
+#define ZYGOTE_CLASSES 64
+
+// The shared range, empty until the zygote is frozen
+char *lshared_lo = NULL;
+char *lshared_hi = NULL;
+
+// Every block starts with its size, including the 8-byte header, in
+// 16-byte units. The arena starts 8 bytes past a 16-byte boundary so that
+// block contents are aligned like malloc's.
+static char *zygote_base = NULL;
+static char *zygote_top = NULL;
+static char *zygote_end = NULL;
+static void *zygote_free[ZYGOTE_CLASSES];
+static bool zygote_frozen = false;
+static pthread_mutex_t zygote_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool lzygote_init(void) {
+    char *arena = mmap(NULL, ZYGOTE_ARENA, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        return false;
+    }
+    zygote_base = arena + 8;
+    zygote_top = zygote_base;
+    zygote_end = arena + ZYGOTE_ARENA;
+    return true;
+}
+
+static size_t zygote_block_size(void *ptr) {
+    return *(size_t *)((char *)ptr - 8);
+}
+
+static bool zygote_owns(void *ptr) {
+    return (char *)ptr >= zygote_base && (char *)ptr < zygote_end;
+}
+
+static void *zygote_take(size_t size) {
+    size_t units = (size + 8 + 15) / 16;
+    if (units < ZYGOTE_CLASSES && zygote_free[units] != NULL) {
+        void *ptr = zygote_free[units];
+        zygote_free[units] = *(void **)ptr;
+        return ptr;
+    }
+
+    if (units * 16 > (size_t)(zygote_end - zygote_top)) {
+        return NULL;
+    }
+    char *block = zygote_top;
+    zygote_top += units * 16;
+    *(size_t *)block = units;
+    return block + 8;
+}
+
+static void zygote_give(void *ptr) {
+    size_t units = zygote_block_size(ptr);
+    if (units < ZYGOTE_CLASSES) {
+        *(void **)ptr = zygote_free[units];
+        zygote_free[units] = ptr;
+    }
+}
+
+void *lzygote_alloc(UNUSED void *ud, void *ptr, size_t size) {
+    // After the fork the arena is only read. Blocks moving out of it are
+    // copied to the process' own heap.
+    if (zygote_frozen) {
+        if (ptr == NULL || !zygote_owns(ptr)) {
+            if (size == 0) {
+                free(ptr);
+                return NULL;
+            }
+            return realloc(ptr, size);
+        }
+        if (size == 0) {
+            return NULL;
+        }
+        void *res = malloc(size);
+        size_t old = zygote_block_size(ptr) * 16 - 8;
+        memcpy(res, ptr, old < size ? old : size);
+        return res;
+    }
+
+    if (ptr != NULL && !zygote_owns(ptr)) {
+        if (size == 0) {
+            free(ptr);
+            return NULL;
+        }
+        return realloc(ptr, size);
+    }
+
+    pthread_mutex_lock(&zygote_lock);
+    void *res = NULL;
+    if (size == 0) {
+        if (ptr != NULL) {
+            zygote_give(ptr);
+        }
+    } else if (ptr != NULL && zygote_block_size(ptr) * 16 - 8 >= size) {
+        res = ptr;
+    } else {
+        res = zygote_take(size);
+        if (ptr != NULL && res != NULL) {
+            memcpy(res, ptr, zygote_block_size(ptr) * 16 - 8);
+            zygote_give(ptr);
+        }
+    }
+    pthread_mutex_unlock(&zygote_lock);
+
+    // Once the arena is full the zygote carries on with malloc, whose
+    // blocks are simply not shared
+    if (res == NULL && size > 0) {
+        res = malloc(size);
+        if (ptr != NULL && res != NULL) {
+            memcpy(res, ptr, zygote_block_size(ptr) * 16 - 8);
+            pthread_mutex_lock(&zygote_lock);
+            zygote_give(ptr);
+            pthread_mutex_unlock(&zygote_lock);
+        }
+    }
+    return res;
+}
+
+static void zygote_freeze(void) {
+    zygote_frozen = true;
+    lshared_lo = zygote_base;
+    lshared_hi = zygote_top;
+}
+
+static void zygote_job(clisp *c, char *files) {
+    lpool_forget();
+
+    char *save = NULL;
+    for (char *file = strtok_r(files, " \t", &save); file != NULL;
+         file = strtok_r(NULL, " \t", &save)) {
+        if (clisp_load_file(c, file) == CLISP_EXIT) {
+            break;
+        }
+    }
+
+    // The interpreter is never freed, which would only touch shared pages
+    fflush(stdout);
+    _exit(clisp_exit_code(c));
+}
+
+static void zygote_report(pid_t pid, int status) {
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    fprintf(stderr, "%d %d\n", (int)pid, code);
+}
+
+int lzygote_run(clisp *c, const char *control) {
+    FILE *in = strcmp(control, "-") == 0 ? stdin : fopen(control, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s\n", control);
+        return 1;
+    }
+
+    clisp_flush(c);
+    fflush(stdout);
+    zygote_freeze();
+
+    char *line = NULL;
+    size_t cap = 0;
+    long running = 0;
+    while (getline(&line, &cap, in) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            zygote_job(c, line);
+        }
+        if (pid < 0) {
+            perror("fork");
+        } else {
+            running++;
+        }
+
+        int status;
+        while (running > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            zygote_report(pid, status);
+            running--;
+        }
+    }
+    free(line);
+
+    while (running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            break;
+        }
+        zygote_report(pid, status);
+        running--;
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct clisp clisp;
+
+// Pre-forking zygote. The interpreter is built once, allocating from an
+// arena, and then forked for every job, so a job starts with the warmed
+// heap shared copy-on-write. Once the zygote is frozen, memory is taken
+// from malloc instead, frees of arena blocks are ignored, and reference
+// counts of structures in the arena are left alone (see REF_SHARED), so
+// the children do not write to the shared pages.
+
+// Reserves the arena. Returns false if the address space is not available.
+bool lzygote_init(void);
+// clisp_alloc_fn for the zygote's interpreter
+void *lzygote_alloc(void *ud, void *ptr, size_t size);
+
+// Reads jobs from the control file ("-" for stdin), one per line, until it
+// is closed. A job is a list of files separated by whitespace, which a
+// child forked from c loads before exiting with the program's exit code.
+// The exit status of every job is reported on stderr as "PID CODE".
+int lzygote_run(clisp *c, const char *control);